@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2014 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* The external address is kept here so that control points asking for it,
+ * which some do every few seconds, are answered from memory. It is read
+ * from the WAN interface if one is configured, and watched for changes on
+ * a routing socket, otherwise it is whatever the PCP server last said
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <net/if.h>
+#include <net/route.h>
+
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "igdpcpd.h"
+
+int		 external_find(struct external *, struct in_addr *);
+int		 external_store(struct external *, struct in_addr *);
+void		 external_route(int, short, void *);
+
+/* Open the routing socket while still privileged */
+void
+external_setup(struct igdpcpd *env)
+{
+	struct external	*ex = &env->sc_external;
+	unsigned int	 rtfilter;
+
+	ex->fd = -1;
+
+	if (ex->ifname == NULL)
+		return;
+
+	if ((ex->fd = socket(AF_ROUTE, SOCK_RAW, AF_INET)) == -1)
+		fatal("socket");
+
+	if (fcntl(ex->fd, F_SETFL, O_NONBLOCK) == -1)
+		fatal("fcntl");
+
+	rtfilter = ROUTE_FILTER(RTM_NEWADDR) | ROUTE_FILTER(RTM_DELADDR) |
+	    ROUTE_FILTER(RTM_IFINFO);
+	if (setsockopt(ex->fd, AF_ROUTE, ROUTE_MSGFILTER, &rtfilter,
+	    sizeof(rtfilter)) == -1)
+		fatal("setsockopt");
+}
+
+/* Nothing has been announced yet, so the starting address is taken
+ * without telling anyone
+ */
+void
+external_init(struct igdpcpd *env)
+{
+	struct external	*ex = &env->sc_external;
+	struct in_addr	 address;
+
+	if (ex->fd == -1)
+		return;
+
+	ex->ev = event_new(env->sc_base, ex->fd, EV_READ|EV_PERSIST,
+	    external_route, env);
+	event_add(ex->ev, NULL);
+
+	if (external_find(ex, &address) == 0)
+		external_store(ex, &address);
+}
+
+/* Use the first IPv4 address on the WAN interface, if it has one */
+int
+external_find(struct external *ex, struct in_addr *address)
+{
+	struct ifaddrs	*ifap, *ifa;
+
+	if (getifaddrs(&ifap) == -1) {
+		log_warn("getifaddrs");
+		return (-1);
+	}
+
+	address->s_addr = INADDR_ANY;
+	for (ifa = ifap; ifa; ifa = ifa->ifa_next)
+		if (ifa->ifa_addr != NULL &&
+		    ifa->ifa_addr->sa_family == AF_INET &&
+		    !strcmp(ifa->ifa_name, ex->ifname)) {
+			*address =
+			    ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+			break;
+		}
+
+	freeifaddrs(ifap);
+
+	return (0);
+}
+
+/* Returns 1 if the address is different to before */
+int
+external_store(struct external *ex, struct in_addr *address)
+{
+	if (ex->address.s_addr == address->s_addr)
+		return (0);
+
+	ex->address = *address;
+	ex->version++;
+
+	if (address->s_addr == INADDR_ANY)
+		ex->str[0] = '\0';
+	else
+		inet_ntop(AF_INET, address, ex->str, sizeof(ex->str));
+
+	log_info("external address is %s", *ex->str ? ex->str : "unknown");
+
+	return (1);
+}
+
+/* Only address and interface messages get through the filter, and they
+ * are rare enough that the interface is just looked at again after any
+ */
+void
+external_route(int fd, short event, void *arg)
+{
+	struct igdpcpd	*env = (struct igdpcpd *)arg;
+	struct in_addr	 address;
+	char		 buf[2048];
+	int		 changed = 0;
+
+	while (read(fd, buf, sizeof(buf)) != -1)
+		changed = 1;
+
+	if (errno != EAGAIN && errno != EINTR)
+		log_warn("routing socket read");
+
+	if (changed && external_find(&env->sc_external, &address) == 0)
+		external_set(env, &address);
+}
+
+/* Record a new external address, INADDR_ANY if it isn't known */
+void
+external_set(struct igdpcpd *env, struct in_addr *address)
+{
+	if (external_store(&env->sc_external, address))
+		upnp_external_changed(env);
+}
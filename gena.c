@@ -0,0 +1,901 @@
+/*
+ * Copyright (c) 2014 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* GENA subscriptions to evented state variables. The HTTP side is in
+ * upnp.c, this keeps track of who is subscribed and for how long, and
+ * delivers the event messages. Subscriptions are found by SID in a hash
+ * table, and all of them expire off a single timer set for whichever is
+ * due first.
+ *
+ * libevent's HTTP client can't send NOTIFY, so each subscriber gets a
+ * plain bufferevent connection that is kept open between messages. Only
+ * so many requests are in flight at once, anyone else waits their turn,
+ * and a subscriber that doesn't answer holds up no one but itself
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+
+#include <event2/bufferevent.h>
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "igdpcpd.h"
+
+/* Seconds, UDA 1.1 section 4.1.1 suggests at least 1800 */
+#define	GENA_TIMEOUT_DEFAULT	 1800
+#define	GENA_TIMEOUT_MIN	 60
+#define	GENA_TIMEOUT_MAX	 86400
+
+/* Seconds to wait for a subscriber to connect or answer, UDA 1.1 allows
+ * it 30 but no one well behaved needs anywhere near that
+ */
+#define	GENA_NOTIFY_TIMEOUT	 10
+
+/* Seconds an unused connection is kept open */
+#define	GENA_IDLE_TIMEOUT	 60
+
+/* Times a message is sent again before it is given up on, waiting one
+ * second longer each time
+ */
+#define	GENA_RETRIES		 2
+
+/* Events in a row a subscriber fails to take before it is cancelled */
+#define	GENA_FAILURES		 3
+
+/* Most of a response read before it is given up on as not HTTP */
+#define	GENA_MAX_RESPONSE	 8192
+
+int		 gena_expiry_cmp(struct gena_subscription *,
+		     struct gena_subscription *);
+u_int64_t	 gena_now(void);
+struct gena_bucket	*gena_bucket(struct igdpcpd *, u_int8_t *);
+void		 gena_arm(struct igdpcpd *);
+void		 gena_expire(int, short, void *);
+void		 gena_free(struct igdpcpd *, struct gena_subscription *);
+void		 gena_moderate(int, short, void *);
+struct gena_body	*gena_body_new(struct evbuffer *);
+void		 gena_body_unref(struct gena_body *);
+void		 gena_body_cleanup(const void *, size_t, void *);
+void		 gena_queue(struct igdpcpd *, struct gena_subscription *,
+		     struct gena_body *, u_int32_t);
+int		 gena_merge(struct igdpcpd *, struct gena_subscription *,
+		     struct gena_body *, u_int32_t);
+int		 gena_failing(struct gena_delivery *);
+struct gena_delivery	*gena_delivery(struct igdpcpd *,
+			     struct gena_subscription *);
+void		 gena_kick(struct gena_delivery *);
+void		 gena_start(struct gena_delivery *);
+void		 gena_dequeue(struct igdpcpd *);
+void		 gena_read(struct bufferevent *, void *);
+void		 gena_event(struct bufferevent *, short, void *);
+int		 gena_response(struct gena_delivery *, struct evbuffer *);
+void		 gena_delivered(struct gena_delivery *);
+void		 gena_failed(struct gena_delivery *);
+void		 gena_retry(int, short, void *);
+void		 gena_finish(struct gena_delivery *);
+void		 gena_close(struct gena_delivery *);
+void		 gena_delivery_free(struct gena_delivery *);
+
+RB_GENERATE(gena_expiries, gena_subscription, expiry, gena_expiry_cmp);
+
+int
+gena_expiry_cmp(struct gena_subscription *a, struct gena_subscription *b)
+{
+	if (a->expires != b->expires)
+		return (a->expires < b->expires ? -1 : 1);
+
+	return (memcmp(a->sid, b->sid, GENA_SID_LENGTH));
+}
+
+u_int64_t
+gena_now(void)
+{
+	struct timespec	 ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		fatal("clock_gettime");
+
+	return (ts.tv_sec);
+}
+
+/* SIDs are random, so the first bytes are as good as any hash */
+struct gena_bucket *
+gena_bucket(struct igdpcpd *env, u_int8_t *sid)
+{
+	u_int32_t	 hash;
+
+	memcpy(&hash, sid, sizeof(hash));
+
+	return (&env->sc_gena.sids[hash % GENA_BUCKETS]);
+}
+
+void
+gena_init(struct igdpcpd *env)
+{
+	int	 i;
+
+	for (i = 0; i < GENA_BUCKETS; i++)
+		LIST_INIT(&env->sc_gena.sids[i]);
+
+	RB_INIT(&env->sc_gena.expiries);
+	TAILQ_INIT(&env->sc_gena.waiting);
+	if ((env->sc_gena.ev = evtimer_new(env->sc_base, gena_expire,
+	    env)) == NULL ||
+	    (env->sc_gena.moderation_ev = evtimer_new(env->sc_base,
+	    gena_moderate, env)) == NULL)
+		fatal("evtimer_new");
+}
+
+/* Set the timer for the next subscription to expire */
+void
+gena_arm(struct igdpcpd *env)
+{
+	struct gena_subscription	*gs;
+	struct timeval			 tv = { 0, 0 };
+	u_int64_t			 now;
+
+	if ((gs = RB_MIN(gena_expiries, &env->sc_gena.expiries)) == NULL) {
+		evtimer_del(env->sc_gena.ev);
+		return;
+	}
+
+	now = gena_now();
+	if (gs->expires > now)
+		tv.tv_sec = gs->expires - now;
+	evtimer_add(env->sc_gena.ev, &tv);
+}
+
+void
+gena_expire(int fd, short event, void *arg)
+{
+	struct igdpcpd			*env = (struct igdpcpd *)arg;
+	struct gena_subscription	*gs;
+	u_int64_t			 now = gena_now();
+	char				 sid[GENA_SID_STRLEN];
+
+	while ((gs = RB_MIN(gena_expiries, &env->sc_gena.expiries)) != NULL &&
+	    gs->expires <= now) {
+		gena_sid_to_string(gs->sid, sid);
+		log_debug("subscription %s expired", sid);
+		gena_free(env, gs);
+	}
+
+	gena_arm(env);
+}
+
+/* Returns NULL if there are too many subscriptions already */
+struct gena_subscription *
+gena_subscribe(struct igdpcpd *env, enum upnp_services service,
+    struct in_addr *addr, u_int16_t port, const char *path,
+    u_int32_t timeout)
+{
+	struct gena_subscription	*gs;
+	size_t				 len = strlen(path) + 1;
+	char				 sid[GENA_SID_STRLEN];
+
+	if (env->sc_gena.count >= GENA_MAXIMUM)
+		return (NULL);
+
+	if ((gs = calloc(1, sizeof(struct gena_subscription) + len)) == NULL)
+		return (NULL);
+
+	/* A version 4 UUID, RFC 4122 section 4.4 */
+	do {
+		arc4random_buf(gs->sid, sizeof(gs->sid));
+		gs->sid[6] = (gs->sid[6] & 0x0f) | 0x40;
+		gs->sid[8] = (gs->sid[8] & 0x3f) | 0x80;
+	} while (gena_find(env, gs->sid) != NULL);
+
+	gs->addr = *addr;
+	gs->port = port;
+	gs->service = service;
+	memcpy(gs->path, path, len);
+	gs->expires = gena_now() + timeout;
+
+	LIST_INSERT_HEAD(gena_bucket(env, gs->sid), gs, entry);
+	RB_INSERT(gena_expiries, &env->sc_gena.expiries, gs);
+	env->sc_gena.count++;
+
+	if (RB_MIN(gena_expiries, &env->sc_gena.expiries) == gs)
+		gena_arm(env);
+
+	gena_sid_to_string(gs->sid, sid);
+	log_debug("subscription %s to http://%s:%u%s for %us", sid,
+	    inet_ntoa(gs->addr), gs->port, gs->path, timeout);
+
+	return (gs);
+}
+
+struct gena_subscription *
+gena_find(struct igdpcpd *env, u_int8_t *sid)
+{
+	struct gena_subscription	*gs;
+
+	LIST_FOREACH(gs, gena_bucket(env, sid), entry)
+		if (memcmp(gs->sid, sid, GENA_SID_LENGTH) == 0)
+			return (gs);
+
+	return (NULL);
+}
+
+void
+gena_renew(struct igdpcpd *env, struct gena_subscription *gs,
+    u_int32_t timeout)
+{
+	RB_REMOVE(gena_expiries, &env->sc_gena.expiries, gs);
+	gs->expires = gena_now() + timeout;
+	RB_INSERT(gena_expiries, &env->sc_gena.expiries, gs);
+
+	gena_arm(env);
+}
+
+void
+gena_cancel(struct igdpcpd *env, struct gena_subscription *gs)
+{
+	gena_free(env, gs);
+	gena_arm(env);
+}
+
+void
+gena_free(struct igdpcpd *env, struct gena_subscription *gs)
+{
+	if (gs->gd != NULL)
+		gena_delivery_free(gs->gd);
+
+	LIST_REMOVE(gs, entry);
+	RB_REMOVE(gena_expiries, &env->sc_gena.expiries, gs);
+	env->sc_gena.count--;
+	free(gs);
+}
+
+/* Note variables of a service that have changed. Subscribers are told at
+ * the end of the moderation window, so however many times a variable
+ * changes in that time there is one event with the latest values
+ */
+void
+gena_changed(struct igdpcpd *env, enum upnp_services service,
+    u_int32_t mask)
+{
+	struct gena	*gena = &env->sc_gena;
+	struct timeval	 tv;
+
+	gena->dirty[service] |= mask;
+
+	if (evtimer_pending(gena->moderation_ev, NULL))
+		return;
+
+	tv.tv_sec = gena->moderation / 1000;
+	tv.tv_usec = (gena->moderation % 1000) * 1000;
+	evtimer_add(gena->moderation_ev, &tv);
+}
+
+/* The moderation window has closed */
+void
+gena_moderate(int fd, short event, void *arg)
+{
+	struct igdpcpd	*env = (struct igdpcpd *)arg;
+	struct gena	*gena = &env->sc_gena;
+	struct evbuffer	*body;
+	int		 i;
+
+	for (i = 0; i < UPNP_SERVICE_MAX; i++) {
+		if (gena->dirty[i] == 0)
+			continue;
+
+		if (gena->count > 0) {
+			body = upnp_propertyset(env, i, gena->dirty[i]);
+			gena_notify(env, i, body, gena->dirty[i]);
+			evbuffer_free(body);
+		}
+
+		/* Whether or not anyone has subscribed */
+		upnp_multicast(env, i, gena->dirty[i]);
+		gena->dirty[i] = 0;
+	}
+}
+
+/* Send an event to everyone subscribed to the service, the body is
+ * copied once and shared between them
+ */
+void
+gena_notify(struct igdpcpd *env, enum upnp_services service,
+    struct evbuffer *body, u_int32_t mask)
+{
+	struct gena_subscription	*gs;
+	struct gena_body		*gb;
+
+	gb = gena_body_new(body);
+
+	RB_FOREACH(gs, gena_expiries, &env->sc_gena.expiries)
+		if (gs->service == service)
+			gena_queue(env, gs, gb, mask);
+
+	gena_body_unref(gb);
+}
+
+/* Send an event to one subscriber */
+void
+gena_send(struct igdpcpd *env, struct gena_subscription *gs,
+    struct evbuffer *body, u_int32_t mask)
+{
+	struct gena_body	*gb;
+
+	gb = gena_body_new(body);
+	gena_queue(env, gs, gb, mask);
+	gena_body_unref(gb);
+}
+
+struct gena_body *
+gena_body_new(struct evbuffer *body)
+{
+	struct gena_body	*gb;
+	size_t			 len = evbuffer_get_length(body);
+
+	if ((gb = malloc(sizeof(struct gena_body) + len)) == NULL)
+		fatal("malloc");
+
+	gb->refs = 1;
+	gb->len = len;
+	evbuffer_copyout(body, gb->data, len);
+
+	return (gb);
+}
+
+void
+gena_body_unref(struct gena_body *gb)
+{
+	if (--gb->refs == 0)
+		free(gb);
+}
+
+/* A connection has finished with the body, or been freed before it did */
+void
+gena_body_cleanup(const void *data, size_t len, void *arg)
+{
+	gena_body_unref((struct gena_body *)arg);
+}
+
+/* Queue an event for one subscriber. Only the latest value of a variable
+ * matters, so an event still waiting to go takes this one in, leaving at
+ * most one being sent and one waiting behind it however slow the
+ * subscriber is
+ */
+void
+gena_queue(struct igdpcpd *env, struct gena_subscription *gs,
+    struct gena_body *gb, u_int32_t mask)
+{
+	struct gena_delivery	*gd;
+	struct gena_message	*gm;
+
+	if (gena_merge(env, gs, gb, mask))
+		return;
+
+	if ((gm = calloc(1, sizeof(struct gena_message))) == NULL)
+		fatal("calloc");
+
+	gm->mask = mask;
+	gm->body = gb;
+	gb->refs++;
+
+	/* Zero is only ever the initial event, UDA 1.1 section 4.2 */
+	gm->seq = gs->seq;
+	gs->seq = gs->seq == UINT32_MAX ? 1 : gs->seq + 1;
+
+	gd = gena_delivery(env, gs);
+	TAILQ_INSERT_TAIL(&gd->queue, gm, entry);
+
+	gena_kick(gd);
+}
+
+/* Returns 1 if the event was merged into one that hasn't been sent yet,
+ * which keeps its SEQ
+ */
+int
+gena_merge(struct igdpcpd *env, struct gena_subscription *gs,
+    struct gena_body *gb, u_int32_t mask)
+{
+	struct gena_delivery	*gd = gs->gd;
+	struct gena_message	*gm;
+	struct evbuffer		*body;
+
+	if (gd == NULL ||
+	    (gm = TAILQ_LAST(&gd->queue, gena_messages)) == NULL ||
+	    (gm == TAILQ_FIRST(&gd->queue) &&
+	    gd->state == GENA_STATE_SENDING))
+		return (0);
+
+	gena_body_unref(gm->body);
+
+	/* Usually the same variables have changed again */
+	if ((gm->mask & ~mask) == 0) {
+		gm->body = gb;
+		gb->refs++;
+	} else {
+		body = upnp_propertyset(env, gs->service, gm->mask | mask);
+		gm->body = gena_body_new(body);
+		evbuffer_free(body);
+	}
+	gm->mask |= mask;
+
+	return (1);
+}
+
+struct gena_delivery *
+gena_delivery(struct igdpcpd *env, struct gena_subscription *gs)
+{
+	struct gena_delivery	*gd;
+
+	if (gs->gd != NULL)
+		return (gs->gd);
+
+	if ((gd = calloc(1, sizeof(struct gena_delivery))) == NULL)
+		fatal("calloc");
+
+	if ((gd->ev = evtimer_new(env->sc_base, gena_retry, gd)) == NULL)
+		fatal("evtimer_new");
+
+	gd->env = env;
+	gd->gs = gs;
+	TAILQ_INIT(&gd->queue);
+	gs->gd = gd;
+
+	return (gd);
+}
+
+/* Send the next message if there is one and nothing else is going on.
+ * Anyone already waiting for a slot goes first
+ */
+void
+gena_kick(struct gena_delivery *gd)
+{
+	struct gena	*gena = &gd->env->sc_gena;
+
+	if (gd->state != GENA_STATE_IDLE || TAILQ_EMPTY(&gd->queue))
+		return;
+
+	if (gena->active < GENA_CONCURRENCY && TAILQ_EMPTY(&gena->waiting)) {
+		gena_start(gd);
+		return;
+	}
+
+	gd->state = GENA_STATE_WAITING;
+	TAILQ_INSERT_TAIL(&gena->waiting, gd, entry);
+}
+
+void
+gena_start(struct gena_delivery *gd)
+{
+	struct gena_subscription	*gs = gd->gs;
+	struct gena_message		*gm = TAILQ_FIRST(&gd->queue);
+	struct sockaddr_in		 sin;
+	struct evbuffer			*output;
+	struct timeval			 tv = { GENA_NOTIFY_TIMEOUT, 0 };
+	char				 sid[GENA_SID_STRLEN];
+
+	gd->env->sc_gena.active++;
+	gd->state = GENA_STATE_SENDING;
+	gd->headers = 0;
+	gd->keepalive = 1;
+	gd->status = 0;
+	gd->remaining = 0;
+
+	if (gd->bev == NULL) {
+		if ((gd->bev = bufferevent_socket_new(gd->env->sc_base, -1,
+		    BEV_OPT_CLOSE_ON_FREE)) == NULL)
+			fatal("bufferevent_socket_new");
+		bufferevent_setcb(gd->bev, gena_read, NULL, gena_event, gd);
+		bufferevent_enable(gd->bev, EV_READ|EV_WRITE);
+
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_len = sizeof(sin);
+		sin.sin_family = AF_INET;
+		sin.sin_addr = gs->addr;
+		sin.sin_port = htons(gs->port);
+
+		/* Failing straight away is no different to failing later */
+		if (bufferevent_socket_connect(gd->bev,
+		    (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+			gena_failed(gd);
+			return;
+		}
+	}
+
+	/* Covers connecting as well */
+	bufferevent_set_timeouts(gd->bev, &tv, &tv);
+
+	gena_sid_to_string(gs->sid, sid);
+
+	output = bufferevent_get_output(gd->bev);
+	evbuffer_add_printf(output, "NOTIFY %s HTTP/1.1\r\n"
+	    "HOST: %s:%u\r\n"
+	    "CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+	    "CONTENT-LENGTH: %zu\r\n"
+	    "NT: upnp:event\r\n"
+	    "NTS: upnp:propchange\r\n"
+	    "SID: %s\r\n"
+	    "SEQ: %u\r\n"
+	    "\r\n", gs->path, inet_ntoa(gs->addr), gs->port,
+	    gm->body->len, sid, gm->seq);
+
+	/* Only the headers above are per subscriber */
+	gm->body->refs++;
+	if (evbuffer_add_reference(output, gm->body->data, gm->body->len,
+	    gena_body_cleanup, gm->body) == -1)
+		fatal("evbuffer_add_reference");
+}
+
+/* Give a slot to whoever has been waiting longest */
+void
+gena_dequeue(struct igdpcpd *env)
+{
+	struct gena		*gena = &env->sc_gena;
+	struct gena_delivery	*gd;
+
+	while (gena->active < GENA_CONCURRENCY &&
+	    (gd = TAILQ_FIRST(&gena->waiting)) != NULL) {
+		TAILQ_REMOVE(&gena->waiting, gd, entry);
+		gd->state = GENA_STATE_IDLE;
+		gena_start(gd);
+	}
+}
+
+void
+gena_read(struct bufferevent *bev, void *arg)
+{
+	struct gena_delivery	*gd = (struct gena_delivery *)arg;
+	struct evbuffer		*input = bufferevent_get_input(bev);
+	size_t			 len;
+
+	/* Nothing should arrive unasked */
+	if (gd->state != GENA_STATE_SENDING) {
+		gena_close(gd);
+		if (TAILQ_EMPTY(&gd->queue) && gd->state == GENA_STATE_IDLE)
+			gena_delivery_free(gd);
+		return;
+	}
+
+	if (!gd->headers) {
+		if (evbuffer_search(input, "\r\n\r\n", 4, NULL).pos == -1) {
+			if (evbuffer_get_length(input) > GENA_MAX_RESPONSE)
+				gena_failed(gd);
+			return;
+		}
+
+		if (gena_response(gd, input) == -1) {
+			gena_failed(gd);
+			return;
+		}
+	}
+
+	len = MIN(gd->remaining, evbuffer_get_length(input));
+	evbuffer_drain(input, len);
+	gd->remaining -= len;
+
+	if (gd->remaining == 0)
+		gena_delivered(gd);
+}
+
+/* Read the status line and the headers that matter */
+int
+gena_response(struct gena_delivery *gd, struct evbuffer *input)
+{
+	const char	*errstr;
+	char		*line;
+	int		 minor, length = 0;
+
+	if ((line = evbuffer_readln(input, NULL, EVBUFFER_EOL_CRLF)) == NULL)
+		return (-1);
+
+	if (sscanf(line, "HTTP/1.%d %d", &minor, &gd->status) != 2) {
+		free(line);
+		return (-1);
+	}
+	free(line);
+
+	if (minor == 0)
+		gd->keepalive = 0;
+
+	while ((line = evbuffer_readln(input, NULL,
+	    EVBUFFER_EOL_CRLF)) != NULL && *line != '\0') {
+		if (!strncasecmp(line, "Content-Length:", 15)) {
+			gd->remaining = strtonum(line + 15 +
+			    strspn(line + 15, " \t"), 0, GENA_MAX_RESPONSE,
+			    &errstr);
+			if (errstr) {
+				free(line);
+				return (-1);
+			}
+			length = 1;
+		} else if (!strncasecmp(line, "Connection:", 11) &&
+		    strcasestr(line + 11, "close") != NULL)
+			gd->keepalive = 0;
+		free(line);
+	}
+	free(line);
+
+	/* Without a length the body runs until the connection closes, so
+	 * don't wait for it
+	 */
+	if (!length) {
+		gd->remaining = 0;
+		gd->keepalive = 0;
+	}
+
+	gd->headers = 1;
+
+	return (0);
+}
+
+void
+gena_event(struct bufferevent *bev, short events, void *arg)
+{
+	struct gena_delivery	*gd = (struct gena_delivery *)arg;
+
+	if (events & BEV_EVENT_CONNECTED)
+		return;
+
+	if (gd->state == GENA_STATE_SENDING) {
+		gena_failed(gd);
+		return;
+	}
+
+	/* An idle connection timed out or was closed */
+	gena_close(gd);
+	if (TAILQ_EMPTY(&gd->queue) && gd->state == GENA_STATE_IDLE)
+		gena_delivery_free(gd);
+}
+
+void
+gena_delivered(struct gena_delivery *gd)
+{
+	struct gena_message	*gm = TAILQ_FIRST(&gd->queue);
+	struct igdpcpd		*env = gd->env;
+	char			 sid[GENA_SID_STRLEN];
+
+	/* The subscriber doesn't know the SID, UDA 1.1 section 4.2.1 */
+	if (gd->status == HTTP_PRECONDITION_FAILED) {
+		gena_sid_to_string(gd->gs->sid, sid);
+		log_debug("subscription %s refused by subscriber", sid);
+		gena_cancel(env, gd->gs);
+		return;
+	}
+
+	if (gd->status < 200 || gd->status > 299) {
+		log_debug("event %u refused with status %d", gm->seq,
+		    gd->status);
+		if (gena_failing(gd))
+			return;
+	} else
+		gd->gs->failures = 0;
+
+	TAILQ_REMOVE(&gd->queue, gm, entry);
+	gena_body_unref(gm->body);
+	free(gm);
+	gd->tries = 0;
+
+	if (!gd->keepalive)
+		gena_close(gd);
+
+	gena_finish(gd);
+}
+
+/* Try the message again on a new connection after a while, unless it has
+ * been tried enough already
+ */
+void
+gena_failed(struct gena_delivery *gd)
+{
+	struct gena_message	*gm = TAILQ_FIRST(&gd->queue);
+	struct timeval		 tv = { 0, 0 };
+	char			 sid[GENA_SID_STRLEN];
+
+	gena_close(gd);
+
+	if (gd->tries++ < GENA_RETRIES) {
+		gd->env->sc_gena.active--;
+		gd->state = GENA_STATE_BACKOFF;
+		tv.tv_sec = gd->tries;
+		evtimer_add(gd->ev, &tv);
+		gena_dequeue(gd->env);
+		return;
+	}
+
+	gena_sid_to_string(gd->gs->sid, sid);
+	log_debug("event %u to subscription %s not delivered", gm->seq, sid);
+
+	if (gena_failing(gd))
+		return;
+
+	TAILQ_REMOVE(&gd->queue, gm, entry);
+	gena_body_unref(gm->body);
+	free(gm);
+	gd->tries = 0;
+
+	gena_finish(gd);
+}
+
+/* Returns 1 if the subscriber has now failed too often and has been
+ * cancelled, so it doesn't hold on to memory or a slot forever
+ */
+int
+gena_failing(struct gena_delivery *gd)
+{
+	char	 sid[GENA_SID_STRLEN];
+
+	if (++gd->gs->failures < GENA_FAILURES)
+		return (0);
+
+	gena_sid_to_string(gd->gs->sid, sid);
+	log_info("subscription %s cancelled after %u failed events", sid,
+	    gd->gs->failures);
+	gena_cancel(gd->env, gd->gs);
+
+	return (1);
+}
+
+void
+gena_retry(int fd, short event, void *arg)
+{
+	struct gena_delivery	*gd = (struct gena_delivery *)arg;
+
+	gd->state = GENA_STATE_IDLE;
+	gena_kick(gd);
+}
+
+/* The request is over, one way or another, which frees its slot. With
+ * nothing more to send an open connection is kept for a while in case
+ * there soon is
+ */
+void
+gena_finish(struct gena_delivery *gd)
+{
+	struct igdpcpd	*env = gd->env;
+	struct timeval	 tv = { GENA_IDLE_TIMEOUT, 0 };
+
+	env->sc_gena.active--;
+	gd->state = GENA_STATE_IDLE;
+
+	if (!TAILQ_EMPTY(&gd->queue))
+		gena_kick(gd);
+	else if (gd->bev != NULL)
+		bufferevent_set_timeouts(gd->bev, &tv, NULL);
+	else
+		gena_delivery_free(gd);
+
+	gena_dequeue(env);
+}
+
+void
+gena_close(struct gena_delivery *gd)
+{
+	if (gd->bev == NULL)
+		return;
+
+	bufferevent_free(gd->bev);
+	gd->bev = NULL;
+}
+
+void
+gena_delivery_free(struct gena_delivery *gd)
+{
+	struct igdpcpd		*env = gd->env;
+	struct gena_message	*gm;
+
+	switch (gd->state) {
+	case GENA_STATE_WAITING:
+		TAILQ_REMOVE(&env->sc_gena.waiting, gd, entry);
+		break;
+	case GENA_STATE_SENDING:
+		env->sc_gena.active--;
+		break;
+	default:
+		break;
+	}
+
+	while ((gm = TAILQ_FIRST(&gd->queue)) != NULL) {
+		TAILQ_REMOVE(&gd->queue, gm, entry);
+		gena_body_unref(gm->body);
+		free(gm);
+	}
+
+	gena_close(gd);
+	event_free(gd->ev);
+	gd->gs->gd = NULL;
+
+	if (gd->state == GENA_STATE_SENDING)
+		gena_dequeue(env);
+
+	free(gd);
+}
+
+/* Parse "uuid:" followed by a UUID in its usual form */
+int
+gena_sid_from_string(const char *str, u_int8_t *sid)
+{
+	int	 i, n, c;
+
+	if (strncasecmp(str, "uuid:", 5))
+		return (-1);
+	str += 5;
+
+	memset(sid, 0, GENA_SID_LENGTH);
+	for (i = 0, n = 0; i < 36; i++, str++) {
+		if (i == 8 || i == 13 || i == 18 || i == 23) {
+			if (*str != '-')
+				return (-1);
+			continue;
+		}
+
+		c = tolower((unsigned char)*str);
+		if (c >= '0' && c <= '9')
+			c -= '0';
+		else if (c >= 'a' && c <= 'f')
+			c -= 'a' - 10;
+		else
+			return (-1);
+
+		sid[n / 2] |= n % 2 ? c : c << 4;
+		n++;
+	}
+
+	return (*str == '\0' ? 0 : -1);
+}
+
+/* The buffer must be GENA_SID_STRLEN long */
+void
+gena_sid_to_string(u_int8_t *sid, char *str)
+{
+	snprintf(str, GENA_SID_STRLEN, "uuid:%02x%02x%02x%02x-%02x%02x-"
+	    "%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x", sid[0], sid[1],
+	    sid[2], sid[3], sid[4], sid[5], sid[6], sid[7], sid[8], sid[9],
+	    sid[10], sid[11], sid[12], sid[13], sid[14], sid[15]);
+}
+
+/* The duration granted for a TIMEOUT header, which may be missing. It
+ * asks for "Second-" and a number, or "infinite" which UDA 1.1 no longer
+ * allows, and gets it within limits
+ */
+u_int32_t
+gena_timeout(const char *str)
+{
+	const char	*errstr;
+	u_int32_t	 timeout;
+
+	if (str == NULL || strncasecmp(str, "Second-", 7))
+		return (GENA_TIMEOUT_DEFAULT);
+	str += 7;
+
+	if (!strcasecmp(str, "infinite"))
+		return (GENA_TIMEOUT_MAX);
+
+	timeout = strtonum(str, 1, UINT32_MAX, &errstr);
+	if (errstr)
+		return (GENA_TIMEOUT_DEFAULT);
+
+	return (MIN(MAX(timeout, GENA_TIMEOUT_MIN), GENA_TIMEOUT_MAX));
+}
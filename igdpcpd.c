@@ -41,8 +41,8 @@
 __dead void		 usage(void);
 void			 handle_signal(int, short, void *);
 
-struct sockaddr_in	 ssdp4, pcp4;
-struct sockaddr_in6	 ssdp6, pcp6;
+struct sockaddr_in	 ssdp4, pcp4, event4;
+struct sockaddr_in6	 ssdp6, pcp6, event6;
 struct utsname		 name;
 
 /* __dead is for lint */
@@ -58,8 +58,13 @@ usage(void)
 void
 handle_signal(int sig, short event, void *arg)
 {
+	struct igdpcpd	*env = (struct igdpcpd *)arg;
+
 	log_info("exiting on signal %d", sig);
 
+	/* Leave a single snapshot for a quick restart */
+	store_compact(env);
+
 	exit(0);
 }
 
@@ -74,6 +79,8 @@ main(int argc, char *argv[])
 	struct passwd		*pw;
 	struct igdpcpd		*env;
 	struct in6_addr		 ssdp_link_nodes = IN6ADDR_LINKLOCAL_SSDP_INIT;
+	struct in6_addr		 event_link_nodes =
+				     IN6ADDR_LINKLOCAL_EVENT_INIT;
 	struct in6_addr		 all_nodes = IN6ADDR_LINKLOCAL_ALLNODES_INIT;
 	struct ifaddrs		*ifap, *ifa, *ifal;
 	struct listen_addr	*la;
@@ -152,6 +159,18 @@ main(int argc, char *argv[])
 	ssdp6.sin6_addr = ssdp_link_nodes;
 	ssdp6.sin6_port = htons(SSDP_PORT);
 
+	memset(&event4, 0, sizeof(event4));
+	event4.sin_family = AF_INET;
+	event4.sin_len = sizeof(event4);
+	event4.sin_addr.s_addr = htonl(INADDR_EVENT_GROUP);
+	event4.sin_port = htons(EVENT_PORT);
+
+	memset(&event6, 0, sizeof(event6));
+	event6.sin6_family = AF_INET6;
+	event6.sin6_len = sizeof(event6);
+	event6.sin6_addr = event_link_nodes;
+	event6.sin6_port = htons(EVENT_PORT);
+
 	memset(&pcp4, 0, sizeof(pcp4));
 	pcp4.sin_family = AF_INET;
 	pcp4.sin_len = sizeof(pcp4);
@@ -457,6 +476,9 @@ main(int argc, char *argv[])
 
 	log_info("startup");
 
+	store_setup(pw);
+	external_setup(env);
+
 	if (chroot(pw->pw_dir) == -1)
 		fatal("chroot");
 	if (chdir("/") == -1)
@@ -491,6 +513,8 @@ main(int argc, char *argv[])
 	}
 
 	env->sc_httpd = evhttp_new(env->sc_base);
+	evhttp_set_allowed_methods(env->sc_httpd, EVHTTP_REQ_GET |
+	    EVHTTP_REQ_HEAD | EVHTTP_REQ_POST | GENA_REQ_UNKNOWN);
 
 	for (la = TAILQ_FIRST(&env->listen_addrs); la; ) {
 		la->ev = event_new(env->sc_base, la->fd, EV_READ|EV_PERSIST,
@@ -502,8 +526,14 @@ main(int argc, char *argv[])
 		la = TAILQ_NEXT(la, entry);
 	}
 
-	env->sc_root = upnp_root_device(env->sc_version,
-	    UPNP_DEVICE_INTERNET_GATEWAY_DEVICE, env->sc_httpd);
+	mapping_init(env);
+	gena_init(env);
+	store_load(env);
+	pcp_init(env);
+	external_init(env);
+
+	env->sc_root = upnp_root_device(env,
+	    UPNP_DEVICE_INTERNET_GATEWAY_DEVICE);
 
 	/* FIXME DEBUG */
 	evhttp_set_gencb(env->sc_httpd, upnp_debug, env);
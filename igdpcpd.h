@@ -20,6 +20,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <netinet/in.h>
 
 #include <event2/event.h>
 #include <event2/buffer.h>
@@ -62,7 +65,6 @@
 #define	PCP_SERVER_PORT			 5351
 #define	EVENT_PORT			 7900
 
-#if 0
 #define	PCP_MIN_VERSION			 2
 #define	PCP_MAX_VERSION			 2
 
@@ -91,14 +93,37 @@
 
 #define	PCP_MAX_REMOTE_PEERS		 10
 
+/* NAT-PMP, RFC 6886, spoken to servers that don't know PCP */
+#define	NATPMP_MAX_VERSION		 0
+
+#define	NATPMP_SUCCESS			 0
+#define	NATPMP_UNSUPP_VERSION		 1
+#define	NATPMP_NOT_AUTHORISED		 2
+#define	NATPMP_NETWORK_FAILURE		 3
+#define	NATPMP_NO_RESOURCES		 4
+#define	NATPMP_UNSUPP_OPCODE		 5
+
+#define	NATPMP_OPCODE_ADDRESS		 0
+#define	NATPMP_OPCODE_MAP_UDP		 1
+#define	NATPMP_OPCODE_MAP_TCP		 2
+#define	NATPMP_OPCODE_RESPONSE		 0x80
+
+#define	NATPMP_MAX_PACKET_SIZE		 16
+
 #define	PCP_OPCODE_ANNOUNCE		 0
 #define	PCP_OPCODE_MAP			 1
 #define	PCP_OPCODE_PEER			 2
+#define	PCP_OPCODE_RESPONSE		 0x80	/* R bit */
 
 #define	PCP_OPTION_THIRD_PARTY		 1
 #define	PCP_OPTION_PREFER_FAILURE	 2
 #define	PCP_OPTION_FILTER		 3
 
+/* Retransmission, RFC 6887 section 8.1.1 */
+#define	PCP_IRT				 3	/* Seconds */
+#define	PCP_MRT				 1024
+
+#if 0
 #define	NATPMPD_MAX_DELAY		 10
 
 #define	NATPMPD_MAX_VERSION \
@@ -115,9 +140,25 @@
 #define	UPNP_VERSION_STRING \
 	(UPNP_STRING(UPNP_VERSION_MAJOR) "." UPNP_STRING(UPNP_VERSION_MINOR))
 
+/* Zero is never an atom */
+#define	URN_ATOM_NONE		 0
+
 struct urn {
-	char	*nid;		/* Namespace Identifier */
-	char	*nss;		/* Namespace Specific String */
+	char		*nid;		/* Namespace Identifier */
+	char		*nss;		/* Namespace Specific String */
+	u_int32_t	 atom;		/* Of the NID */
+};
+
+/* Longest NSS that is decoded on the stack */
+#define	URN_VIEW_MAX		 256
+
+/* A URN parsed where it lies, nothing is copied or allocated */
+struct urn_view {
+	const char	*nid;
+	size_t		 nid_len;
+	const char	*nss;		/* Still %-encoded */
+	size_t		 nss_len;
+	u_int32_t	 atom;		/* Of the NID */
 };
 
 enum upnp_types {
@@ -147,29 +188,49 @@ struct upnp_nss {
 	unsigned int	 version;
 };
 
+struct upnp_nss_view {
+	enum upnp_types	 type;
+	const char	*name;
+	size_t		 name_len;
+	unsigned int	 version;
+};
+
 struct ssdp_device {
 	TAILQ_ENTRY(ssdp_device)	 entry;
 	char				*uuid;
 	struct urn			*urn;
 	struct upnp_nss			*nss;
+	u_int32_t			 type;		/* Atom of the URN */
+	u_int8_t			 device;	/* enum upnp_devices */
 };
 
 TAILQ_HEAD(ssdp_devices, ssdp_device);
 
+/* Description documents are filled in from the generated templates once,
+ * at startup, and the same bytes are handed to every GET
+ */
+struct upnp_description {
+	char		*xml;
+	size_t		 len;
+};
+
 struct ssdp_service {
 	TAILQ_ENTRY(ssdp_service)	 entry;
 	struct ssdp_device		*parent;
 	struct urn			*urn;
 	struct upnp_nss			*nss;
-	xmlDocPtr			 document;
+	u_int32_t			 type;		/* Atom of the URN */
+	u_int8_t			 service;	/* enum upnp_services */
+	struct upnp_description		 description;	/* SCPD */
+	u_int32_t			 seq;		/* Multicast events */
 };
 
 TAILQ_HEAD(ssdp_services, ssdp_service);
 
 struct ssdp_root {
-	struct ssdp_devices	 devices;
-	struct ssdp_services	 services;
-	xmlDocPtr		 document;
+	struct ssdp_devices		 devices;
+	struct ssdp_services		 services;
+	struct upnp_description		 description;
 };
 
 #if 0
@@ -179,6 +240,300 @@ struct address {
 };
 #endif
 
+enum mapping_protocols {
+	MAPPING_PROTOCOL_TCP = 0,
+	MAPPING_PROTOCOL_UDP,
+	MAPPING_PROTOCOL_MAX,
+};
+
+struct mapping {
+	RB_ENTRY(mapping)	 entry;		/* By protocol */
+	RB_ENTRY(mapping)	 client_entry;	/* By internal client */
+	struct igdpcpd		*env;
+	struct mapping_client	*mc;
+	struct event		*ev;
+	enum mapping_protocols	 protocol;
+	u_int16_t		 eport;
+	struct in_addr		 remote;	/* INADDR_ANY is wildcard */
+	u_int16_t		 iport;
+	struct in_addr		 client;
+	u_int8_t		 enabled;
+	u_int32_t		 lease;		/* Requested duration */
+	time_t			 expires;
+	char			*description;
+	u_int8_t		 nonce[PCP_NONCE_LENGTH];
+	struct pcp_request	*pcp;		/* Upstream, if any */
+};
+
+RB_HEAD(mapping_tree, mapping);
+RB_PROTOTYPE(mapping_tree, mapping, entry, mapping_cmp);
+RB_HEAD(mapping_client_tree, mapping);
+RB_PROTOTYPE(mapping_client_tree, mapping, client_entry, mapping_cmp);
+
+/* Mappings belonging to a single internal client */
+struct mapping_client {
+	RB_ENTRY(mapping_client)	 entry;
+	struct in_addr			 addr;
+	struct mapping_client_tree	 tree[MAPPING_PROTOCOL_MAX];
+	u_int32_t			 count;
+	u_int32_t			 refused;	/* Over quota */
+};
+
+RB_HEAD(mapping_clients, mapping_client);
+RB_PROTOTYPE(mapping_clients, mapping_client, entry, mapping_client_cmp);
+
+#define	MAPPING_PORT_WORDS	 (65536 / 64)
+
+/* Free external ports, with a summary bit set for each word of the
+ * bitmap that still has a free port
+ */
+struct mapping_bitmap {
+	u_int64_t		 free[MAPPING_PORT_WORDS];
+	u_int64_t		 summary[MAPPING_PORT_WORDS / 64];
+};
+
+struct mapping_stats {
+	u_int64_t		 client_refused;	/* Over client quota */
+	u_int64_t		 table_refused;		/* Over global quota */
+};
+
+struct mapping_table {
+	struct mapping_tree	 tree[MAPPING_PROTOCOL_MAX];
+	struct mapping_clients	 clients;
+	struct mapping_bitmap	 bitmap[MAPPING_PROTOCOL_MAX];
+	u_int64_t		 permit[MAPPING_PORT_WORDS];
+	u_int32_t		 count;
+	u_int32_t		 updateid;
+	u_int32_t		 maximum;	/* Zero is unlimited */
+	u_int32_t		 client_maximum;
+	struct mapping_stats	 stats;
+};
+
+/* PCP wire format, RFC 6887 */
+struct pcp_common_request {
+	u_int8_t		 version;
+	u_int8_t		 opcode;
+	u_int16_t		 reserved;
+	u_int32_t		 lifetime;
+	struct in6_addr		 client;
+};
+
+struct pcp_common_response {
+	u_int8_t		 version;
+	u_int8_t		 opcode;
+	u_int8_t		 reserved;
+	u_int8_t		 result;
+	u_int32_t		 lifetime;
+	u_int32_t		 epoch;
+	u_int32_t		 reserved2[3];
+};
+
+struct pcp_map {
+	u_int8_t		 nonce[PCP_NONCE_LENGTH];
+	u_int8_t		 protocol;
+	u_int8_t		 reserved[3];
+	u_int16_t		 iport;
+	u_int16_t		 eport;
+	struct in6_addr		 external;
+};
+
+struct pcp_peer {
+	u_int8_t		 nonce[PCP_NONCE_LENGTH];
+	u_int8_t		 protocol;
+	u_int8_t		 reserved[3];
+	u_int16_t		 iport;
+	u_int16_t		 eport;
+	struct in6_addr		 external;
+	u_int16_t		 rport;
+	u_int16_t		 reserved2;
+	struct in6_addr		 remote;
+};
+
+struct pcp_option {
+	u_int8_t		 code;
+	u_int8_t		 reserved;
+	u_int16_t		 length;
+};
+
+struct pcp_filter {
+	u_int8_t		 reserved;
+	u_int8_t		 prefix;
+	u_int16_t		 port;
+	struct in6_addr		 remote;
+};
+
+/* NAT-PMP wire format, RFC 6886 */
+struct natpmp_request {
+	u_int8_t		 version;
+	u_int8_t		 opcode;
+	u_int16_t		 reserved;	/* MAP only */
+	u_int16_t		 iport;
+	u_int16_t		 eport;
+	u_int32_t		 lifetime;
+};
+
+/* An error may be just the first eight bytes */
+struct natpmp_response {
+	u_int8_t		 version;
+	u_int8_t		 opcode;
+	u_int16_t		 result;
+	u_int32_t		 epoch;
+	union {
+		struct in_addr	 external;	/* ADDRESS */
+		struct {
+			u_int16_t	 iport;
+			u_int16_t	 eport;
+			u_int32_t	 lifetime;
+		} map;
+	};
+};
+
+/* Where things are in a validated packet, pointing into its buffer */
+struct pcp_packet {
+	u_int8_t			 opcode;	/* Without the R bit */
+	struct pcp_common_request	*request;	/* One or the other */
+	struct pcp_common_response	*response;
+	struct pcp_map			*map;		/* If opcode is MAP */
+	struct pcp_peer			*peer;		/* If opcode is PEER */
+	struct in6_addr			*third_party;
+	u_int8_t			 prefer_failure;
+	struct pcp_filter		*filter;	/* The first */
+	u_int8_t			 filters;
+};
+
+TAILQ_HEAD(pcp_requests, pcp_request);
+
+enum pcp_health {
+	PCP_SERVER_UP = 0,		/* Or not yet tried */
+	PCP_SERVER_DOWN,		/* Probed until it answers */
+};
+
+/* Upstream PCP server */
+struct pcp_server {
+	TAILQ_ENTRY(pcp_server)	 entry;
+	struct igdpcpd		*env;
+	struct sockaddr_storage	 sa;
+	struct in6_addr		 client;	/* Our address as it sees it */
+	int			 fd;
+	struct event		*ev;
+	struct pcp_requests	 queue;		/* Waiting for the window */
+	u_int32_t		 inflight;
+	u_int32_t		 window;
+	u_int32_t		 acks;		/* Since the window grew */
+	u_int32_t		 srtt;		/* Milliseconds */
+	u_int32_t		 base_rtt;	/* Lowest seen */
+	u_int8_t		 epoch_seen;
+	u_int32_t		 prev_server;	/* Epoch, seconds */
+	u_int64_t		 prev_client;
+	struct event		*resync_ev;
+	int			 resync;	/* Protocol being resynced */
+	u_int16_t		 resync_eport;	/* Resume point */
+	struct in_addr		 resync_remote;
+	u_int8_t		 resync_resume;
+	enum pcp_health		 health;
+	struct event		*probe_ev;
+	u_int8_t		 version;	/* PCP, or NAT-PMP */
+	u_int8_t		 answered;	/* Ever, in either */
+	struct in_addr		 external;	/* NAT-PMP only */
+};
+
+TAILQ_HEAD(pcp_servers, pcp_server);
+
+enum pcp_states {
+	PCP_STATE_REQUESTING = 0,	/* Waiting for the first response */
+	PCP_STATE_MAPPED,
+	PCP_STATE_RENEWING,
+	PCP_STATE_FAILED,
+	PCP_STATE_RELEASING,		/* Freed once the server confirms */
+};
+
+/* A MAP request and, once granted, the upstream mapping it created */
+struct pcp_request {
+	TAILQ_ENTRY(pcp_request) entry;		/* Outstanding or queued */
+	struct igdpcpd		*env;
+	struct pcp_server	*server;
+	struct mapping		*m;		/* NULL once released */
+	struct event		*ev;		/* Retransmit */
+	enum pcp_states		 state;
+	u_int8_t		 nonce[PCP_NONCE_LENGTH];
+	u_int8_t		 opcode;
+	u_int8_t		 protocol;	/* IANA protocol number */
+	u_int8_t		 prefer_failure;
+	u_int16_t		 iport;
+	u_int16_t		 eport;		/* Suggested, then assigned */
+	struct in_addr		 client;
+	struct in_addr		 remote;
+	u_int16_t		 rport;		/* PEER only */
+	struct in_addr		 external;	/* Assigned */
+	u_int32_t		 lifetime;	/* Requested */
+	u_int32_t		 granted;
+	int			 result;	/* -1 if there was no response */
+	u_int32_t		 rt;		/* Milliseconds */
+	u_int32_t		 elapsed;
+	u_int32_t		 duration;	/* Seconds, zero is forever */
+	void			(*cb)(struct pcp_request *, void *);
+	void			*arg;
+	u_int8_t		 queued;
+	u_int64_t		 sent;		/* Milliseconds, monotonic */
+	TAILQ_ENTRY(pcp_request) renew_entry;
+	struct pcp_renewal	*renewal;	/* Once mapped, if renewing */
+	u_int8_t		 retries;	/* Refusals in a row */
+};
+
+/* Mappings due for renewal at about the same time, renewed together */
+struct pcp_renewal {
+	RB_ENTRY(pcp_renewal)	 entry;
+	u_int64_t		 due;		/* Seconds, monotonic */
+	TAILQ_HEAD(, pcp_request) requests;
+};
+
+RB_HEAD(pcp_renewals, pcp_renewal);
+RB_PROTOTYPE(pcp_renewals, pcp_renewal, entry, pcp_renewal_cmp);
+
+/* A remote host whose flows are kept alive with PEER rather than opened
+ * with MAP, as UPnP has no way to give the remote port
+ */
+struct pcp_remote {
+	TAILQ_ENTRY(pcp_remote)	 entry;
+	struct in_addr		 addr;
+	u_int16_t		 port;
+};
+
+TAILQ_HEAD(pcp_remotes, pcp_remote);
+
+#define	PCP_REQUEST_BUCKETS	 256
+#define	PCP_WINDOW		 16
+
+struct pcp_client {
+	struct pcp_servers	 servers;
+	struct pcp_remotes	 remotes;
+	struct pcp_requests	 outstanding[PCP_REQUEST_BUCKETS];
+	u_int32_t		 window;	/* Most in flight per server */
+	int			 fd4;		/* ANNOUNCE */
+	int			 fd6;
+	struct event		*ev4;
+	struct event		*ev6;
+	struct pcp_renewals	 renewals;
+	struct event		*renew_ev;	/* Earliest renewal */
+};
+
+/* Persistent copy of the mapping table */
+struct store {
+	int			 fd;		/* Journal, -1 if not persisting */
+	struct event		*ev;
+	u_int32_t		 records;	/* In the journal */
+};
+
+/* The address mappings are reached on, as control points are told */
+struct external {
+	char			*ifname;	/* NULL to learn from PCP */
+	int			 fd;		/* Routing socket */
+	struct event		*ev;
+	struct in_addr		 address;	/* INADDR_ANY if unknown */
+	char			 str[INET_ADDRSTRLEN];
+	u_int32_t		 version;	/* Bumped on every change */
+};
+
 struct listen_addr {
 	TAILQ_ENTRY(listen_addr)	 entry;
 	struct sockaddr_storage		 sa;
@@ -200,6 +555,101 @@ struct ntp_addr_wrap {
 	u_int8_t		 pool;
 };
 
+/* GENA eventing, UPnP Device Architecture 1.1 section 4 */
+#define	GENA_SID_LENGTH		 16
+#define	GENA_SID_STRLEN		 42	/* "uuid:" + 36 + '\0' */
+#define	GENA_BUCKETS		 256
+#define	GENA_MAXIMUM		 4096	/* Subscriptions, all services */
+#define	GENA_CONCURRENCY	 32	/* NOTIFY requests in flight */
+#define	GENA_MODERATION		 200	/* Milliseconds between events */
+
+/* What libevent makes of SUBSCRIBE and UNSUBSCRIBE, as it has no names
+ * for methods it doesn't know
+ */
+#define	GENA_REQ_UNKNOWN	 (1 << 15)
+
+/* libevent has no name for it */
+#define	HTTP_PRECONDITION_FAILED 412
+
+/* A rendered propertyset, shared by every message that carries it and
+ * by the connections still writing it out
+ */
+struct gena_body {
+	u_int32_t			 refs;
+	size_t				 len;
+	char				 data[];
+};
+
+/* An event message waiting to be sent to a subscriber */
+struct gena_message {
+	TAILQ_ENTRY(gena_message)	 entry;
+	u_int32_t			 seq;
+	u_int32_t			 mask;		/* Variables carried */
+	struct gena_body		*body;
+};
+
+TAILQ_HEAD(gena_messages, gena_message);
+
+enum gena_states {
+	GENA_STATE_IDLE = 0,		/* The connection may still be open */
+	GENA_STATE_WAITING,		/* For a free slot */
+	GENA_STATE_SENDING,		/* Until the response is read */
+	GENA_STATE_BACKOFF,		/* After a failure */
+};
+
+/* Sending to a subscriber, only there while there is something to send
+ * or a connection is kept open
+ */
+struct gena_delivery {
+	TAILQ_ENTRY(gena_delivery)	 entry;		/* Waiting */
+	struct igdpcpd			*env;
+	struct gena_subscription	*gs;
+	struct bufferevent		*bev;
+	struct event			*ev;		/* Backoff */
+	struct gena_messages		 queue;
+	enum gena_states		 state;
+	u_int8_t			 tries;		/* Of the first message */
+	u_int8_t			 headers;	/* Of the response, read */
+	u_int8_t			 keepalive;
+	int				 status;
+	size_t				 remaining;	/* Of the response body */
+};
+
+TAILQ_HEAD(gena_deliveries, gena_delivery);
+
+/* Kept small, there can be thousands. The callback path is allocated
+ * along with the rest
+ */
+struct gena_subscription {
+	LIST_ENTRY(gena_subscription)	 entry;		/* By SID */
+	RB_ENTRY(gena_subscription)	 expiry;
+	u_int64_t			 expires;	/* Seconds, monotonic */
+	u_int8_t			 sid[GENA_SID_LENGTH];
+	u_int32_t			 seq;		/* Next to send */
+	struct in_addr			 addr;		/* Callback */
+	u_int16_t			 port;
+	u_int8_t			 service;	/* enum upnp_services */
+	u_int8_t			 failures;	/* Events in a row */
+	struct gena_delivery		*gd;
+	char				 path[];
+};
+
+LIST_HEAD(gena_bucket, gena_subscription);
+RB_HEAD(gena_expiries, gena_subscription);
+RB_PROTOTYPE(gena_expiries, gena_subscription, expiry, gena_expiry_cmp);
+
+struct gena {
+	struct gena_bucket	 sids[GENA_BUCKETS];
+	struct gena_expiries	 expiries;	/* Soonest first */
+	struct event		*ev;
+	u_int32_t		 count;
+	struct gena_deliveries	 waiting;	/* For a free slot */
+	u_int32_t		 active;	/* NOTIFY requests in flight */
+	u_int32_t		 dirty[UPNP_SERVICE_MAX]; /* Variable bits */
+	u_int32_t		 moderation;	/* Milliseconds */
+	struct event		*moderation_ev;
+};
+
 struct igdpcpd {
 	struct event_base	*sc_base;
 	u_int8_t		 sc_flags;
@@ -219,6 +669,11 @@ struct igdpcpd {
 	struct event		*sc_announce_ev;
 	struct evhttp		*sc_httpd;
 	struct ssdp_root	*sc_root;
+	struct mapping_table	 sc_mappings;
+	struct store		 sc_store;
+	struct pcp_client	 sc_pcp;
+	struct external		 sc_external;
+	struct gena		 sc_gena;
 };
 
 /* prototypes */
@@ -239,20 +694,116 @@ int			 host(const char *, struct ntp_addr **);
 int			 host_dns(const char *, struct ntp_addr **);
 
 /* urn.c */
+ssize_t			 urn_encode(const char *, size_t, char *, size_t);
+ssize_t			 urn_decode(const char *, size_t, char *, size_t);
 char			*urn_to_string(struct urn *);
 struct urn		*urn_from_string(char *);
 void			 urn_free(struct urn *);
+int			 urn_view_from_string(const char *, size_t,
+			     struct urn_view *);
+const char		*urn_view_nss(struct urn_view *, char *, size_t,
+			     size_t *);
+u_int32_t		 urn_intern(const char *);
+u_int32_t		 urn_atom(const char *, size_t);
+const char		*urn_atom_string(u_int32_t);
+
+/* mapping.c */
+extern const char	*mapping_protocol[MAPPING_PROTOCOL_MAX];
+void			 mapping_init(struct igdpcpd *);
+struct mapping		*mapping_new(struct igdpcpd *);
+void			 mapping_free(struct mapping *);
+int			 mapping_add(struct mapping *);
+int			 mapping_move(struct mapping *, u_int16_t);
+void			 mapping_delete(struct mapping *);
+void			 mapping_refresh(struct mapping *, u_int32_t);
+void			 mapping_schedule(struct mapping *, u_int32_t);
+struct mapping		*mapping_find(struct igdpcpd *, enum mapping_protocols,
+			     u_int16_t, struct in_addr *);
+struct mapping		*mapping_range(struct igdpcpd *, enum mapping_protocols,
+			     struct in_addr *, u_int16_t, struct in_addr *);
+struct mapping		*mapping_range_next(struct mapping *, int);
+u_int32_t		 mapping_remaining(struct mapping *);
+void			 mapping_permit(struct mapping_table *, u_int16_t,
+			     u_int16_t);
+int			 mapping_permitted(struct igdpcpd *, u_int16_t);
+u_int16_t		 mapping_allocate(struct igdpcpd *,
+			     enum mapping_protocols, u_int16_t);
+int			 mapping_admit(struct igdpcpd *, struct in_addr *);
+
+/* store.c */
+struct passwd;
+void			 store_setup(struct passwd *);
+void			 store_load(struct igdpcpd *);
+void			 store_update(struct mapping *);
+void			 store_delete(struct mapping *);
+void			 store_compact(struct igdpcpd *);
+
+/* external.c */
+void			 external_setup(struct igdpcpd *);
+void			 external_init(struct igdpcpd *);
+void			 external_set(struct igdpcpd *, struct in_addr *);
+
+/* gena.c */
+void			 gena_init(struct igdpcpd *);
+struct gena_subscription	*gena_subscribe(struct igdpcpd *,
+				     enum upnp_services, struct in_addr *,
+				     u_int16_t, const char *, u_int32_t);
+struct gena_subscription	*gena_find(struct igdpcpd *, u_int8_t *);
+void			 gena_renew(struct igdpcpd *,
+			     struct gena_subscription *, u_int32_t);
+void			 gena_cancel(struct igdpcpd *,
+			     struct gena_subscription *);
+void			 gena_changed(struct igdpcpd *, enum upnp_services,
+			     u_int32_t);
+void			 gena_notify(struct igdpcpd *, enum upnp_services,
+			     struct evbuffer *, u_int32_t);
+void			 gena_send(struct igdpcpd *, struct gena_subscription *,
+			     struct evbuffer *, u_int32_t);
+int			 gena_sid_from_string(const char *, u_int8_t *);
+void			 gena_sid_to_string(u_int8_t *, char *);
+u_int32_t		 gena_timeout(const char *);
+
+/* pcpwire.c */
+int			 pcp_decode(u_int8_t *, size_t, int,
+			     struct pcp_packet *);
+size_t			 pcp_header(u_int8_t *, u_int8_t, u_int32_t,
+			     struct in6_addr *);
+size_t			 pcp_option(u_int8_t *, size_t, u_int8_t,
+			     const void *, u_int16_t);
+int			 natpmp_decode(u_int8_t *, size_t,
+			     struct natpmp_response **);
+size_t			 natpmp_request(u_int8_t *, u_int8_t, u_int16_t,
+			     u_int16_t, u_int32_t);
+
+/* pcp.c */
+void			 pcp_init(struct igdpcpd *);
+int			 pcp_enabled(struct igdpcpd *);
+int			 pcp_map(struct mapping *, int, u_int32_t,
+			     void (*)(struct pcp_request *, void *), void *);
+void			 pcp_refresh(struct mapping *);
+void			 pcp_unmap(struct mapping *);
 
 /* ssdp.c */
 void			 ssdp_announce(int, short, void *);
 void			 ssdp_recvmsg(int, short, void *);
+void			 ssdp_update(struct igdpcpd *);
+void			 ssdp_event(struct igdpcpd *, struct ssdp_service *,
+			     const char *, struct evbuffer *);
 
 /* upnp.c */
 char			*upnp_nss_to_string(struct upnp_nss *);
 struct upnp_nss		*upnp_nss_from_string(char *);
 void			 upnp_nss_free(struct upnp_nss *);
-struct ssdp_root	*upnp_root_device(u_int32_t, enum upnp_devices,
-			     struct evhttp *);
+int			 upnp_nss_view_from_string(const char *, size_t,
+			     struct upnp_nss_view *);
+int			 upnp_type_find(struct upnp_nss_view *);
+struct ssdp_root	*upnp_root_device(struct igdpcpd *, enum upnp_devices);
 void			 upnp_debug(struct evhttp_request *, void *);
+struct evbuffer		*upnp_propertyset(struct igdpcpd *, enum upnp_services,
+			     u_int32_t);
+void			 upnp_multicast(struct igdpcpd *, enum upnp_services,
+			     u_int32_t);
+void			 upnp_external_changed(struct igdpcpd *);
+void			 upnp_mappings_changed(struct igdpcpd *);
 
 #endif
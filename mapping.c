@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2014 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/tree.h>
+
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "igdpcpd.h"
+
+int		 mapping_cmp(struct mapping *, struct mapping *);
+int		 mapping_client_cmp(struct mapping_client *,
+		     struct mapping_client *);
+struct mapping_client	*mapping_client_find(struct igdpcpd *,
+			     struct in_addr *);
+time_t		 mapping_now(void);
+void		 mapping_port_set(struct mapping_bitmap *, u_int16_t);
+void		 mapping_port_clear(struct mapping_bitmap *, u_int16_t);
+int		 mapping_port_used(struct igdpcpd *, enum mapping_protocols,
+		     u_int16_t);
+void		 mapping_expire(int, short, void *);
+
+/* Used for parsing and generating PortMappingProtocol values */
+const char	*mapping_protocol[MAPPING_PROTOCOL_MAX] = {
+	"TCP",
+	"UDP",
+};
+
+RB_GENERATE(mapping_tree, mapping, entry, mapping_cmp);
+RB_GENERATE(mapping_client_tree, mapping, client_entry, mapping_cmp);
+RB_GENERATE(mapping_clients, mapping_client, entry, mapping_client_cmp);
+
+/* Each protocol has its own trees, so order mappings by external port
+ * then remote host so a range of external ports is contiguous
+ */
+int
+mapping_cmp(struct mapping *a, struct mapping *b)
+{
+	if (a->eport != b->eport)
+		return (a->eport < b->eport ? -1 : 1);
+	if (a->remote.s_addr != b->remote.s_addr)
+		return (ntohl(a->remote.s_addr) < ntohl(b->remote.s_addr) ?
+		    -1 : 1);
+
+	return (0);
+}
+
+int
+mapping_client_cmp(struct mapping_client *a, struct mapping_client *b)
+{
+	if (a->addr.s_addr != b->addr.s_addr)
+		return (ntohl(a->addr.s_addr) < ntohl(b->addr.s_addr) ?
+		    -1 : 1);
+
+	return (0);
+}
+
+/* Find the index of mappings for an internal client */
+struct mapping_client *
+mapping_client_find(struct igdpcpd *env, struct in_addr *addr)
+{
+	struct mapping_client	 key;
+
+	key.addr = *addr;
+
+	return (RB_FIND(mapping_clients, &env->sc_mappings.clients, &key));
+}
+
+/* Seconds on a clock that doesn't jump */
+time_t
+mapping_now(void)
+{
+	struct timespec	 ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		fatal("clock_gettime");
+
+	return (ts.tv_sec);
+}
+
+/* Mark a port as free */
+void
+mapping_port_set(struct mapping_bitmap *bitmap, u_int16_t port)
+{
+	bitmap->free[port / 64] |= 1ULL << (port % 64);
+	bitmap->summary[port / 4096] |= 1ULL << ((port / 64) % 64);
+}
+
+/* Mark a port as used */
+void
+mapping_port_clear(struct mapping_bitmap *bitmap, u_int16_t port)
+{
+	bitmap->free[port / 64] &= ~(1ULL << (port % 64));
+	if (bitmap->free[port / 64] == 0)
+		bitmap->summary[port / 4096] &= ~(1ULL << ((port / 64) % 64));
+}
+
+/* Whether any mapping, for any remote host, uses the external port */
+int
+mapping_port_used(struct igdpcpd *env, enum mapping_protocols protocol,
+    u_int16_t eport)
+{
+	struct mapping	 key, *m;
+
+	key.eport = eport;
+	key.remote.s_addr = INADDR_ANY;
+
+	m = RB_NFIND(mapping_tree, &env->sc_mappings.tree[protocol], &key);
+
+	return (m != NULL && m->eport == eport);
+}
+
+/* Permit external ports lo to hi inclusive to be mapped */
+void
+mapping_permit(struct mapping_table *table, u_int16_t lo, u_int16_t hi)
+{
+	unsigned int	 port;
+
+	for (port = lo; port <= hi; port++)
+		table->permit[port / 64] |= 1ULL << (port % 64);
+}
+
+int
+mapping_permitted(struct igdpcpd *env, u_int16_t port)
+{
+	return ((env->sc_mappings.permit[port / 64] >> (port % 64)) & 1);
+}
+
+void
+mapping_init(struct igdpcpd *env)
+{
+	struct mapping_table	*table = &env->sc_mappings;
+	int			 i, j;
+
+	for (i = 0; i < MAPPING_PROTOCOL_MAX; i++)
+		RB_INIT(&table->tree[i]);
+	RB_INIT(&table->clients);
+	table->count = 0;
+	table->updateid = 0;
+
+	/* Without any configured ranges, permit every port but zero */
+	for (j = 0; j < MAPPING_PORT_WORDS; j++)
+		if (table->permit[j])
+			break;
+	if (j == MAPPING_PORT_WORDS)
+		mapping_permit(table, 1, USHRT_MAX);
+
+	/* Every permitted port starts off free */
+	for (i = 0; i < MAPPING_PROTOCOL_MAX; i++) {
+		memset(&table->bitmap[i], 0, sizeof(struct mapping_bitmap));
+		for (j = 0; j < MAPPING_PORT_WORDS; j++) {
+			table->bitmap[i].free[j] = table->permit[j];
+			if (table->permit[j])
+				table->bitmap[i].summary[j / 64] |=
+				    1ULL << (j % 64);
+		}
+	}
+}
+
+/* Find a free permitted external port, starting at the requested port and
+ * working upwards before wrapping around. Returns zero if there are none
+ */
+u_int16_t
+mapping_allocate(struct igdpcpd *env, enum mapping_protocols protocol,
+    u_int16_t port)
+{
+	struct mapping_bitmap	*bitmap = &env->sc_mappings.bitmap[protocol];
+	u_int64_t		 bits;
+	unsigned int		 word, i, s;
+
+	/* Rest of the word holding the requested port */
+	word = port / 64;
+	bits = bitmap->free[word] & (~0ULL << (port % 64));
+	if (bits)
+		return (word * 64 + __builtin_ctzll(bits));
+
+	/* Use the summary to skip straight to a word with a free port */
+	s = word / 64;
+	bits = bitmap->summary[s] & ((~0ULL << (word % 64)) << 1);
+	for (i = 0; i <= MAPPING_PORT_WORDS / 64; i++) {
+		if (bits) {
+			word = (s * 64) + __builtin_ctzll(bits);
+			return (word * 64 + __builtin_ctzll(bitmap->free[word]));
+		}
+		s = (s + 1) % (MAPPING_PORT_WORDS / 64);
+		bits = bitmap->summary[s];
+	}
+
+	return (0);
+}
+
+/* Whether the internal client may add another mapping. Refusals are
+ * counted, and logged each time a client's count reaches a power of two
+ * to find noisy devices without flooding the log
+ */
+int
+mapping_admit(struct igdpcpd *env, struct in_addr *client)
+{
+	struct mapping_table	*table = &env->sc_mappings;
+	struct mapping_client	*mc;
+
+	mc = mapping_client_find(env, client);
+
+	if (table->client_maximum && mc != NULL &&
+	    mc->count >= table->client_maximum)
+		table->stats.client_refused++;
+	else if (table->maximum && table->count >= table->maximum)
+		table->stats.table_refused++;
+	else
+		return (0);
+
+	/* A client with no mappings yet has nowhere to count */
+	if (mc == NULL)
+		return (-1);
+
+	mc->refused++;
+	if ((mc->refused & (mc->refused - 1)) == 0)
+		log_warnx("%s refused %u mappings over quota",
+		    inet_ntoa(*client), mc->refused);
+
+	return (-1);
+}
+
+/* Allocate an empty mapping, not yet part of the table */
+struct mapping *
+mapping_new(struct igdpcpd *env)
+{
+	struct mapping	*m;
+
+	if ((m = calloc(1, sizeof(struct mapping))) == NULL)
+		return (NULL);
+
+	m->env = env;
+	if ((m->ev = evtimer_new(env->sc_base, mapping_expire, m)) == NULL) {
+		free(m);
+		return (NULL);
+	}
+
+	/* Identifies the mapping to a PCP server for as long as it lives */
+	arc4random_buf(m->nonce, sizeof(m->nonce));
+
+	return (m);
+}
+
+/* Free a mapping that has already been removed from the table */
+void
+mapping_free(struct mapping *m)
+{
+	if (m == NULL)
+		return;
+
+	event_free(m->ev);
+	free(m->description);
+	free(m);
+}
+
+/* Insert a mapping into the table, fails if the key is already present */
+int
+mapping_add(struct mapping *m)
+{
+	struct mapping_table	*table = &m->env->sc_mappings;
+	struct mapping_client	*mc;
+	int			 i;
+
+	if ((mc = mapping_client_find(m->env, &m->client)) == NULL) {
+		if ((mc = calloc(1, sizeof(struct mapping_client))) == NULL)
+			return (-1);
+
+		mc->addr = m->client;
+		for (i = 0; i < MAPPING_PROTOCOL_MAX; i++)
+			RB_INIT(&mc->tree[i]);
+
+		RB_INSERT(mapping_clients, &table->clients, mc);
+	}
+
+	if (RB_INSERT(mapping_tree, &table->tree[m->protocol], m) != NULL) {
+		if (mc->count == 0) {
+			RB_REMOVE(mapping_clients, &table->clients, mc);
+			free(mc);
+		}
+		return (-1);
+	}
+
+	RB_INSERT(mapping_client_tree, &mc->tree[m->protocol], m);
+	m->mc = mc;
+	mc->count++;
+
+	mapping_port_clear(&table->bitmap[m->protocol], m->eport);
+
+	table->count++;
+	table->updateid++;
+
+	mapping_refresh(m, m->lease);
+
+	log_debug("added %s mapping %u -> %s:%u",
+	    mapping_protocol[m->protocol], m->eport, inet_ntoa(m->client),
+	    m->iport);
+
+	upnp_mappings_changed(m->env);
+
+	return (0);
+}
+
+/* Change the external port of a mapping in the table, such as when a PCP
+ * server assigns a different one. Fails if the new key is already present
+ */
+int
+mapping_move(struct mapping *m, u_int16_t eport)
+{
+	struct mapping_table	*table = &m->env->sc_mappings;
+	u_int16_t		 old = m->eport;
+
+	if (eport == old)
+		return (0);
+
+	if (mapping_find(m->env, m->protocol, eport, &m->remote) != NULL)
+		return (-1);
+
+	/* The journal is keyed on the external port, so the old key has to
+	 * go or a replay would bring it back alongside the new one
+	 */
+	store_delete(m);
+
+	RB_REMOVE(mapping_tree, &table->tree[m->protocol], m);
+	RB_REMOVE(mapping_client_tree, &m->mc->tree[m->protocol], m);
+
+	m->eport = eport;
+
+	RB_INSERT(mapping_tree, &table->tree[m->protocol], m);
+	RB_INSERT(mapping_client_tree, &m->mc->tree[m->protocol], m);
+
+	if (!mapping_port_used(m->env, m->protocol, old) &&
+	    mapping_permitted(m->env, old))
+		mapping_port_set(&table->bitmap[m->protocol], old);
+	mapping_port_clear(&table->bitmap[m->protocol], eport);
+
+	table->updateid++;
+
+	store_update(m);
+
+	upnp_mappings_changed(m->env);
+
+	return (0);
+}
+
+/* Remove a mapping from the table and free it */
+void
+mapping_delete(struct mapping *m)
+{
+	struct mapping_table	*table = &m->env->sc_mappings;
+	struct mapping_client	*mc = m->mc;
+
+	if (m->pcp != NULL)
+		pcp_unmap(m);
+
+	RB_REMOVE(mapping_tree, &table->tree[m->protocol], m);
+	RB_REMOVE(mapping_client_tree, &mc->tree[m->protocol], m);
+
+	/* Last mapping for this client */
+	if (--mc->count == 0) {
+		RB_REMOVE(mapping_clients, &table->clients, mc);
+		free(mc);
+	}
+
+	/* Port is free again if no other remote host is using it */
+	if (!mapping_port_used(m->env, m->protocol, m->eport) &&
+	    mapping_permitted(m->env, m->eport))
+		mapping_port_set(&table->bitmap[m->protocol], m->eport);
+
+	table->count--;
+	table->updateid++;
+
+	store_delete(m);
+
+	log_debug("deleted %s mapping %u -> %s:%u",
+	    mapping_protocol[m->protocol], m->eport, inet_ntoa(m->client),
+	    m->iport);
+
+	upnp_mappings_changed(m->env);
+
+	mapping_free(m);
+}
+
+/* (Re)start the lease on a mapping, a lease of zero never expires */
+void
+mapping_refresh(struct mapping *m, u_int32_t lease)
+{
+	m->lease = lease;
+	mapping_schedule(m, lease);
+
+	store_update(m);
+}
+
+/* Expire a mapping after the given number of seconds, or never if zero */
+void
+mapping_schedule(struct mapping *m, u_int32_t seconds)
+{
+	struct timeval	 tv = { 0, 0 };
+
+	if (seconds == 0) {
+		m->expires = 0;
+		evtimer_del(m->ev);
+		return;
+	}
+
+	m->expires = mapping_now() + seconds;
+
+	tv.tv_sec = seconds;
+	evtimer_add(m->ev, &tv);
+}
+
+void
+mapping_expire(int fd, short event, void *arg)
+{
+	struct mapping	*m = (struct mapping *)arg;
+
+	log_debug("%s mapping %u expired", mapping_protocol[m->protocol],
+	    m->eport);
+
+	mapping_delete(m);
+}
+
+/* Find the mapping with exactly this key */
+struct mapping *
+mapping_find(struct igdpcpd *env, enum mapping_protocols protocol,
+    u_int16_t eport, struct in_addr *remote)
+{
+	struct mapping	 key;
+
+	key.eport = eport;
+	key.remote = *remote;
+
+	return (RB_FIND(mapping_tree, &env->sc_mappings.tree[protocol], &key));
+}
+
+/* Find the first mapping for the protocol at or after the given external
+ * port and remote host, optionally only those belonging to an internal
+ * client. Subsequent mappings are found with mapping_range_next()
+ */
+struct mapping *
+mapping_range(struct igdpcpd *env, enum mapping_protocols protocol,
+    struct in_addr *client, u_int16_t eport, struct in_addr *remote)
+{
+	struct mapping		 key;
+	struct mapping_client	*mc;
+
+	key.eport = eport;
+	key.remote = *remote;
+
+	if (client == NULL)
+		return (RB_NFIND(mapping_tree,
+		    &env->sc_mappings.tree[protocol], &key));
+
+	if ((mc = mapping_client_find(env, client)) == NULL)
+		return (NULL);
+
+	return (RB_NFIND(mapping_client_tree, &mc->tree[protocol], &key));
+}
+
+/* Next mapping in the same tree mapping_range() used */
+struct mapping *
+mapping_range_next(struct mapping *m, int byclient)
+{
+	if (byclient)
+		return (RB_NEXT(mapping_client_tree, &m->mc->tree[m->protocol],
+		    m));
+
+	return (RB_NEXT(mapping_tree, &m->env->sc_mappings.tree[m->protocol],
+	    m));
+}
+
+/* Seconds left on the lease, zero for a permanent mapping */
+u_int32_t
+mapping_remaining(struct mapping *m)
+{
+	time_t	 now;
+
+	if (m->expires == 0)
+		return (0);
+
+	now = mapping_now();
+
+	/* Never report zero for a lease that is about to expire */
+	return (m->expires > now ? m->expires - now : 1);
+}
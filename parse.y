@@ -75,10 +75,16 @@ typedef struct {
 
 %token	LISTEN ON
 %token	HTTP PORT
+%token	PERMIT TO
+%token	MAXIMUM MAPPINGS PER CLIENT
+%token	PCP SERVER WINDOW PEER
+%token	EXTERNAL INTERFACE
+%token	EVENT MODERATION
 %token	ERROR
 %token	<v.string>		STRING
 %token	<v.number>		NUMBER
 %type	<v.addr>		address
+%type	<v.number>		pcpport
 %%
 
 grammar		: /* empty */
@@ -126,6 +132,145 @@ main		: LISTEN ON address	{
 			}
 			conf->sc_port = $3;
 		}
+		| PERMIT PORT NUMBER	{
+			if ($3 <= 0 || $3 > USHRT_MAX) {
+				yyerror("invalid port number");
+				YYERROR;
+			}
+			mapping_permit(&conf->sc_mappings, $3, $3);
+		}
+		| PERMIT PORT NUMBER TO NUMBER	{
+			if ($3 <= 0 || $3 > USHRT_MAX ||
+			    $5 <= 0 || $5 > USHRT_MAX) {
+				yyerror("invalid port number");
+				YYERROR;
+			}
+			if ($3 > $5) {
+				yyerror("invalid port range");
+				YYERROR;
+			}
+			mapping_permit(&conf->sc_mappings, $3, $5);
+		}
+		| MAXIMUM MAPPINGS NUMBER	{
+			if ($3 <= 0 || $3 > UINT_MAX) {
+				yyerror("invalid number of mappings");
+				YYERROR;
+			}
+			conf->sc_mappings.maximum = $3;
+		}
+		| MAXIMUM MAPPINGS NUMBER PER CLIENT	{
+			if ($3 <= 0 || $3 > UINT_MAX) {
+				yyerror("invalid number of mappings");
+				YYERROR;
+			}
+			conf->sc_mappings.client_maximum = $3;
+		}
+		| PCP SERVER address pcpport	{
+			struct pcp_server	*ps;
+			struct ntp_addr		*h, *next;
+
+			if ((h = $3->a) == NULL &&
+			    (host_dns($3->name, &h) == -1 || !h)) {
+				yyerror("could not resolve \"%s\"", $3->name);
+				free($3->name);
+				free($3);
+				YYERROR;
+			}
+
+			if (h->ss.ss_family == AF_UNSPEC) {
+				yyerror("pcp server needs an address");
+				for (; h != NULL; h = next) {
+					next = h->next;
+					free(h);
+				}
+				free($3->name);
+				free($3);
+				YYERROR;
+			}
+
+			/* Every address of a name is a server in its own
+			 * right
+			 */
+			for (; h != NULL; h = next) {
+				next = h->next;
+
+				if ((ps = calloc(1,
+				    sizeof(struct pcp_server))) == NULL)
+					fatal("pcp server calloc");
+				ps->fd = -1;
+				memcpy(&ps->sa, &h->ss,
+				    sizeof(struct sockaddr_storage));
+				switch (ps->sa.ss_family) {
+				case AF_INET:
+					((struct sockaddr_in *)&ps->sa)->sin_port =
+					    htons($4);
+					break;
+				case AF_INET6:
+					((struct sockaddr_in6 *)&ps->sa)->sin6_port =
+					    htons($4);
+					break;
+				}
+				TAILQ_INSERT_TAIL(&conf->sc_pcp.servers, ps,
+				    entry);
+
+				free(h);
+			}
+			free($3->name);
+			free($3);
+		}
+		| PCP WINDOW NUMBER	{
+			if ($3 <= 0 || $3 > USHRT_MAX) {
+				yyerror("invalid pcp window");
+				YYERROR;
+			}
+			conf->sc_pcp.window = $3;
+		}
+		| PCP PEER STRING PORT NUMBER	{
+			struct pcp_remote	*pr;
+
+			if ((pr = calloc(1, sizeof(struct pcp_remote))) ==
+			    NULL)
+				fatal("pcp peer calloc");
+			if (inet_pton(AF_INET, $3, &pr->addr) != 1) {
+				yyerror("invalid pcp peer address \"%s\"", $3);
+				free($3);
+				free(pr);
+				YYERROR;
+			}
+			free($3);
+			if ($5 <= 0 || $5 > USHRT_MAX) {
+				yyerror("invalid port number");
+				free(pr);
+				YYERROR;
+			}
+			pr->port = $5;
+			TAILQ_INSERT_TAIL(&conf->sc_pcp.remotes, pr, entry);
+		}
+		| EXTERNAL INTERFACE STRING	{
+			if (conf->sc_external.ifname != NULL) {
+				yyerror("external interface already set");
+				free($3);
+				YYERROR;
+			}
+			conf->sc_external.ifname = $3;
+		}
+		| EVENT MODERATION NUMBER	{
+			if ($3 < 0 || $3 > 60000) {
+				yyerror("invalid event moderation");
+				YYERROR;
+			}
+			conf->sc_gena.moderation = $3;
+		}
+		;
+
+pcpport		: /* empty */		{ $$ = PCP_SERVER_PORT; }
+		| PORT NUMBER		{
+			if ($2 <= 0 || $2 > USHRT_MAX) {
+				yyerror("invalid port number");
+				YYERROR;
+			}
+			$$ = $2;
+		}
 		;
 
 address		: STRING		{
@@ -177,10 +322,24 @@ lookup(char *s)
 {
 	/* this has to be sorted always */
 	static const struct keywords keywords[] = {
+		{ "client",	CLIENT },
+		{ "event",	EVENT },
+		{ "external",	EXTERNAL },
 		{ "http",	HTTP },
+		{ "interface",	INTERFACE },
 		{ "listen",	LISTEN },
+		{ "mappings",	MAPPINGS },
+		{ "maximum",	MAXIMUM },
+		{ "moderation",	MODERATION },
 		{ "on",		ON },
-		{ "port",	PORT }
+		{ "pcp",	PCP },
+		{ "peer",	PEER },
+		{ "per",	PER },
+		{ "permit",	PERMIT },
+		{ "port",	PORT },
+		{ "server",	SERVER },
+		{ "to",		TO },
+		{ "window",	WINDOW }
 	};
 	const struct keywords	*p;
 
@@ -463,6 +622,10 @@ parse_config(const char *filename, u_int flags)
 	conf->sc_confpath = filename;
 
 	TAILQ_INIT(&conf->listen_addrs);
+	TAILQ_INIT(&conf->sc_pcp.servers);
+	TAILQ_INIT(&conf->sc_pcp.remotes);
+	conf->sc_pcp.window = PCP_WINDOW;
+	conf->sc_gena.moderation = GENA_MODERATION;
 
 	conf->sc_version = 1;
 
@@ -14,5 +14,1549 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "igdpcpd.h"
+
 extern struct sockaddr_in	 pcp4;
 extern struct sockaddr_in6	 pcp6;
+
+/* How long to keep trying to delete a mapping upstream, in seconds */
+#define	PCP_RELEASE_DURATION	 30
+
+/* Requests in flight to a server before it has shown how fast it is */
+#define	PCP_WINDOW_INITIAL	 4
+
+/* Most responses handled before going back to the event loop */
+#define	PCP_RECV_BATCH		 32
+
+/* Clients wait up to this long before renewing after a server restart,
+ * in milliseconds, so they don't all hit it at once
+ */
+#define	PCP_RESYNC_DELAY	 5000
+
+/* Milliseconds between batches of renewals while resynchronising */
+#define	PCP_RESYNC_INTERVAL	 100
+
+/* Seconds a request can go unanswered before its server is taken to be
+ * down. With the retransmission timer's jitter this is always reached at
+ * the second timeout, never the first
+ */
+#define	PCP_FAILOVER_TIMEOUT	 7
+
+/* Seconds between ANNOUNCE requests to a server that is down */
+#define	PCP_PROBE_INTERVAL	 30
+
+/* PCP results for NAT-PMP ones, indexed by the NAT-PMP result */
+const u_int8_t	 natpmp_result[] = {
+	PCP_SUCCESS,
+	PCP_UNSUPP_VERSION,
+	PCP_NOT_AUTHORISED,
+	PCP_NETWORK_FAILURE,
+	PCP_NO_RESOURCES,
+	PCP_UNSUPP_OPCODE,
+};
+
+int		 pcp_renewal_cmp(struct pcp_renewal *, struct pcp_renewal *);
+void		 pcp_v4mapped(struct in6_addr *, struct in_addr *);
+u_int32_t	 pcp_rt(u_int32_t);
+u_int32_t	 pcp_lifetime(struct mapping *);
+u_int64_t	 pcp_ms(void);
+struct pcp_requests	*pcp_bucket(struct igdpcpd *, u_int8_t *, u_int8_t,
+			     u_int16_t);
+struct pcp_requests	*pcp_outstanding(struct pcp_request *);
+struct pcp_request	*pcp_lookup(struct igdpcpd *, u_int8_t *, u_int8_t,
+			     u_int16_t);
+struct pcp_request	*natpmp_lookup(struct pcp_server *, u_int8_t,
+			     u_int16_t);
+struct pcp_request	*natpmp_oldest(struct pcp_server *, u_int8_t);
+int		 pcp_waiting(struct pcp_request *);
+struct pcp_request	*pcp_new(struct mapping *, int, u_int32_t,
+			     void (*)(struct pcp_request *, void *), void *);
+void		 pcp_listen(struct igdpcpd *, struct pcp_server *,
+		     struct sockaddr_storage *);
+void		 pcp_epoch(struct pcp_server *, u_int32_t);
+void		 pcp_resync(struct pcp_server *, u_int32_t);
+void		 pcp_resync_next(int, short, void *);
+void		 pcp_announce(int, short, void *);
+struct pcp_server	*pcp_server_find(struct igdpcpd *,
+			     struct sockaddr_storage *);
+struct pcp_server	*pcp_select(struct igdpcpd *);
+void		 pcp_move(struct pcp_request *, struct pcp_server *);
+void		 pcp_down(struct pcp_server *);
+void		 pcp_up(struct pcp_server *);
+void		 pcp_version(struct pcp_server *, u_int8_t);
+void		 pcp_ask(struct pcp_server *);
+void		 pcp_probe(int, short, void *);
+void		 pcp_external(struct pcp_server *, struct in_addr *);
+size_t		 pcp_encode(struct pcp_request *, u_int8_t *);
+void		 pcp_send(struct pcp_request *);
+void		 pcp_start(struct pcp_request *);
+void		 pcp_finish(struct pcp_request *);
+void		 pcp_dequeue(struct pcp_server *);
+void		 pcp_rtt(struct pcp_server *, struct pcp_request *);
+void		 pcp_transmit(struct pcp_request *);
+void		 pcp_timeout(int, short, void *);
+void		 pcp_schedule(struct pcp_request *);
+void		 pcp_schedule_between(struct pcp_request *, u_int64_t,
+		     u_int64_t);
+void		 pcp_unschedule(struct pcp_request *);
+void		 pcp_renew_arm(struct igdpcpd *);
+void		 pcp_renew(int, short, void *);
+void		 pcp_complete(struct pcp_request *);
+void		 pcp_free(struct pcp_request *);
+void		 pcp_recv(int, short, void *);
+void		 pcp_response(struct pcp_server *, u_int8_t *, size_t);
+void		 natpmp_response(struct pcp_server *, u_int8_t *, size_t);
+void		 pcp_answer(struct pcp_request *, int, u_int32_t, u_int16_t,
+		     struct in_addr *);
+int		 pcp_moved(struct pcp_request *);
+int		 pcp_refused(struct pcp_request *, u_int32_t);
+
+/* IANA protocol numbers, indexed by enum mapping_protocols */
+const u_int8_t	 pcp_protocol[MAPPING_PROTOCOL_MAX] = {
+	IPPROTO_TCP,
+	IPPROTO_UDP,
+};
+
+RB_GENERATE(pcp_renewals, pcp_renewal, entry, pcp_renewal_cmp);
+
+int
+pcp_renewal_cmp(struct pcp_renewal *a, struct pcp_renewal *b)
+{
+	if (a->due != b->due)
+		return (a->due < b->due ? -1 : 1);
+
+	return (0);
+}
+
+/* IPv4 addresses are carried as IPv4-mapped IPv6 addresses */
+void
+pcp_v4mapped(struct in6_addr *in6, struct in_addr *in)
+{
+	struct in6_addr	 v4mapped = IN6ADDR_V4MAPPED_INIT;
+
+	*in6 = v4mapped;
+	memcpy(&in6->s6_addr[12], in, sizeof(struct in_addr));
+}
+
+/* Randomise a retransmission timeout by +/- 10% */
+u_int32_t
+pcp_rt(u_int32_t ms)
+{
+	return (((u_int64_t)ms * (900 + arc4random_uniform(201))) / 1000);
+}
+
+/* Ask for whatever is left of the UPnP lease, a lifetime of zero would
+ * delete the mapping so permanent mappings ask for as long as possible
+ */
+u_int32_t
+pcp_lifetime(struct mapping *m)
+{
+	return (m->expires ? mapping_remaining(m) : UINT32_MAX);
+}
+
+/* Milliseconds on a clock that doesn't jump */
+u_int64_t
+pcp_ms(void)
+{
+	struct timespec	 ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		fatal("clock_gettime");
+
+	return ((u_int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* Responses are matched on the nonce, protocol and internal port. The
+ * same mapping can have two requests in flight with the same nonce, such
+ * as when its internal port changes, so all three make up the key. NAT-PMP
+ * has no nonce, which is passed as NULL
+ */
+struct pcp_requests *
+pcp_bucket(struct igdpcpd *env, u_int8_t *nonce, u_int8_t protocol,
+    u_int16_t iport)
+{
+	u_int32_t	 hash = 0;
+
+	/* Nonces are random, so the first bytes are as good as any hash */
+	if (nonce != NULL)
+		memcpy(&hash, nonce, sizeof(hash));
+	hash ^= (protocol << 16) | iport;
+
+	return (&env->sc_pcp.outstanding[hash % PCP_REQUEST_BUCKETS]);
+}
+
+/* Where an in flight request is kept, which depends on the version
+ * spoken to its server
+ */
+struct pcp_requests *
+pcp_outstanding(struct pcp_request *req)
+{
+	return (pcp_bucket(req->env,
+	    req->server->version == NATPMP_MAX_VERSION ? NULL : req->nonce,
+	    req->protocol, req->iport));
+}
+
+struct pcp_request *
+pcp_lookup(struct igdpcpd *env, u_int8_t *nonce, u_int8_t protocol,
+    u_int16_t iport)
+{
+	struct pcp_request	*req;
+
+	TAILQ_FOREACH(req, pcp_bucket(env, nonce, protocol, iport), entry)
+		if (req->protocol == protocol && req->iport == iport &&
+		    memcmp(req->nonce, nonce, PCP_NONCE_LENGTH) == 0)
+			return (req);
+
+	return (NULL);
+}
+
+/* Without a nonce the oldest request to the server for the port is taken
+ * to be the one answered
+ */
+struct pcp_request *
+natpmp_lookup(struct pcp_server *ps, u_int8_t protocol, u_int16_t iport)
+{
+	struct pcp_request	*req;
+
+	TAILQ_FOREACH(req, pcp_bucket(ps->env, NULL, protocol, iport), entry)
+		if (req->server == ps && req->protocol == protocol &&
+		    req->iport == iport)
+			return (req);
+
+	return (NULL);
+}
+
+/* A short error response has no ports to match on, so it is taken to be
+ * for the MAP to that server that has waited longest
+ */
+struct pcp_request *
+natpmp_oldest(struct pcp_server *ps, u_int8_t protocol)
+{
+	struct pcp_request	*req, *oldest = NULL;
+	int			 i;
+
+	for (i = 0; i < PCP_REQUEST_BUCKETS; i++)
+		TAILQ_FOREACH(req, &ps->env->sc_pcp.outstanding[i], entry)
+			if (req->server == ps &&
+			    req->opcode == PCP_OPCODE_MAP &&
+			    req->protocol == protocol &&
+			    (oldest == NULL || req->sent < oldest->sent))
+				oldest = req;
+
+	return (oldest);
+}
+
+/* Whether the request is in flight, waiting on a response */
+int
+pcp_waiting(struct pcp_request *req)
+{
+	if (req->queued)
+		return (0);
+
+	switch (req->state) {
+	case PCP_STATE_REQUESTING:
+	case PCP_STATE_RENEWING:
+	case PCP_STATE_RELEASING:
+		return (1);
+	default:
+		return (0);
+	}
+}
+
+void
+pcp_init(struct igdpcpd *env)
+{
+	struct pcp_server	*ps;
+	struct sockaddr_storage	 ss;
+	struct mapping		*m;
+	socklen_t		 slen;
+	int			 i;
+
+	for (i = 0; i < PCP_REQUEST_BUCKETS; i++)
+		TAILQ_INIT(&env->sc_pcp.outstanding[i]);
+
+	env->sc_pcp.fd4 = env->sc_pcp.fd6 = -1;
+
+	RB_INIT(&env->sc_pcp.renewals);
+	if ((env->sc_pcp.renew_ev = evtimer_new(env->sc_base, pcp_renew,
+	    env)) == NULL)
+		fatal("evtimer_new");
+
+	TAILQ_FOREACH(ps, &env->sc_pcp.servers, entry) {
+		ps->env = env;
+		TAILQ_INIT(&ps->queue);
+		ps->window = MIN(PCP_WINDOW_INITIAL, env->sc_pcp.window);
+
+		if ((ps->fd = socket(ps->sa.ss_family, SOCK_DGRAM, 0)) == -1)
+			fatal("socket");
+
+		if (fcntl(ps->fd, F_SETFL, O_NONBLOCK) == -1)
+			fatal("fcntl");
+
+		/* Connecting picks the source address, which has to go in
+		 * every request, and filters out anyone else's packets
+		 */
+		if (connect(ps->fd, (struct sockaddr *)&ps->sa,
+		    SA_LEN((struct sockaddr *)&ps->sa)) == -1)
+			fatal("connect");
+
+		slen = sizeof(ss);
+		if (getsockname(ps->fd, (struct sockaddr *)&ss, &slen) == -1)
+			fatal("getsockname");
+
+		switch (ss.ss_family) {
+		case AF_INET:
+			pcp_v4mapped(&ps->client,
+			    &((struct sockaddr_in *)&ss)->sin_addr);
+			break;
+		case AF_INET6:
+			ps->client = ((struct sockaddr_in6 *)&ss)->sin6_addr;
+			break;
+		default:
+			fatalx("king bula sez: af borked");
+		}
+
+		ps->ev = event_new(env->sc_base, ps->fd, EV_READ|EV_PERSIST,
+		    pcp_recv, ps);
+		event_add(ps->ev, NULL);
+
+		ps->resync_ev = evtimer_new(env->sc_base, pcp_resync_next, ps);
+		ps->resync = MAPPING_PROTOCOL_MAX;
+		ps->probe_ev = evtimer_new(env->sc_base, pcp_probe, ps);
+		ps->version = PCP_MAX_VERSION;
+
+		pcp_listen(env, ps, &ss);
+
+		log_info("using PCP server %s",
+		    log_sockaddr((struct sockaddr *)&ps->sa));
+	}
+
+	if (!pcp_enabled(env))
+		return;
+
+	/* Anything restored from the store needs mapping upstream again.
+	 * The requests start out failed and are sent in paced batches, the
+	 * same as after a server restart
+	 */
+	for (i = 0; i < MAPPING_PROTOCOL_MAX; i++)
+		RB_FOREACH(m, mapping_tree, &env->sc_mappings.tree[i]) {
+			if ((m->pcp = pcp_new(m, 1, 0, NULL, NULL)) == NULL)
+				fatal("pcp_new");
+			m->pcp->state = PCP_STATE_FAILED;
+		}
+
+	if (env->sc_mappings.count)
+		TAILQ_FOREACH(ps, &env->sc_pcp.servers, entry)
+			pcp_resync(ps, 0);
+}
+
+/* Listen for ANNOUNCE responses multicast by servers that have restarted,
+ * joining the group on the interface used to reach each server
+ */
+void
+pcp_listen(struct igdpcpd *env, struct pcp_server *ps,
+    struct sockaddr_storage *ss)
+{
+	struct ip_mreq		 mreq4;
+	struct ipv6_mreq	 mreq6;
+	struct sockaddr		*sa;
+	struct event		**ev;
+	int			*fd, reuse = 1;
+
+	switch (ss->ss_family) {
+	case AF_INET:
+		fd = &env->sc_pcp.fd4;
+		ev = &env->sc_pcp.ev4;
+		sa = (struct sockaddr *)&pcp4;
+		break;
+	case AF_INET6:
+		fd = &env->sc_pcp.fd6;
+		ev = &env->sc_pcp.ev6;
+		sa = (struct sockaddr *)&pcp6;
+		break;
+	default:
+		fatalx("king bula sez: af borked");
+	}
+
+	if (*fd == -1) {
+		if ((*fd = socket(sa->sa_family, SOCK_DGRAM, 0)) == -1)
+			fatal("socket");
+
+		if (fcntl(*fd, F_SETFL, O_NONBLOCK) == -1)
+			fatal("fcntl");
+
+		if (setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+		    sizeof(reuse)) == -1)
+			fatal("setsockopt");
+
+		if (setsockopt(*fd, SOL_SOCKET, SO_REUSEPORT, &reuse,
+		    sizeof(reuse)) == -1)
+			fatal("setsockopt");
+
+		if (bind(*fd, sa, SA_LEN(sa)) == -1)
+			fatal("bind");
+
+		*ev = event_new(env->sc_base, *fd, EV_READ|EV_PERSIST,
+		    pcp_announce, env);
+		event_add(*ev, NULL);
+
+		log_info("listening on %s:%u", log_sockaddr(sa),
+		    PCP_CLIENT_PORT);
+	}
+
+	/* Servers reached through the same interface share a membership */
+	switch (ss->ss_family) {
+	case AF_INET:
+		memset(&mreq4, 0, sizeof(mreq4));
+		mreq4.imr_multiaddr = pcp4.sin_addr;
+		mreq4.imr_interface = ((struct sockaddr_in *)ss)->sin_addr;
+
+		if (setsockopt(*fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq4,
+		    sizeof(mreq4)) == -1 && errno != EADDRINUSE)
+			fatal("setsockopt");
+		break;
+	case AF_INET6:
+		memset(&mreq6, 0, sizeof(mreq6));
+		mreq6.ipv6mr_multiaddr = pcp6.sin6_addr;
+		mreq6.ipv6mr_interface =
+		    ((struct sockaddr_in6 *)ss)->sin6_scope_id;
+
+		if (setsockopt(*fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq6,
+		    sizeof(mreq6)) == -1 && errno != EADDRINUSE)
+			fatal("setsockopt");
+		break;
+	}
+}
+
+/* Every response carries the server's epoch, the seconds since it last
+ * lost its state. RFC 6887 section 8.5 allows for reordering and clock
+ * drift, anything else means the server has restarted and forgotten the
+ * mappings
+ */
+void
+pcp_epoch(struct pcp_server *ps, u_int32_t epoch)
+{
+	int64_t		 client_delta, server_delta;
+	u_int64_t	 now = pcp_ms() / 1000;
+	int		 valid = 1;
+
+	if (ps->epoch_seen) {
+		client_delta = now - ps->prev_client;
+		server_delta = (int64_t)epoch - ps->prev_server;
+
+		if (server_delta < -1)
+			valid = 0;
+		else if (client_delta + 2 < server_delta - server_delta / 16 ||
+		    server_delta + 2 < client_delta - client_delta / 16)
+			valid = 0;
+	}
+
+	ps->epoch_seen = 1;
+	ps->prev_client = now;
+	ps->prev_server = epoch;
+
+	if (valid)
+		return;
+
+	log_warnx("PCP server %s has lost its mappings",
+	    log_sockaddr((struct sockaddr *)&ps->sa));
+
+	pcp_resync(ps, arc4random_uniform(PCP_RESYNC_DELAY));
+}
+
+/* Renew every mapping held with the server, starting over if already
+ * part way through. The first batch goes after a delay in milliseconds.
+ * If another server would now be chosen for new mappings, because this
+ * one is down or slower, they are moved there instead
+ */
+void
+pcp_resync(struct pcp_server *ps, u_int32_t ms)
+{
+	struct timeval	 tv;
+
+	ps->resync = 0;
+	ps->resync_eport = 0;
+	ps->resync_remote.s_addr = INADDR_ANY;
+	ps->resync_resume = 0;
+
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	evtimer_add(ps->resync_ev, &tv);
+}
+
+/* Send the next window's worth of renewals. Nothing more is sent while
+ * the last batch is still queued, so the resync goes only as fast as the
+ * server answers and leaves room for new requests
+ */
+void
+pcp_resync_next(int fd, short event, void *arg)
+{
+	struct pcp_server	*ps = (struct pcp_server *)arg;
+	struct igdpcpd		*env = ps->env;
+	struct pcp_server	*target = pcp_select(env);
+	struct mapping		*m = NULL;
+	struct timeval		 tv;
+	u_int32_t		 count = 0;
+
+	while (ps->resync < MAPPING_PROTOCOL_MAX && count < target->window &&
+	    TAILQ_EMPTY(&target->queue)) {
+		m = mapping_range(env, ps->resync, NULL, ps->resync_eport,
+		    &ps->resync_remote);
+		if (m != NULL && ps->resync_resume &&
+		    m->eport == ps->resync_eport &&
+		    m->remote.s_addr == ps->resync_remote.s_addr)
+			m = mapping_range_next(m, 0);
+
+		if (m == NULL) {
+			ps->resync++;
+			ps->resync_eport = 0;
+			ps->resync_remote.s_addr = INADDR_ANY;
+			ps->resync_resume = 0;
+			continue;
+		}
+
+		ps->resync_eport = m->eport;
+		ps->resync_remote = m->remote;
+		ps->resync_resume = 1;
+
+		if (m->pcp == NULL || m->pcp->server != ps)
+			continue;
+
+		if (target != ps) {
+			pcp_move(m->pcp, target);
+			count++;
+			continue;
+		}
+
+		/* Anything in flight will be answered by the new instance */
+		switch (m->pcp->state) {
+		case PCP_STATE_MAPPED:
+		case PCP_STATE_FAILED:
+			pcp_refresh(m);
+			count++;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (ps->resync == MAPPING_PROTOCOL_MAX) {
+		log_debug("PCP server %s resynchronised",
+		    log_sockaddr((struct sockaddr *)&ps->sa));
+		return;
+	}
+
+	tv.tv_sec = 0;
+	tv.tv_usec = PCP_RESYNC_INTERVAL * 1000;
+	evtimer_add(ps->resync_ev, &tv);
+}
+
+/* Where new mappings go: the quickest server that is up. One that has
+ * not answered yet counts as quickest, so every server gets tried
+ */
+struct pcp_server *
+pcp_select(struct igdpcpd *env)
+{
+	struct pcp_server	*ps, *best = NULL;
+
+	TAILQ_FOREACH(ps, &env->sc_pcp.servers, entry)
+		if (best == NULL || ps->health < best->health ||
+		    (ps->health == best->health && ps->srtt < best->srtt))
+			best = ps;
+
+	return (best);
+}
+
+/* Start over with another server, whatever state the request is in. The
+ * old server is down or has lost the mapping, so it isn't released there
+ */
+void
+pcp_move(struct pcp_request *req, struct pcp_server *target)
+{
+	if (req->queued) {
+		TAILQ_REMOVE(&req->server->queue, req, entry);
+		req->queued = 0;
+	} else if (pcp_waiting(req))
+		pcp_finish(req);
+	pcp_unschedule(req);
+
+	req->server = target;
+	req->state = PCP_STATE_REQUESTING;
+	req->lifetime = pcp_lifetime(req->m);
+	pcp_send(req);
+}
+
+void
+pcp_down(struct pcp_server *ps)
+{
+	struct timeval	 tv = { PCP_PROBE_INTERVAL, 0 };
+
+	ps->health = PCP_SERVER_DOWN;
+	evtimer_add(ps->probe_ev, &tv);
+
+	log_warnx("PCP server %s is not responding",
+	    log_sockaddr((struct sockaddr *)&ps->sa));
+
+	/* Fail over if there is anywhere better to go */
+	if (pcp_select(ps->env) != ps)
+		pcp_resync(ps, 0);
+}
+
+void
+pcp_up(struct pcp_server *ps)
+{
+	if (ps->health == PCP_SERVER_UP)
+		return;
+
+	ps->health = PCP_SERVER_UP;
+	evtimer_del(ps->probe_ev);
+
+	log_info("PCP server %s is responding again",
+	    log_sockaddr((struct sockaddr *)&ps->sa));
+}
+
+/* Switch to speaking another version to the server. Anything in flight
+ * is matched differently from now on, so it is sent again from the
+ * start, ahead of whatever is queued
+ */
+void
+pcp_version(struct pcp_server *ps, u_int8_t version)
+{
+	struct igdpcpd		*env = ps->env;
+	struct pcp_requests	 restart;
+	struct pcp_request	*req, *next;
+	int			 i;
+
+	if (ps->version == version)
+		return;
+
+	TAILQ_INIT(&restart);
+	for (i = 0; i < PCP_REQUEST_BUCKETS; i++)
+		for (req = TAILQ_FIRST(&env->sc_pcp.outstanding[i]); req;
+		    req = next) {
+			next = TAILQ_NEXT(req, entry);
+			if (req->server != ps)
+				continue;
+			TAILQ_REMOVE(&env->sc_pcp.outstanding[i], req, entry);
+			evtimer_del(req->ev);
+			ps->inflight--;
+			TAILQ_INSERT_TAIL(&restart, req, entry);
+		}
+
+	while ((req = TAILQ_LAST(&restart, pcp_requests)) != NULL) {
+		TAILQ_REMOVE(&restart, req, entry);
+		TAILQ_INSERT_HEAD(&ps->queue, req, entry);
+		req->queued = 1;
+	}
+
+	ps->version = version;
+	ps->epoch_seen = 0;
+
+	if (version == NATPMP_MAX_VERSION)
+		log_warnx("PCP server %s only speaks NAT-PMP, mappings are "
+		    "made for this host and without remote host filters",
+		    log_sockaddr((struct sockaddr *)&ps->sa));
+	else
+		log_info("PCP server %s speaks PCP again",
+		    log_sockaddr((struct sockaddr *)&ps->sa));
+
+	pcp_dequeue(ps);
+	pcp_ask(ps);
+}
+
+/* Ask the server for its epoch, and with NAT-PMP the external address */
+void
+pcp_ask(struct pcp_server *ps)
+{
+	u_int32_t	 buf[PCP_MAX_PACKET_SIZE / sizeof(u_int32_t)];
+	size_t		 len;
+
+	if (ps->version == NATPMP_MAX_VERSION)
+		len = natpmp_request((u_int8_t *)buf, NATPMP_OPCODE_ADDRESS,
+		    0, 0, 0);
+	else
+		len = pcp_header((u_int8_t *)buf, PCP_OPCODE_ANNOUNCE, 0,
+		    &ps->client);
+
+	if (send(ps->fd, buf, len, 0) == -1)
+		log_warn("PCP send to %s",
+		    log_sockaddr((struct sockaddr *)&ps->sa));
+}
+
+/* Nothing is sent to a server that is down, so ask it for its epoch to
+ * find out when it comes back
+ */
+void
+pcp_probe(int fd, short event, void *arg)
+{
+	struct pcp_server	*ps = (struct pcp_server *)arg;
+	struct timeval		 tv = { PCP_PROBE_INTERVAL, 0 };
+
+	pcp_ask(ps);
+
+	evtimer_add(ps->probe_ev, &tv);
+}
+
+/* Without a WAN interface to watch, the server in use is the only one to
+ * say what the external address is
+ */
+void
+pcp_external(struct pcp_server *ps, struct in_addr *address)
+{
+	if (ps->env->sc_external.ifname == NULL && ps == pcp_select(ps->env))
+		external_set(ps->env, address);
+}
+
+/* An unsolicited ANNOUNCE, only of interest for its epoch. A NAT-PMP
+ * server announces its external address the same way
+ */
+void
+pcp_announce(int fd, short event, void *arg)
+{
+	struct igdpcpd			*env = (struct igdpcpd *)arg;
+	struct pcp_server		*ps;
+	struct pcp_packet		 pkt;
+	struct natpmp_response		*nr;
+	struct sockaddr_storage		 ss;
+	u_int32_t			 buf[PCP_MAX_PACKET_SIZE /
+					     sizeof(u_int32_t)];
+	socklen_t			 slen;
+	ssize_t				 len;
+	int				 i;
+
+	for (i = 0; i < PCP_RECV_BATCH; i++) {
+		slen = sizeof(ss);
+		if ((len = recvfrom(fd, buf, sizeof(buf), 0,
+		    (struct sockaddr *)&ss, &slen)) == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				log_warn("PCP recvfrom");
+			return;
+		}
+
+		if ((ps = pcp_server_find(env, &ss)) == NULL) {
+			log_debug("PCP announcement from unknown server %s",
+			    log_sockaddr((struct sockaddr *)&ss));
+			continue;
+		}
+
+		if (ps->version == NATPMP_MAX_VERSION) {
+			if (natpmp_decode((u_int8_t *)buf, len, &nr) == 0 &&
+			    nr->opcode == (NATPMP_OPCODE_ADDRESS|
+			    NATPMP_OPCODE_RESPONSE))
+				natpmp_response(ps, (u_int8_t *)buf, len);
+			continue;
+		}
+
+		if (pcp_decode((u_int8_t *)buf, len, 1, &pkt) != PCP_SUCCESS ||
+		    pkt.opcode != PCP_OPCODE_ANNOUNCE ||
+		    pkt.response->result != PCP_SUCCESS)
+			continue;
+
+		pcp_epoch(ps, ntohl(pkt.response->epoch));
+	}
+}
+
+/* Only the configured servers, from their own port */
+struct pcp_server *
+pcp_server_find(struct igdpcpd *env, struct sockaddr_storage *ss)
+{
+	struct pcp_server	*ps;
+
+	TAILQ_FOREACH(ps, &env->sc_pcp.servers, entry) {
+		if (ps->sa.ss_family != ss->ss_family)
+			continue;
+		if (ss->ss_family == AF_INET &&
+		    memcmp(&((struct sockaddr_in *)ss)->sin_addr,
+		    &((struct sockaddr_in *)&ps->sa)->sin_addr,
+		    sizeof(struct in_addr)) == 0 &&
+		    ((struct sockaddr_in *)ss)->sin_port ==
+		    ((struct sockaddr_in *)&ps->sa)->sin_port)
+			return (ps);
+		if (ss->ss_family == AF_INET6 &&
+		    memcmp(&((struct sockaddr_in6 *)ss)->sin6_addr,
+		    &((struct sockaddr_in6 *)&ps->sa)->sin6_addr,
+		    sizeof(struct in6_addr)) == 0 &&
+		    ((struct sockaddr_in6 *)ss)->sin6_port ==
+		    ((struct sockaddr_in6 *)&ps->sa)->sin6_port)
+			return (ps);
+	}
+
+	return (NULL);
+}
+
+int
+pcp_enabled(struct igdpcpd *env)
+{
+	return (!TAILQ_EMPTY(&env->sc_pcp.servers));
+}
+
+struct pcp_request *
+pcp_new(struct mapping *m, int prefer_failure, u_int32_t duration,
+    void (*cb)(struct pcp_request *, void *), void *arg)
+{
+	struct igdpcpd		*env = m->env;
+	struct pcp_request	*req;
+	struct pcp_remote	*pr;
+
+	if ((req = calloc(1, sizeof(struct pcp_request))) == NULL)
+		return (NULL);
+
+	if ((req->ev = evtimer_new(env->sc_base, pcp_timeout, req)) == NULL) {
+		free(req);
+		return (NULL);
+	}
+
+	req->env = env;
+	req->server = pcp_select(env);
+	req->m = m;
+	req->state = PCP_STATE_REQUESTING;
+	memcpy(req->nonce, m->nonce, sizeof(req->nonce));
+	req->opcode = PCP_OPCODE_MAP;
+	req->protocol = pcp_protocol[m->protocol];
+
+	/* Flows to some remote hosts are better kept alive than opened */
+	if (m->remote.s_addr != INADDR_ANY)
+		TAILQ_FOREACH(pr, &env->sc_pcp.remotes, entry)
+			if (pr->addr.s_addr == m->remote.s_addr) {
+				req->opcode = PCP_OPCODE_PEER;
+				req->rport = pr->port;
+				break;
+			}
+
+	req->prefer_failure = prefer_failure;
+	req->iport = m->iport;
+	req->eport = m->eport;
+	req->client = m->client;
+	req->remote = m->remote;
+	req->lifetime = pcp_lifetime(m);
+	req->duration = duration;
+	req->cb = cb;
+	req->arg = arg;
+
+	return (req);
+}
+
+/* Create the mapping upstream. The callback, if any, is called once with
+ * the first response or after duration seconds without one
+ */
+int
+pcp_map(struct mapping *m, int prefer_failure, u_int32_t duration,
+    void (*cb)(struct pcp_request *, void *), void *arg)
+{
+	struct pcp_request	*req;
+
+	if ((req = pcp_new(m, prefer_failure, duration, cb, arg)) == NULL)
+		return (-1);
+
+	m->pcp = req;
+
+	pcp_send(req);
+
+	return (0);
+}
+
+/* The UPnP lease has changed, so tell the server now rather than at the
+ * next renewal
+ */
+void
+pcp_refresh(struct mapping *m)
+{
+	struct pcp_request	*req = m->pcp;
+
+	req->lifetime = pcp_lifetime(m);
+
+	switch (req->state) {
+	case PCP_STATE_REQUESTING:
+	case PCP_STATE_RENEWING:
+		/* The next retransmission carries the new lifetime */
+		break;
+	case PCP_STATE_MAPPED:
+		pcp_unschedule(req);
+		req->state = PCP_STATE_RENEWING;
+		req->duration = 0;
+		pcp_send(req);
+		break;
+	case PCP_STATE_FAILED:
+		pcp_unschedule(req);
+		req->state = PCP_STATE_REQUESTING;
+		req->duration = 0;
+		pcp_send(req);
+		break;
+	default:
+		break;
+	}
+}
+
+/* The mapping is going away, so delete it upstream too. The request is
+ * detached from the mapping and frees itself when done
+ */
+void
+pcp_unmap(struct mapping *m)
+{
+	struct pcp_request	*req = m->pcp;
+
+	int			 sent = 1;
+
+	m->pcp = NULL;
+	req->m = NULL;
+
+	if (req->queued) {
+		TAILQ_REMOVE(&req->server->queue, req, entry);
+		req->queued = 0;
+		if (req->state == PCP_STATE_REQUESTING)
+			sent = 0;
+	} else if (pcp_waiting(req))
+		pcp_finish(req);
+	evtimer_del(req->ev);
+	pcp_unschedule(req);
+
+	/* Nobody is waiting any more */
+	if (req->state == PCP_STATE_REQUESTING && req->cb != NULL) {
+		req->result = -1;
+		pcp_complete(req);
+	}
+
+	/* Nothing was created upstream */
+	if (req->state == PCP_STATE_FAILED || !sent) {
+		pcp_free(req);
+		return;
+	}
+
+	req->state = PCP_STATE_RELEASING;
+	req->lifetime = 0;
+	req->duration = PCP_RELEASE_DURATION;
+	pcp_send(req);
+}
+
+/* Encode a MAP or PEER request, returning its length. NAT-PMP can only
+ * map to this host, with no remote peer or filter, and deletes with a
+ * zero lifetime and external port
+ */
+size_t
+pcp_encode(struct pcp_request *req, u_int8_t *buf)
+{
+	struct pcp_map		*map;
+	struct pcp_peer		*peer;
+	struct pcp_filter	 pf;
+	struct in6_addr		 client;
+	size_t			 len;
+
+	if (req->server->version == NATPMP_MAX_VERSION)
+		return (natpmp_request(buf, req->protocol == IPPROTO_UDP ?
+		    NATPMP_OPCODE_MAP_UDP : NATPMP_OPCODE_MAP_TCP, req->iport,
+		    req->lifetime ? req->eport : 0, req->lifetime));
+
+	len = pcp_header(buf, req->opcode, req->lifetime, &req->server->client);
+
+	/* PEER starts out the same as MAP */
+	map = (struct pcp_map *)(buf + len);
+	memcpy(map->nonce, req->nonce, sizeof(map->nonce));
+	map->protocol = req->protocol;
+	memset(map->reserved, 0, sizeof(map->reserved));
+	map->iport = htons(req->iport);
+	map->eport = htons(req->eport);
+	pcp_v4mapped(&map->external, &req->external);
+
+	if (req->opcode == PCP_OPCODE_PEER) {
+		peer = (struct pcp_peer *)map;
+		peer->rport = htons(req->rport);
+		peer->reserved2 = 0;
+		pcp_v4mapped(&peer->remote, &req->remote);
+		len += sizeof(struct pcp_peer);
+	} else
+		len += sizeof(struct pcp_map);
+
+	/* Mapping on behalf of an internal client */
+	pcp_v4mapped(&client, &req->client);
+	if (memcmp(&client, &req->server->client, sizeof(client)))
+		len = pcp_option(buf, len, PCP_OPTION_THIRD_PARTY, &client,
+		    sizeof(client));
+
+	/* The rest only apply to MAP */
+	if (req->opcode != PCP_OPCODE_MAP)
+		return (len);
+
+	if (req->prefer_failure)
+		len = pcp_option(buf, len, PCP_OPTION_PREFER_FAILURE, NULL, 0);
+
+	/* Only accept traffic from the UPnP RemoteHost */
+	if (req->remote.s_addr != INADDR_ANY) {
+		memset(&pf, 0, sizeof(pf));
+		pf.prefix = 128;
+		pcp_v4mapped(&pf.remote, &req->remote);
+		len = pcp_option(buf, len, PCP_OPTION_FILTER, &pf, sizeof(pf));
+	}
+
+	return (len);
+}
+
+/* Start a new exchange with the server, or queue it until there is room
+ * in the window
+ */
+void
+pcp_send(struct pcp_request *req)
+{
+	struct pcp_server	*ps = req->server;
+
+	if (ps->inflight < ps->window && TAILQ_EMPTY(&ps->queue)) {
+		pcp_start(req);
+		return;
+	}
+
+	TAILQ_INSERT_TAIL(&ps->queue, req, entry);
+	req->queued = 1;
+}
+
+void
+pcp_start(struct pcp_request *req)
+{
+	struct timeval	 tv;
+
+	TAILQ_INSERT_TAIL(pcp_outstanding(req), req, entry);
+	req->server->inflight++;
+
+	req->rt = pcp_rt(PCP_IRT * 1000);
+	req->elapsed = 0;
+	req->sent = pcp_ms();
+
+	pcp_transmit(req);
+
+	tv.tv_sec = req->rt / 1000;
+	tv.tv_usec = (req->rt % 1000) * 1000;
+	evtimer_add(req->ev, &tv);
+}
+
+/* The exchange is over, which makes room for the next in the queue */
+void
+pcp_finish(struct pcp_request *req)
+{
+	TAILQ_REMOVE(pcp_outstanding(req), req, entry);
+	req->server->inflight--;
+	evtimer_del(req->ev);
+
+	pcp_dequeue(req->server);
+}
+
+void
+pcp_dequeue(struct pcp_server *ps)
+{
+	struct pcp_request	*req;
+
+	while (ps->inflight < ps->window &&
+	    (req = TAILQ_FIRST(&ps->queue)) != NULL) {
+		TAILQ_REMOVE(&ps->queue, req, entry);
+		req->queued = 0;
+		pcp_start(req);
+	}
+}
+
+/* Adapt the window to how quickly the server answers. It grows by one
+ * for each window's worth of prompt responses, shrinks by one once the
+ * smoothed round trip is double the quickest seen, as requests are
+ * queueing at the server, and halves on a retransmission
+ */
+void
+pcp_rtt(struct pcp_server *ps, struct pcp_request *req)
+{
+	u_int32_t	 rtt;
+
+	/* Can't tell which transmission a retransmitted one answers */
+	if (req->elapsed)
+		return;
+
+	rtt = MAX(pcp_ms() - req->sent, 1);
+
+	if (ps->base_rtt == 0 || rtt < ps->base_rtt)
+		ps->base_rtt = rtt;
+	ps->srtt = ps->srtt ? (7 * ps->srtt + rtt) / 8 : rtt;
+
+	if (ps->srtt > 2 * ps->base_rtt) {
+		if (ps->window > 1)
+			ps->window--;
+		ps->acks = 0;
+	} else if (++ps->acks >= ps->window) {
+		if (ps->window < ps->env->sc_pcp.window)
+			ps->window++;
+		ps->acks = 0;
+	}
+}
+
+void
+pcp_transmit(struct pcp_request *req)
+{
+	u_int32_t	 buf[PCP_MAX_PACKET_SIZE / sizeof(u_int32_t)];
+	size_t		 len;
+
+	len = pcp_encode(req, (u_int8_t *)buf);
+
+	/* Losing a packet here is no different to losing it on the wire */
+	if (send(req->server->fd, buf, len, 0) == -1)
+		log_warn("PCP send to %s",
+		    log_sockaddr((struct sockaddr *)&req->server->sa));
+}
+
+/* Retransmit or give up */
+void
+pcp_timeout(int fd, short event, void *arg)
+{
+	struct pcp_request	*req = (struct pcp_request *)arg;
+	struct timeval		 tv;
+
+	req->elapsed += req->rt;
+
+	if (req->elapsed >= PCP_FAILOVER_TIMEOUT * 1000 &&
+	    req->server->health == PCP_SERVER_UP) {
+		/* Never heard from at all, maybe it only knows NAT-PMP. This
+		 * sends the request again so there is nothing more to do
+		 */
+		if (!req->server->answered &&
+		    req->server->version != NATPMP_MAX_VERSION) {
+			pcp_version(req->server, NATPMP_MAX_VERSION);
+			return;
+		}
+		pcp_down(req->server);
+	}
+
+	/* Assume loss means the server or the path is overloaded */
+	req->server->window = MAX(req->server->window / 2, 1);
+	req->server->acks = 0;
+
+	if (req->duration && req->elapsed >= req->duration * 1000) {
+		pcp_finish(req);
+
+		if (req->state == PCP_STATE_RELEASING) {
+			pcp_free(req);
+			return;
+		}
+
+		req->state = PCP_STATE_FAILED;
+		req->result = -1;
+		pcp_complete(req);
+		return;
+	}
+
+	req->rt = pcp_rt(MIN(req->rt * 2, PCP_MRT * 1000));
+
+	pcp_transmit(req);
+
+	tv.tv_sec = req->rt / 1000;
+	tv.tv_usec = (req->rt % 1000) * 1000;
+	evtimer_add(req->ev, &tv);
+}
+
+/* Renew a granted mapping at somewhere between three eighths and half of
+ * its lifetime. Joining the earliest renewal already due in that range
+ * means one wakeup renews many mappings, and a new renewal is placed at
+ * random within it so they don't all line up. Nothing is renewed if the
+ * UPnP lease ends before the granted lifetime does
+ */
+void
+pcp_schedule(struct pcp_request *req)
+{
+	struct mapping		*m = req->m;
+	u_int64_t		 now;
+
+	if (m->expires && mapping_remaining(m) <= req->granted)
+		return;
+
+	now = pcp_ms() / 1000;
+	pcp_schedule_between(req, now + MAX((u_int64_t)req->granted * 3 / 8, 1),
+	    now + MAX(req->granted / 2, 1));
+}
+
+/* Renew somewhere between two times, in seconds */
+void
+pcp_schedule_between(struct pcp_request *req, u_int64_t low, u_int64_t high)
+{
+	struct igdpcpd		*env = req->env;
+	struct pcp_renewal	*rn, key;
+
+	key.due = low;
+	if ((rn = RB_NFIND(pcp_renewals, &env->sc_pcp.renewals, &key)) ==
+	    NULL || rn->due > high) {
+		if ((rn = calloc(1, sizeof(struct pcp_renewal))) == NULL)
+			fatal("calloc");
+		rn->due = low + arc4random_uniform(high - low + 1);
+		TAILQ_INIT(&rn->requests);
+		RB_INSERT(pcp_renewals, &env->sc_pcp.renewals, rn);
+
+		if (rn == RB_MIN(pcp_renewals, &env->sc_pcp.renewals))
+			pcp_renew_arm(env);
+	}
+
+	TAILQ_INSERT_TAIL(&rn->requests, req, renew_entry);
+	req->renewal = rn;
+}
+
+void
+pcp_unschedule(struct pcp_request *req)
+{
+	struct igdpcpd		*env = req->env;
+	struct pcp_renewal	*rn = req->renewal;
+
+	if (rn == NULL)
+		return;
+
+	TAILQ_REMOVE(&rn->requests, req, renew_entry);
+	req->renewal = NULL;
+
+	/* Leave the timer alone, it copes with a renewal going away */
+	if (TAILQ_EMPTY(&rn->requests)) {
+		RB_REMOVE(pcp_renewals, &env->sc_pcp.renewals, rn);
+		free(rn);
+	}
+}
+
+void
+pcp_renew_arm(struct igdpcpd *env)
+{
+	struct pcp_renewal	*rn;
+	struct timeval		 tv = { 0, 0 };
+	u_int64_t		 now;
+
+	if ((rn = RB_MIN(pcp_renewals, &env->sc_pcp.renewals)) == NULL) {
+		evtimer_del(env->sc_pcp.renew_ev);
+		return;
+	}
+
+	now = pcp_ms() / 1000;
+	if (rn->due > now)
+		tv.tv_sec = rn->due - now;
+	evtimer_add(env->sc_pcp.renew_ev, &tv);
+}
+
+/* Renew everything that is due. The requests go through each server's
+ * window like any other, so a large batch is pipelined rather than sent
+ * in one burst
+ */
+void
+pcp_renew(int fd, short event, void *arg)
+{
+	struct igdpcpd		*env = (struct igdpcpd *)arg;
+	struct pcp_renewal	*rn;
+	struct pcp_request	*req;
+	u_int64_t		 now = pcp_ms() / 1000;
+
+	while ((rn = RB_MIN(pcp_renewals, &env->sc_pcp.renewals)) != NULL &&
+	    rn->due <= now) {
+		RB_REMOVE(pcp_renewals, &env->sc_pcp.renewals, rn);
+
+		while ((req = TAILQ_FIRST(&rn->requests)) != NULL) {
+			TAILQ_REMOVE(&rn->requests, req, renew_entry);
+			req->renewal = NULL;
+
+			/* A refused mapping has nothing upstream to renew */
+			req->state = req->state == PCP_STATE_FAILED ?
+			    PCP_STATE_REQUESTING : PCP_STATE_RENEWING;
+			req->lifetime = pcp_lifetime(req->m);
+			req->duration = 0;
+			pcp_send(req);
+		}
+
+		free(rn);
+	}
+
+	pcp_renew_arm(env);
+}
+
+/* Hand the result to whoever asked for it. The callback may unmap and so
+ * free the request, so it must be the last thing to touch it
+ */
+void
+pcp_complete(struct pcp_request *req)
+{
+	void	(*cb)(struct pcp_request *, void *) = req->cb;
+
+	req->cb = NULL;
+
+	if (cb != NULL) {
+		cb(req, req->arg);
+		return;
+	}
+
+	if (req->result == -1)
+		log_warnx("PCP server %s did not respond",
+		    log_sockaddr((struct sockaddr *)&req->server->sa));
+	else if (req->result != PCP_SUCCESS)
+		log_warnx("PCP request for %s port %u failed with result %d",
+		    inet_ntoa(req->client), req->iport, req->result);
+}
+
+void
+pcp_free(struct pcp_request *req)
+{
+	event_free(req->ev);
+	free(req);
+}
+
+void
+pcp_recv(int fd, short event, void *arg)
+{
+	struct pcp_server	*ps = (struct pcp_server *)arg;
+	u_int32_t		 buf[PCP_MAX_PACKET_SIZE / sizeof(u_int32_t)];
+	ssize_t			 len;
+	int			 i;
+
+	/* Responses to a window of requests tend to arrive together */
+	for (i = 0; i < PCP_RECV_BATCH; i++) {
+		if ((len = recv(fd, buf, sizeof(buf), 0)) == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				log_warn("PCP recv from %s",
+				    log_sockaddr((struct sockaddr *)&ps->sa));
+			return;
+		}
+
+		pcp_response(ps, (u_int8_t *)buf, len);
+	}
+}
+
+void
+pcp_response(struct pcp_server *ps, u_int8_t *buf, size_t len)
+{
+	struct pcp_common_response	*cr;
+	struct pcp_map			*map;
+	struct pcp_request		*req;
+	struct pcp_packet		 pkt;
+	struct in_addr			 external;
+
+	/* RFC 6887 section 9, a NAT-PMP server answers in NAT-PMP */
+	if (len > 0 && buf[0] == NATPMP_MAX_VERSION) {
+		natpmp_response(ps, buf, len);
+		return;
+	}
+
+	/* RFC 6887 section 8.3 */
+	if (pcp_decode(buf, len, 1, &pkt) != PCP_SUCCESS) {
+		log_debug("bad PCP response from %s",
+		    log_sockaddr((struct sockaddr *)&ps->sa));
+		return;
+	}
+
+	ps->answered = 1;
+
+	/* Anything in PCP, even an error, means it speaks it after all */
+	if (ps->version != PCP_MAX_VERSION) {
+		pcp_version(ps, PCP_MAX_VERSION);
+		return;
+	}
+
+	cr = pkt.response;
+	pcp_up(ps);
+	pcp_epoch(ps, ntohl(cr->epoch));
+
+	/* MAP and PEER begin the same way */
+	if ((map = pkt.map) == NULL &&
+	    (map = (struct pcp_map *)pkt.peer) == NULL)
+		return;
+
+	/* Must match an outstanding request in every detail */
+	if ((req = pcp_lookup(ps->env, map->nonce, map->protocol,
+	    ntohs(map->iport))) == NULL || req->server != ps ||
+	    req->opcode != pkt.opcode || (pkt.peer != NULL &&
+	    (ntohs(pkt.peer->rport) != req->rport ||
+	    memcmp(&pkt.peer->remote.s6_addr[12], &req->remote,
+	    sizeof(struct in_addr))))) {
+		log_debug("unexpected PCP response from %s",
+		    log_sockaddr((struct sockaddr *)&ps->sa));
+		return;
+	}
+
+	memcpy(&external, &map->external.s6_addr[12], sizeof(external));
+	pcp_answer(req, cr->result, ntohl(cr->lifetime), ntohs(map->eport),
+	    &external);
+}
+
+void
+natpmp_response(struct pcp_server *ps, u_int8_t *buf, size_t len)
+{
+	struct natpmp_response	*nr;
+	struct pcp_request	*req;
+	u_int16_t		 result;
+	u_int8_t		 opcode, protocol;
+
+	if (natpmp_decode(buf, len, &nr) == -1) {
+		log_debug("bad NAT-PMP response from %s",
+		    log_sockaddr((struct sockaddr *)&ps->sa));
+		return;
+	}
+
+	ps->answered = 1;
+	result = ntohs(nr->result);
+
+	/* Not understanding a PCP request is the cue to fall back */
+	if (ps->version != NATPMP_MAX_VERSION) {
+		if (result == NATPMP_UNSUPP_VERSION)
+			pcp_version(ps, NATPMP_MAX_VERSION);
+		return;
+	}
+
+	pcp_up(ps);
+	pcp_epoch(ps, ntohl(nr->epoch));
+
+	opcode = nr->opcode & ~NATPMP_OPCODE_RESPONSE;
+	if (opcode == NATPMP_OPCODE_ADDRESS) {
+		if (result == NATPMP_SUCCESS) {
+			ps->external = nr->external;
+			pcp_external(ps, &ps->external);
+		}
+		return;
+	}
+
+	protocol = opcode == NATPMP_OPCODE_MAP_UDP ? IPPROTO_UDP : IPPROTO_TCP;
+
+	/* An error may stop after the epoch, with no ports to match on */
+	if (len < sizeof(struct natpmp_response)) {
+		if ((req = natpmp_oldest(ps, protocol)) == NULL) {
+			log_debug("unexpected NAT-PMP response from %s",
+			    log_sockaddr((struct sockaddr *)&ps->sa));
+			return;
+		}
+		pcp_answer(req, result < sizeof(natpmp_result) ?
+		    natpmp_result[result] : PCP_NETWORK_FAILURE, 0, 0, NULL);
+		return;
+	}
+
+	if ((req = natpmp_lookup(ps, protocol, ntohs(nr->map.iport))) ==
+	    NULL) {
+		log_debug("unexpected NAT-PMP response from %s",
+		    log_sockaddr((struct sockaddr *)&ps->sa));
+		return;
+	}
+
+	/* The external address only comes from asking for it */
+	pcp_answer(req, result < sizeof(natpmp_result) ?
+	    natpmp_result[result] : PCP_NETWORK_FAILURE,
+	    ntohl(nr->map.lifetime), ntohs(nr->map.eport),
+	    ps->external.s_addr != INADDR_ANY ? &ps->external : NULL);
+}
+
+/* A matching response from the server, in either version */
+void
+pcp_answer(struct pcp_request *req, int result, u_int32_t lifetime,
+    u_int16_t eport, struct in_addr *external)
+{
+	struct pcp_server	*ps = req->server;
+	char			 str[INET_ADDRSTRLEN];
+
+	pcp_rtt(ps, req);
+	pcp_finish(req);
+
+	if (req->state == PCP_STATE_RELEASING) {
+		pcp_free(req);
+		return;
+	}
+
+	req->result = result;
+
+	if (req->result != PCP_SUCCESS || lifetime == 0) {
+		req->state = PCP_STATE_FAILED;
+		/* Nobody waits on a renewal or resync, so it is dealt with here */
+		if (req->cb == NULL && pcp_refused(req, lifetime) == -1)
+			return;
+		pcp_complete(req);
+		return;
+	}
+
+	req->state = PCP_STATE_MAPPED;
+	req->retries = 0;
+	req->granted = lifetime;
+	req->eport = eport;
+	if (external != NULL) {
+		req->external = *external;
+		pcp_external(ps, external);
+	}
+
+	/* A new mapping's callback decides what to do with another port.
+	 * Otherwise, such as on a renewal or resync, the table follows the
+	 * server so it never advertises a port that isn't mapped upstream
+	 */
+	if (req->cb == NULL && eport != req->m->eport &&
+	    pcp_moved(req) == -1)
+		return;
+
+	pcp_schedule(req);
+
+	inet_ntop(AF_INET, &req->external, str, sizeof(str));
+	log_debug("PCP mapped %s port %u to %s:%u for %us",
+	    inet_ntoa(req->client), req->iport, str, req->eport,
+	    req->granted);
+
+	pcp_complete(req);
+}
+
+/* The server refused a mapping it isn't creating for the first time. A
+ * short-term error is tried again after the lifetime the server gave, or
+ * longer each time it happens again. Anything else won't get better, so
+ * the mapping is removed rather than advertised without upstream state,
+ * and -1 returned as the request may no longer be touched
+ */
+int
+pcp_refused(struct pcp_request *req, u_int32_t lifetime)
+{
+	u_int64_t	 now;
+	u_int32_t	 delay;
+
+	switch (req->result) {
+	case PCP_SUCCESS:	/* But no lifetime */
+	case PCP_NETWORK_FAILURE:
+	case PCP_NO_RESOURCES:
+	case PCP_USER_EX_QUOTA:
+	case PCP_CANNOT_PROVIDE_EXTERNAL:
+		break;
+	default:
+		log_warnx("PCP server refused %s port %u with result %d, "
+		    "removing it", inet_ntoa(req->client), req->iport,
+		    req->result);
+		mapping_delete(req->m);
+		return (-1);
+	}
+
+	delay = MIN(MAX(lifetime, PCP_IRT << req->retries), PCP_MRT);
+	if ((PCP_IRT << req->retries) < PCP_MRT)
+		req->retries++;
+
+	now = pcp_ms() / 1000;
+	pcp_schedule_between(req, now + delay, now + delay + delay / 4);
+
+	return (0);
+}
+
+/* The server granted a different external port to the one in the table.
+ * If another mapping already has that port then this one is dropped,
+ * which releases the port upstream, and -1 returned as the request may
+ * no longer be touched
+ */
+int
+pcp_moved(struct pcp_request *req)
+{
+	struct mapping	*m = req->m;
+
+	if (mapping_move(m, req->eport) == -1) {
+		log_warnx("PCP server moved %s port %u from %u to %u, "
+		    "which is taken, removing it", inet_ntoa(req->client),
+		    req->iport, m->eport, req->eport);
+		mapping_delete(m);
+		return (-1);
+	}
+
+	log_info("PCP server moved %s port %u to external port %u",
+	    inet_ntoa(req->client), req->iport, req->eport);
+
+	return (0);
+}
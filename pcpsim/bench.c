@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2014 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Drive igdpcpd with AddPortMapping actions while it maps them upstream
+ * through the simulator, which is in the same process so its counters
+ * can be reported alongside the latencies
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+#include "pcpsim.h"
+
+#define	BENCH_SERVICE	 "urn:schemas-upnp-org:service:WANIPConnection:2"
+
+/* One connection to igdpcpd, with one action outstanding at a time */
+struct bench_slot {
+	struct bench			*b;
+	struct evhttp_connection	*evcon;
+	u_int64_t			 start;	/* Microseconds */
+};
+
+struct bench {
+	struct sim		*sim;
+	struct sim_stats	 stats;		/* Simulator counters before */
+	char			 host[NI_MAXHOST];
+	const char		*path;
+	const char		*target;	/* NewInternalClient */
+	u_int16_t		 port;		/* First mapped */
+	u_int32_t		 count;
+	u_int32_t		 next;
+	u_int32_t		 done;
+	u_int32_t		 errors;
+	u_int32_t		*latency;	/* Microseconds */
+	u_int64_t		 start;
+	struct bench_slot	*slots;
+};
+
+u_int64_t	 bench_us(void);
+int		 bench_cmp(const void *, const void *);
+void		 bench_next(struct bench_slot *);
+void		 bench_done(struct evhttp_request *, void *);
+void		 bench_report(struct bench *);
+size_t		 bench_sample(u_int8_t *, int);
+
+u_int64_t
+bench_us(void)
+{
+	struct timespec	 ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		fatal("clock_gettime");
+
+	return ((u_int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+int
+bench_cmp(const void *a, const void *b)
+{
+	u_int32_t	 x = *(const u_int32_t *)a, y = *(const u_int32_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+void
+bench_next(struct bench_slot *bs)
+{
+	struct bench		*b = bs->b;
+	struct evhttp_request	*req;
+	struct evkeyvalq	*headers;
+	u_int16_t		 port;
+
+	if (b->next == b->count)
+		return;
+
+	port = b->port + b->next++;
+
+	if ((req = evhttp_request_new(bench_done, bs)) == NULL)
+		fatal("evhttp_request_new");
+
+	headers = evhttp_request_get_output_headers(req);
+	evhttp_add_header(headers, "Host", b->host);
+	evhttp_add_header(headers, "Content-Type",
+	    "text/xml; charset=\"utf-8\"");
+	evhttp_add_header(headers, "SOAPAction",
+	    "\"" BENCH_SERVICE "#AddPortMapping\"");
+
+	evbuffer_add_printf(evhttp_request_get_output_buffer(req),
+	    "<?xml version=\"1.0\"?>"
+	    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\""
+	    " s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+	    "<s:Body><u:AddPortMapping xmlns:u=\"" BENCH_SERVICE "\">"
+	    "<NewRemoteHost></NewRemoteHost>"
+	    "<NewExternalPort>%u</NewExternalPort>"
+	    "<NewProtocol>TCP</NewProtocol>"
+	    "<NewInternalPort>%u</NewInternalPort>"
+	    "<NewInternalClient>%s</NewInternalClient>"
+	    "<NewEnabled>1</NewEnabled>"
+	    "<NewPortMappingDescription>pcpsim</NewPortMappingDescription>"
+	    "<NewLeaseDuration>0</NewLeaseDuration>"
+	    "</u:AddPortMapping></s:Body></s:Envelope>",
+	    port, port, b->target);
+
+	bs->start = bench_us();
+
+	if (evhttp_make_request(bs->evcon, req, EVHTTP_REQ_POST,
+	    b->path) == -1)
+		fatalx("evhttp_make_request");
+}
+
+void
+bench_done(struct evhttp_request *req, void *arg)
+{
+	struct bench_slot	*bs = (struct bench_slot *)arg;
+	struct bench		*b = bs->b;
+
+	b->latency[b->done++] = bench_us() - bs->start;
+
+	if (req == NULL || evhttp_request_get_response_code(req) != HTTP_OK)
+		b->errors++;
+
+	if (b->done < b->count) {
+		bench_next(bs);
+		return;
+	}
+
+	bench_report(b);
+	event_base_loopexit(b->sim->base, NULL);
+}
+
+void
+bench_report(struct bench *b)
+{
+	struct sim_stats	*s = &b->sim->stats;
+	u_int64_t		 elapsed = bench_us() - b->start;
+
+	qsort(b->latency, b->count, sizeof(u_int32_t), bench_cmp);
+
+	printf("%u mappings in %llu ms, %llu/s\n", b->count,
+	    elapsed / 1000, b->count * 1000000ULL / MAX(elapsed, 1));
+	printf("latency p50 %u.%03u ms, p99 %u.%03u ms, max %u.%03u ms\n",
+	    b->latency[b->count / 2] / 1000, b->latency[b->count / 2] % 1000,
+	    b->latency[b->count * 99 / 100] / 1000,
+	    b->latency[b->count * 99 / 100] % 1000,
+	    b->latency[b->count - 1] / 1000, b->latency[b->count - 1] % 1000);
+	printf("errors %u, PCP requests %llu, dropped %llu, "
+	    "retransmits %llu\n", b->errors,
+	    s->requests - b->stats.requests, s->dropped - b->stats.dropped,
+	    s->retransmits - b->stats.retransmits);
+}
+
+void
+bench(struct sim *sim, const char *url, const char *target,
+    u_int32_t count, u_int32_t concurrency, u_int16_t port)
+{
+	struct bench		*b;
+	struct evhttp_uri	*uri;
+	u_int32_t		 i;
+	int			 p;
+
+	if ((uri = evhttp_uri_parse(url)) == NULL ||
+	    evhttp_uri_get_host(uri) == NULL)
+		errx(1, "bad url %s", url);
+
+	if ((b = calloc(1, sizeof(struct bench))) == NULL ||
+	    (b->latency = calloc(count, sizeof(u_int32_t))) == NULL ||
+	    (b->slots = calloc(concurrency,
+	    sizeof(struct bench_slot))) == NULL)
+		fatal("calloc");
+
+	b->sim = sim;
+	b->stats = sim->stats;
+	b->path = evhttp_uri_get_path(uri);
+	b->target = target;
+	b->port = port;
+	b->count = count;
+
+	if ((p = evhttp_uri_get_port(uri)) == -1)
+		p = 80;
+	snprintf(b->host, sizeof(b->host), "%s:%d",
+	    evhttp_uri_get_host(uri), p);
+
+	b->start = bench_us();
+
+	for (i = 0; i < concurrency; i++) {
+		b->slots[i].b = b;
+		if ((b->slots[i].evcon = evhttp_connection_base_new(sim->base,
+		    NULL, evhttp_uri_get_host(uri), p)) == NULL)
+			fatalx("evhttp_connection_base_new");
+		bench_next(&b->slots[i]);
+	}
+}
+
+/* Representative packets for the decode benchmark, with every option and
+ * opcode the codec knows about
+ */
+size_t
+bench_sample(u_int8_t *buf, int which)
+{
+	struct pcp_common_response	*cr = (struct pcp_common_response *)buf;
+	struct pcp_map			*map;
+	struct pcp_peer			*peer;
+	struct pcp_filter		 pf;
+	struct in6_addr			 client = IN6ADDR_V4MAPPED_INIT;
+	size_t				 len;
+
+	memset(buf, 0, PCP_MAX_PACKET_SIZE);
+	client.s6_addr[12] = 192;
+	client.s6_addr[15] = 2;
+
+	switch (which) {
+	case 0:
+		/* MAP on behalf of another client with two filters */
+		len = pcp_header(buf, PCP_OPCODE_MAP, 3600, &client);
+		map = (struct pcp_map *)(buf + len);
+		arc4random_buf(map->nonce, sizeof(map->nonce));
+		map->protocol = IPPROTO_TCP;
+		map->iport = map->eport = htons(8080);
+		len += sizeof(struct pcp_map);
+		len = pcp_option(buf, len, PCP_OPTION_THIRD_PARTY, &client,
+		    sizeof(client));
+		len = pcp_option(buf, len, PCP_OPTION_PREFER_FAILURE, NULL, 0);
+		memset(&pf, 0, sizeof(pf));
+		pf.prefix = 128;
+		pf.remote = client;
+		len = pcp_option(buf, len, PCP_OPTION_FILTER, &pf, sizeof(pf));
+		len = pcp_option(buf, len, PCP_OPTION_FILTER, &pf, sizeof(pf));
+		return (len);
+	case 1:
+		/* The response to it, options echoed */
+		len = bench_sample(buf, 0);
+		buf[1] |= PCP_OPCODE_RESPONSE;
+		cr->epoch = htonl(1000);
+		return (len);
+	case 2:
+		len = pcp_header(buf, PCP_OPCODE_PEER, 3600, &client);
+		peer = (struct pcp_peer *)(buf + len);
+		arc4random_buf(peer->nonce, sizeof(peer->nonce));
+		peer->protocol = IPPROTO_UDP;
+		peer->iport = peer->eport = peer->rport = htons(5060);
+		peer->remote = client;
+		return (len + sizeof(struct pcp_peer));
+	default:
+		len = pcp_header(buf, PCP_OPCODE_ANNOUNCE, 0, &client);
+		buf[1] |= PCP_OPCODE_RESPONSE;
+		return (len);
+	}
+}
+
+#define	BENCH_SAMPLES	 4
+
+/* Time decoding valid packets, then throw randomly damaged copies at the
+ * decoder and count what it makes of them. Run under a memory checker
+ * this shakes out any read past the validated length
+ */
+void
+bench_decode(u_int32_t count)
+{
+	u_int32_t		 buf[BENCH_SAMPLES][PCP_MAX_PACKET_SIZE /
+				     sizeof(u_int32_t)];
+	u_int32_t		 copy[PCP_MAX_PACKET_SIZE / sizeof(u_int32_t)];
+	size_t			 len[BENCH_SAMPLES], n;
+	struct pcp_packet	 pkt;
+	u_int64_t		 start, elapsed, results[256];
+	u_int32_t		 i, j, accepted = 0;
+	int			 k;
+
+	for (k = 0; k < BENCH_SAMPLES; k++)
+		len[k] = bench_sample((u_int8_t *)buf[k], k);
+
+	start = bench_us();
+	for (i = 0; i < count; i++) {
+		k = i % BENCH_SAMPLES;
+		if (pcp_decode((u_int8_t *)buf[k], len[k],
+		    ((u_int8_t *)buf[k])[1] & PCP_OPCODE_RESPONSE,
+		    &pkt) != PCP_SUCCESS)
+			errx(1, "sample %d doesn't decode", k);
+	}
+	elapsed = MAX(bench_us() - start, 1);
+
+	printf("decoded %u packets in %llu us, %llu ns each, %llu/s\n",
+	    count, elapsed, elapsed * 1000 / count,
+	    count * 1000000ULL / elapsed);
+
+	memset(results, 0, sizeof(results));
+	for (i = 0; i < count; i++) {
+		k = arc4random_uniform(BENCH_SAMPLES);
+		memcpy(copy, buf[k], sizeof(copy));
+
+		/* Damage a few bytes, and sometimes the length */
+		for (j = arc4random_uniform(4) + 1; j; j--)
+			((u_int8_t *)copy)[arc4random_uniform(len[k])] =
+			    arc4random();
+		n = len[k];
+		if (arc4random_uniform(4) == 0)
+			n = arc4random_uniform(len[k] + 1);
+
+		results[pcp_decode((u_int8_t *)copy, n,
+		    ((u_int8_t *)copy)[1] & PCP_OPCODE_RESPONSE, &pkt)]++;
+	}
+
+	accepted = results[PCP_SUCCESS];
+	printf("damaged %u packets, %u accepted", count, accepted);
+	for (k = 1; k < 256; k++)
+		if (results[k])
+			printf(", %llu result %d", results[k], k);
+	printf("\n");
+}
@@ -0,0 +1,803 @@
+/*
+ * Copyright (c) 2014 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* A stand-in for a carrier-grade NAT's PCP server, good enough to develop
+ * and measure igdpcpd against without one. It keeps mappings in memory and
+ * can add latency, lose packets, clamp lifetimes, move mappings to another
+ * external port on renewal and restart on a timer
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pcpsim.h"
+
+/* Most lifetime granted unless told otherwise, in seconds */
+#define	SIM_LIFETIME		 7200
+
+/* Seconds between sweeps for expired mappings */
+#define	SIM_SWEEP_INTERVAL	 10
+
+/* A nonce not seen for this long is forgotten */
+#define	SIM_EXCHANGE_TIMEOUT	 (2 * PCP_MRT)
+
+/* External ports handed out when the suggestion can't be honoured */
+#define	SIM_PORT_FIRST		 1024
+
+/* A response waiting out the simulated latency */
+struct sim_reply {
+	struct sim		*sim;
+	struct event		*ev;
+	struct sockaddr_storage	 ss;
+	socklen_t		 slen;
+	size_t			 len;
+	u_int32_t		 buf[PCP_MAX_PACKET_SIZE / sizeof(u_int32_t)];
+};
+
+__dead void	 usage(void);
+int		 sim_mapping_cmp(struct sim_mapping *, struct sim_mapping *);
+int		 sim_exchange_cmp(struct sim_exchange *, struct sim_exchange *);
+int		 sim_protocol(u_int8_t);
+int		 sim_lost(struct sim *);
+int		 sim_moved(struct sim *);
+void		 sim_v4mapped(struct in6_addr *, struct in_addr *);
+struct sim_exchange	*sim_exchange(struct sim *, u_int8_t, u_int8_t *,
+			     u_int8_t, u_int16_t);
+void		 sim_answered(struct sim *, u_int8_t *, size_t);
+void		 sim_release(struct sim *, struct sim_mapping *);
+u_int16_t	 sim_allocate(struct sim *, int, u_int16_t);
+int		 sim_map(struct sim *, struct pcp_common_request *,
+		     struct in6_addr *, int, u_int8_t *, u_int32_t *);
+void		 sim_recv(int, short, void *);
+void		 sim_request(struct sim *, u_int8_t *, size_t,
+		     struct sockaddr_storage *, socklen_t);
+void		 sim_reply(struct sim *, u_int8_t *, size_t,
+		     struct sockaddr_storage *, socklen_t);
+void		 sim_send(int, short, void *);
+void		 sim_announce(struct sim *);
+void		 sim_sweep(int, short, void *);
+void		 sim_reset(int, short, void *);
+void		 sim_signal(int, short, void *);
+
+RB_GENERATE(sim_mappings, sim_mapping, entry, sim_mapping_cmp);
+RB_GENERATE(sim_exchanges, sim_exchange, entry, sim_exchange_cmp);
+
+extern char	*__progname;
+
+struct sockaddr_in	 pcp4;
+
+__dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-v] [-a address] [-d delay] [-j jitter] "
+	    "[-L lifetime] [-l loss]\n"
+	    "\t[-m move] [-p port] [-r reset] [-x external]\n"
+	    "       %s -b [-c concurrency] [-n count] [-P port] "
+	    "[-t client] -u url\n"
+	    "       %s -D count\n", __progname, __progname, __progname);
+	exit(1);
+}
+
+/* Mappings are owned by the internal address, protocol and port, and for
+ * PEER the remote peer too
+ */
+int
+sim_mapping_cmp(struct sim_mapping *a, struct sim_mapping *b)
+{
+	int	 r;
+
+	if ((r = memcmp(&a->client, &b->client, sizeof(a->client))) != 0)
+		return (r);
+	if (a->opcode != b->opcode)
+		return (a->opcode < b->opcode ? -1 : 1);
+	if (a->protocol != b->protocol)
+		return (a->protocol < b->protocol ? -1 : 1);
+	if (a->iport != b->iport)
+		return (a->iport < b->iport ? -1 : 1);
+	if ((r = memcmp(&a->remote, &b->remote, sizeof(a->remote))) != 0)
+		return (r);
+	if (a->rport != b->rport)
+		return (a->rport < b->rport ? -1 : 1);
+
+	return (0);
+}
+
+int
+sim_exchange_cmp(struct sim_exchange *a, struct sim_exchange *b)
+{
+	int	 r;
+
+	if ((r = memcmp(a->nonce, b->nonce, sizeof(a->nonce))) != 0)
+		return (r);
+	if (a->opcode != b->opcode)
+		return (a->opcode < b->opcode ? -1 : 1);
+	if (a->protocol != b->protocol)
+		return (a->protocol < b->protocol ? -1 : 1);
+	if (a->iport != b->iport)
+		return (a->iport < b->iport ? -1 : 1);
+
+	return (0);
+}
+
+u_int64_t
+sim_now(void)
+{
+	struct timespec	 ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		fatal("clock_gettime");
+
+	return (ts.tv_sec);
+}
+
+int
+sim_protocol(u_int8_t protocol)
+{
+	switch (protocol) {
+	case IPPROTO_TCP:
+		return (SIM_PROTOCOL_TCP);
+	case IPPROTO_UDP:
+		return (SIM_PROTOCOL_UDP);
+	default:
+		return (-1);
+	}
+}
+
+int
+sim_lost(struct sim *sim)
+{
+	return (sim->loss && arc4random_uniform(100) < sim->loss);
+}
+
+int
+sim_moved(struct sim *sim)
+{
+	return (sim->move && arc4random_uniform(100) < sim->move);
+}
+
+void
+sim_v4mapped(struct in6_addr *in6, struct in_addr *in)
+{
+	struct in6_addr	 v4mapped = IN6ADDR_V4MAPPED_INIT;
+
+	*in6 = v4mapped;
+	memcpy(&in6->s6_addr[12], in, sizeof(struct in_addr));
+}
+
+/* Note a request, counting it as a retransmission if the response to the
+ * last one with the same nonce never made it back
+ */
+struct sim_exchange *
+sim_exchange(struct sim *sim, u_int8_t opcode, u_int8_t *nonce,
+    u_int8_t protocol, u_int16_t iport)
+{
+	struct sim_exchange	*ex, key;
+
+	memcpy(key.nonce, nonce, sizeof(key.nonce));
+	key.opcode = opcode;
+	key.protocol = protocol;
+	key.iport = iport;
+
+	if ((ex = RB_FIND(sim_exchanges, &sim->exchanges, &key)) == NULL) {
+		if ((ex = calloc(1, sizeof(struct sim_exchange))) == NULL)
+			fatal("calloc");
+		memcpy(ex, &key, sizeof(key));
+		RB_INSERT(sim_exchanges, &sim->exchanges, ex);
+	} else if (!ex->answered)
+		sim->stats.retransmits++;
+
+	ex->answered = 0;
+	ex->seen = sim_now();
+
+	return (ex);
+}
+
+/* A response has been delivered */
+void
+sim_answered(struct sim *sim, u_int8_t *buf, size_t len)
+{
+	struct pcp_common_response	*cr = (struct pcp_common_response *)buf;
+	struct pcp_map			*map;
+	struct sim_exchange		*ex, key;
+	u_int8_t			 opcode;
+
+	opcode = cr->opcode & ~PCP_OPCODE_RESPONSE;
+	if (opcode != PCP_OPCODE_MAP && opcode != PCP_OPCODE_PEER)
+		return;
+
+	/* MAP and PEER begin the same way */
+	map = (struct pcp_map *)(buf + sizeof(struct pcp_common_response));
+	memcpy(key.nonce, map->nonce, sizeof(key.nonce));
+	key.opcode = opcode;
+	key.protocol = map->protocol;
+	key.iport = ntohs(map->iport);
+
+	if ((ex = RB_FIND(sim_exchanges, &sim->exchanges, &key)) != NULL)
+		ex->answered = 1;
+}
+
+void
+sim_release(struct sim *sim, struct sim_mapping *sm)
+{
+	int	 p = sim_protocol(sm->protocol);
+
+	sim->used[p][sm->eport / 8] &= ~(1 << (sm->eport % 8));
+	RB_REMOVE(sim_mappings, &sim->mappings, sm);
+	sim->count--;
+	free(sm);
+}
+
+/* The suggested port if it is free, otherwise the first free one after a
+ * random starting point. Zero if it has to be the suggested port, or there
+ * are none left
+ */
+u_int16_t
+sim_allocate(struct sim *sim, int p, u_int16_t eport)
+{
+	u_int32_t	 i, port, range = 65536 - SIM_PORT_FIRST;
+	u_int8_t	*used = sim->used[p];
+
+	if (eport && !(used[eport / 8] & (1 << (eport % 8))))
+		return (eport);
+
+	port = SIM_PORT_FIRST + arc4random_uniform(range);
+	for (i = 0; i < range; i++, port++) {
+		if (port > 65535)
+			port = SIM_PORT_FIRST;
+		if (!(used[port / 8] & (1 << (port % 8))))
+			return (port);
+	}
+
+	return (0);
+}
+
+/* Create, refresh or delete a mapping, MAP and PEER differ only in the
+ * remote peer. Returns the result and fills in the assigned port and
+ * granted lifetime
+ */
+int
+sim_map(struct sim *sim, struct pcp_common_request *cr,
+    struct in6_addr *client, int prefer_failure, u_int8_t *body,
+    u_int32_t *lifetime)
+{
+	struct pcp_map		*map = (struct pcp_map *)body;
+	struct pcp_peer		*peer = (struct pcp_peer *)body;
+	struct sim_mapping	*sm, key;
+	u_int16_t		 eport;
+	int			 p;
+
+	if ((p = sim_protocol(map->protocol)) == -1)
+		return (PCP_UNSUPP_PROTOCOL);
+
+	memset(&key, 0, sizeof(key));
+	key.client = *client;
+	key.opcode = cr->opcode;
+	key.protocol = map->protocol;
+	key.iport = ntohs(map->iport);
+	if (cr->opcode == PCP_OPCODE_PEER) {
+		key.remote = peer->remote;
+		key.rport = peer->rport;
+	}
+
+	*lifetime = MIN(ntohl(cr->lifetime), sim->lifetime);
+
+	if ((sm = RB_FIND(sim_mappings, &sim->mappings, &key)) != NULL &&
+	    sm->expires <= sim_now()) {
+		sim_release(sim, sm);
+		sm = NULL;
+	}
+
+	if (sm != NULL) {
+		/* Only whoever created the mapping can change it */
+		if (memcmp(sm->nonce, map->nonce, sizeof(sm->nonce)))
+			return (PCP_NOT_AUTHORISED);
+
+		if (*lifetime == 0) {
+			map->eport = htons(sm->eport);
+			sim_release(sim, sm);
+			return (PCP_SUCCESS);
+		}
+
+		/* As if the mapping was lost and made again somewhere else,
+		 * which a client that insists on its port won't accept
+		 */
+		if (!prefer_failure && sim_moved(sim) &&
+		    (eport = sim_allocate(sim, p, 0)) != 0) {
+			sim->used[p][sm->eport / 8] &= ~(1 << (sm->eport % 8));
+			sim->used[p][eport / 8] |= 1 << (eport % 8);
+			sm->eport = eport;
+			sim->stats.moves++;
+		}
+
+		map->eport = htons(sm->eport);
+
+		sm->expires = sim_now() + *lifetime;
+		return (PCP_SUCCESS);
+	}
+
+	/* Deleting something that doesn't exist succeeds */
+	if (*lifetime == 0)
+		return (PCP_SUCCESS);
+
+	if ((eport = sim_allocate(sim, p, ntohs(map->eport))) == 0 ||
+	    (prefer_failure && eport != ntohs(map->eport)))
+		return (PCP_CANNOT_PROVIDE_EXTERNAL);
+
+	if ((sm = calloc(1, sizeof(struct sim_mapping))) == NULL)
+		return (PCP_NO_RESOURCES);
+
+	memcpy(sm, &key, sizeof(key));
+	memcpy(sm->nonce, map->nonce, sizeof(sm->nonce));
+	sm->eport = eport;
+	sm->expires = sim_now() + *lifetime;
+	RB_INSERT(sim_mappings, &sim->mappings, sm);
+	sim->count++;
+	sim->used[p][eport / 8] |= 1 << (eport % 8);
+
+	map->eport = htons(eport);
+
+	return (PCP_SUCCESS);
+}
+
+void
+sim_recv(int fd, short event, void *arg)
+{
+	struct sim		*sim = (struct sim *)arg;
+	struct sockaddr_storage	 ss;
+	socklen_t		 slen;
+	u_int32_t		 buf[PCP_MAX_PACKET_SIZE / sizeof(u_int32_t) + 1];
+	ssize_t			 len;
+
+	for (;;) {
+		slen = sizeof(ss);
+		if ((len = recvfrom(fd, buf, sizeof(buf), 0,
+		    (struct sockaddr *)&ss, &slen)) == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				log_warn("recvfrom");
+			return;
+		}
+
+		sim_request(sim, (u_int8_t *)buf, len, &ss, slen);
+	}
+}
+
+/* Answer a request in place, RFC 6887 sections 7 and 8 */
+void
+sim_request(struct sim *sim, u_int8_t *buf, size_t len,
+    struct sockaddr_storage *ss, socklen_t slen)
+{
+	struct pcp_common_request	*cr = (struct pcp_common_request *)buf;
+	struct pcp_common_response	*rsp = (struct pcp_common_response *)buf;
+	struct pcp_packet		 pkt;
+	struct pcp_map			*map;
+	struct in6_addr			 source;
+	u_int32_t			 lifetime = 0;
+	int				 result;
+
+	sim->stats.requests++;
+
+	/* Silently dropped, RFC 6887 section 8.3 */
+	if (len < sizeof(struct pcp_common_request) ||
+	    len > PCP_MAX_PACKET_SIZE || (cr->opcode & PCP_OPCODE_RESPONSE))
+		return;
+
+	result = pcp_decode(buf, len, 0, &pkt);
+	if (result != PCP_UNSUPP_OPCODE && cr->opcode <= PCP_OPCODE_PEER)
+		sim->stats.opcodes[cr->opcode]++;
+
+	/* MAP and PEER begin the same way */
+	if ((map = pkt.map) == NULL)
+		map = (struct pcp_map *)pkt.peer;
+	if (map != NULL)
+		sim_exchange(sim, pkt.opcode, map->nonce, map->protocol,
+		    ntohs(map->iport));
+
+	if (sim_lost(sim)) {
+		sim->stats.dropped++;
+		return;
+	}
+
+	/* The client address has to be the one the request came from */
+	switch (ss->ss_family) {
+	case AF_INET:
+		sim_v4mapped(&source,
+		    &((struct sockaddr_in *)ss)->sin_addr);
+		break;
+	default:
+		source = ((struct sockaddr_in6 *)ss)->sin6_addr;
+		break;
+	}
+
+	if (result == PCP_SUCCESS &&
+	    memcmp(&cr->client, &source, sizeof(source)))
+		result = PCP_ADDRESS_MISMATCH;
+
+	if (result == PCP_SUCCESS && map != NULL)
+		result = sim_map(sim, cr, pkt.third_party ? pkt.third_party :
+		    &cr->client, pkt.prefer_failure, (u_int8_t *)map,
+		    &lifetime);
+
+	if (result != PCP_SUCCESS) {
+		sim->stats.errors++;
+		lifetime = PCP_SHORT_LIFETIME;
+	} else if (map != NULL)
+		sim_v4mapped(&map->external, &sim->external);
+
+	/* The opcode body and options are echoed back */
+	rsp->version = PCP_MAX_VERSION;
+	rsp->opcode |= PCP_OPCODE_RESPONSE;
+	rsp->reserved = 0;
+	rsp->result = result;
+	rsp->lifetime = htonl(lifetime);
+	rsp->epoch = htonl(sim_now() - sim->epoch);
+	memset(rsp->reserved2, 0, sizeof(rsp->reserved2));
+
+	sim_reply(sim, buf, len, ss, slen);
+}
+
+void
+sim_reply(struct sim *sim, u_int8_t *buf, size_t len,
+    struct sockaddr_storage *ss, socklen_t slen)
+{
+	struct sim_reply	*sr;
+	struct timeval		 tv;
+	u_int32_t		 ms;
+
+	if ((sr = calloc(1, sizeof(struct sim_reply))) == NULL)
+		fatal("calloc");
+
+	if ((sr->ev = evtimer_new(sim->base, sim_send, sr)) == NULL)
+		fatal("evtimer_new");
+
+	sr->sim = sim;
+	memcpy(&sr->ss, ss, slen);
+	sr->slen = slen;
+	sr->len = len;
+	memcpy(sr->buf, buf, len);
+
+	ms = sim->delay;
+	if (sim->jitter)
+		ms += arc4random_uniform(sim->jitter + 1);
+
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	evtimer_add(sr->ev, &tv);
+}
+
+void
+sim_send(int fd, short event, void *arg)
+{
+	struct sim_reply	*sr = (struct sim_reply *)arg;
+	struct sim		*sim = sr->sim;
+
+	if (sim_lost(sim))
+		sim->stats.dropped++;
+	else if (sendto(sim->fd, sr->buf, sr->len, 0,
+	    (struct sockaddr *)&sr->ss, sr->slen) == -1)
+		log_warn("sendto");
+	else
+		sim_answered(sim, (u_int8_t *)sr->buf, sr->len);
+
+	event_free(sr->ev);
+	free(sr);
+}
+
+/* Tell clients on the link that mappings have been lost */
+void
+sim_announce(struct sim *sim)
+{
+	struct pcp_common_response	 rsp;
+
+	memset(&rsp, 0, sizeof(rsp));
+	rsp.version = PCP_MAX_VERSION;
+	rsp.opcode = PCP_OPCODE_ANNOUNCE|PCP_OPCODE_RESPONSE;
+	rsp.result = PCP_SUCCESS;
+	rsp.epoch = htonl(sim_now() - sim->epoch);
+
+	if (sendto(sim->fd, &rsp, sizeof(rsp), 0, (struct sockaddr *)&pcp4,
+	    sizeof(pcp4)) == -1)
+		log_warn("sendto %s", log_sockaddr((struct sockaddr *)&pcp4));
+}
+
+void
+sim_sweep(int fd, short event, void *arg)
+{
+	struct sim		*sim = (struct sim *)arg;
+	struct sim_mapping	*sm, *next;
+	struct sim_exchange	*ex, *nex;
+	struct timeval		 tv = { SIM_SWEEP_INTERVAL, 0 };
+	u_int64_t		 now = sim_now();
+
+	for (sm = RB_MIN(sim_mappings, &sim->mappings); sm; sm = next) {
+		next = RB_NEXT(sim_mappings, &sim->mappings, sm);
+		if (sm->expires <= now)
+			sim_release(sim, sm);
+	}
+
+	for (ex = RB_MIN(sim_exchanges, &sim->exchanges); ex; ex = nex) {
+		nex = RB_NEXT(sim_exchanges, &sim->exchanges, ex);
+		if (now - ex->seen > SIM_EXCHANGE_TIMEOUT) {
+			RB_REMOVE(sim_exchanges, &sim->exchanges, ex);
+			free(ex);
+		}
+	}
+
+	evtimer_add(sim->sweep_ev, &tv);
+}
+
+/* Forget every mapping and start a new epoch, as a restart would */
+void
+sim_restart(struct sim *sim)
+{
+	struct sim_mapping	*sm;
+
+	while ((sm = RB_ROOT(&sim->mappings)) != NULL)
+		sim_release(sim, sm);
+
+	sim->epoch = sim_now();
+	sim->stats.resets++;
+
+	log_info("restarted, all mappings lost");
+
+	sim_announce(sim);
+}
+
+void
+sim_reset(int fd, short event, void *arg)
+{
+	struct sim	*sim = (struct sim *)arg;
+	struct timeval	 tv = { sim->reset, 0 };
+
+	sim_restart(sim);
+
+	evtimer_add(sim->reset_ev, &tv);
+}
+
+void
+sim_report(struct sim *sim)
+{
+	log_info("requests %llu (announce %llu, map %llu, peer %llu), "
+	    "errors %llu, dropped %llu, retransmits %llu, restarts %llu, "
+	    "moves %llu, mappings %u",
+	    sim->stats.requests, sim->stats.opcodes[PCP_OPCODE_ANNOUNCE],
+	    sim->stats.opcodes[PCP_OPCODE_MAP],
+	    sim->stats.opcodes[PCP_OPCODE_PEER], sim->stats.errors,
+	    sim->stats.dropped, sim->stats.retransmits, sim->stats.resets,
+	    sim->stats.moves, sim->count);
+}
+
+void
+sim_signal(int sig, short event, void *arg)
+{
+	struct sim	*sim = (struct sim *)arg;
+
+	switch (sig) {
+	case SIGHUP:
+		sim_restart(sim);
+		break;
+	case SIGUSR1:
+		sim_report(sim);
+		break;
+	default:
+		sim_report(sim);
+		exit(0);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sim	 sim;
+	struct event	*ev_sighup, *ev_sigusr1, *ev_sigint, *ev_sigterm;
+	struct timeval	 tv = { SIM_SWEEP_INTERVAL, 0 };
+	const char	*errstr, *url = NULL, *target = "127.0.0.1";
+	u_int32_t	 count = 1000, concurrency = 16, decode = 0;
+	u_int16_t	 port = 20000;
+	int		 c, benchmark = 0, verbose = 0;
+	unsigned char	 loop = 1;
+
+	memset(&sim, 0, sizeof(sim));
+	sim.sa.sin_family = AF_INET;
+	sim.sa.sin_len = sizeof(sim.sa);
+	sim.sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sim.sa.sin_port = htons(PCP_SERVER_PORT);
+	sim.external.s_addr = htonl(0xc0000201);	/* 192.0.2.1 */
+	sim.lifetime = SIM_LIFETIME;
+
+	memset(&pcp4, 0, sizeof(pcp4));
+	pcp4.sin_family = AF_INET;
+	pcp4.sin_len = sizeof(pcp4);
+	pcp4.sin_addr.s_addr = htonl(INADDR_ALLHOSTS_GROUP);
+	pcp4.sin_port = htons(PCP_CLIENT_PORT);
+
+	while ((c = getopt(argc, argv, "a:bc:D:d:j:L:l:m:n:P:p:r:t:u:vx:")) !=
+	    -1) {
+		switch (c) {
+		case 'a':
+			if (inet_pton(AF_INET, optarg,
+			    &sim.sa.sin_addr) != 1)
+				errx(1, "bad address %s", optarg);
+			break;
+		case 'b':
+			benchmark = 1;
+			break;
+		case 'c':
+			concurrency = strtonum(optarg, 1, 1024, &errstr);
+			if (errstr)
+				errx(1, "concurrency is %s", errstr);
+			break;
+		case 'D':
+			decode = strtonum(optarg, 1, UINT32_MAX, &errstr);
+			if (errstr)
+				errx(1, "count is %s", errstr);
+			break;
+		case 'd':
+			sim.delay = strtonum(optarg, 0, 60000, &errstr);
+			if (errstr)
+				errx(1, "delay is %s", errstr);
+			break;
+		case 'j':
+			sim.jitter = strtonum(optarg, 0, 60000, &errstr);
+			if (errstr)
+				errx(1, "jitter is %s", errstr);
+			break;
+		case 'L':
+			sim.lifetime = strtonum(optarg, 1, UINT32_MAX,
+			    &errstr);
+			if (errstr)
+				errx(1, "lifetime is %s", errstr);
+			break;
+		case 'l':
+			sim.loss = strtonum(optarg, 0, 100, &errstr);
+			if (errstr)
+				errx(1, "loss is %s", errstr);
+			break;
+		case 'm':
+			sim.move = strtonum(optarg, 0, 100, &errstr);
+			if (errstr)
+				errx(1, "move is %s", errstr);
+			break;
+		case 'n':
+			count = strtonum(optarg, 1, 65535, &errstr);
+			if (errstr)
+				errx(1, "count is %s", errstr);
+			break;
+		case 'P':
+			port = strtonum(optarg, 1, 65535, &errstr);
+			if (errstr)
+				errx(1, "port is %s", errstr);
+			break;
+		case 'p':
+			sim.sa.sin_port = htons(strtonum(optarg, 1, 65535,
+			    &errstr));
+			if (errstr)
+				errx(1, "port is %s", errstr);
+			break;
+		case 'r':
+			sim.reset = strtonum(optarg, 1, 86400, &errstr);
+			if (errstr)
+				errx(1, "reset is %s", errstr);
+			break;
+		case 't':
+			target = optarg;
+			break;
+		case 'u':
+			url = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'x':
+			if (inet_pton(AF_INET, optarg, &sim.external) != 1)
+				errx(1, "bad address %s", optarg);
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc > 0 || (benchmark && url == NULL) ||
+	    (benchmark && port + count > 65536))
+		usage();
+
+	log_init(1);
+
+	if (decode) {
+		bench_decode(decode);
+		return (0);
+	}
+
+	RB_INIT(&sim.mappings);
+	RB_INIT(&sim.exchanges);
+	sim.epoch = sim_now();
+
+	if ((sim.fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		fatal("socket");
+
+	if (fcntl(sim.fd, F_SETFL, O_NONBLOCK) == -1)
+		fatal("fcntl");
+
+	if (bind(sim.fd, (struct sockaddr *)&sim.sa, sizeof(sim.sa)) == -1)
+		fatal("bind");
+
+	/* Announcements go out on the interface being listened on */
+	if (setsockopt(sim.fd, IPPROTO_IP, IP_MULTICAST_IF,
+	    &sim.sa.sin_addr, sizeof(sim.sa.sin_addr)) == -1)
+		fatal("setsockopt");
+
+	if (setsockopt(sim.fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+	    sizeof(loop)) == -1)
+		fatal("setsockopt");
+
+	sim.base = event_base_new();
+
+	sim.ev = event_new(sim.base, sim.fd, EV_READ|EV_PERSIST, sim_recv,
+	    &sim);
+	event_add(sim.ev, NULL);
+
+	sim.sweep_ev = evtimer_new(sim.base, sim_sweep, &sim);
+	evtimer_add(sim.sweep_ev, &tv);
+
+	if (sim.reset) {
+		sim.reset_ev = evtimer_new(sim.base, sim_reset, &sim);
+		tv.tv_sec = sim.reset;
+		evtimer_add(sim.reset_ev, &tv);
+	}
+
+	ev_sighup = evsignal_new(sim.base, SIGHUP, sim_signal, &sim);
+	ev_sigusr1 = evsignal_new(sim.base, SIGUSR1, sim_signal, &sim);
+	ev_sigint = evsignal_new(sim.base, SIGINT, sim_signal, &sim);
+	ev_sigterm = evsignal_new(sim.base, SIGTERM, sim_signal, &sim);
+	evsignal_add(ev_sighup, NULL);
+	evsignal_add(ev_sigusr1, NULL);
+	evsignal_add(ev_sigint, NULL);
+	evsignal_add(ev_sigterm, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	log_info("listening on %s:%u", log_sockaddr((struct sockaddr *)&sim.sa),
+	    ntohs(sim.sa.sin_port));
+	if (verbose)
+		log_info("delay %ums jitter %ums loss %u%% lifetime %us "
+		    "reset %us", sim.delay, sim.jitter, sim.loss,
+		    sim.lifetime, sim.reset);
+
+	if (benchmark)
+		bench(&sim, url, target, count, concurrency, port);
+
+	event_base_dispatch(sim.base);
+
+	sim_report(&sim);
+
+	return (0);
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2014 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _PCPSIM_H
+#define _PCPSIM_H
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <netinet/in.h>
+
+#include <event2/event.h>
+
+#include "igdpcpd.h"
+
+/* A mapping created by a MAP or PEER request */
+struct sim_mapping {
+	RB_ENTRY(sim_mapping)	 entry;
+	struct in6_addr		 client;
+	u_int8_t		 opcode;
+	u_int8_t		 protocol;
+	u_int16_t		 iport;
+	struct in6_addr		 remote;	/* PEER only */
+	u_int16_t		 rport;
+	u_int8_t		 nonce[PCP_NONCE_LENGTH];
+	u_int16_t		 eport;
+	u_int64_t		 expires;	/* Seconds, monotonic */
+};
+
+RB_HEAD(sim_mappings, sim_mapping);
+RB_PROTOTYPE(sim_mappings, sim_mapping, entry, sim_mapping_cmp);
+
+/* The last request seen for a nonce, used to spot retransmissions */
+struct sim_exchange {
+	RB_ENTRY(sim_exchange)	 entry;
+	u_int8_t		 nonce[PCP_NONCE_LENGTH];
+	u_int8_t		 opcode;
+	u_int8_t		 protocol;
+	u_int16_t		 iport;
+	u_int8_t		 answered;	/* A response was delivered */
+	u_int64_t		 seen;		/* Seconds, monotonic */
+};
+
+RB_HEAD(sim_exchanges, sim_exchange);
+RB_PROTOTYPE(sim_exchanges, sim_exchange, entry, sim_exchange_cmp);
+
+struct sim_stats {
+	u_int64_t		 requests;
+	u_int64_t		 opcodes[PCP_OPCODE_PEER + 1];
+	u_int64_t		 errors;	/* Any result but success */
+	u_int64_t		 dropped;	/* Requests and responses */
+	u_int64_t		 retransmits;
+	u_int64_t		 resets;
+	u_int64_t		 moves;
+};
+
+#define	SIM_PROTOCOL_TCP	 0
+#define	SIM_PROTOCOL_UDP	 1
+#define	SIM_PROTOCOL_MAX	 2
+
+struct sim {
+	struct event_base	*base;
+	struct sockaddr_in	 sa;
+	int			 fd;
+	struct event		*ev;
+	struct in_addr		 external;
+	u_int32_t		 delay;		/* Milliseconds */
+	u_int32_t		 jitter;
+	u_int32_t		 loss;		/* Percent, each way */
+	u_int32_t		 move;		/* Percent of renewals */
+	u_int32_t		 lifetime;	/* Most granted, seconds */
+	u_int32_t		 reset;		/* Seconds between restarts */
+	u_int64_t		 epoch;		/* When it last restarted */
+	struct sim_mappings	 mappings;
+	u_int32_t		 count;
+	struct sim_exchanges	 exchanges;
+	u_int8_t		 used[SIM_PROTOCOL_MAX][65536 / 8];
+	struct event		*sweep_ev;
+	struct event		*reset_ev;
+	struct sim_stats	 stats;
+};
+
+/* pcpsim.c */
+u_int64_t		 sim_now(void);
+void			 sim_restart(struct sim *);
+void			 sim_report(struct sim *);
+
+/* bench.c */
+void			 bench(struct sim *, const char *, const char *,
+			     u_int32_t, u_int32_t, u_int16_t);
+void			 bench_decode(u_int32_t);
+
+#endif
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2014 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* PCP and NAT-PMP packets are read and written in place through the wire
+ * structures. Buffers are always u_int32_t arrays, and every field is at
+ * an offset that is a multiple of its size, so the casts are safe
+ */
+
+#include <sys/types.h>
+
+#include <netinet/in.h>
+
+#include <string.h>
+
+#include "igdpcpd.h"
+
+/* Length of the opcode-specific data, indexed by opcode */
+const size_t	 pcp_opcode_length[] = {
+	0,				/* ANNOUNCE */
+	sizeof(struct pcp_map),		/* MAP */
+	sizeof(struct pcp_peer),	/* PEER */
+};
+
+#define	PCP_OPCODE_MAX	 (sizeof(pcp_opcode_length) / sizeof(size_t))
+
+/* Check a request or response and find its parts, in a single pass over
+ * the options. Returns the result code a server would answer with, so
+ * PCP_SUCCESS if the packet can be used.
+ *
+ * A response that isn't a success may leave out the opcode-specific
+ * data, in which case neither map nor peer is set
+ */
+int
+pcp_decode(u_int8_t *buf, size_t len, int response, struct pcp_packet *pkt)
+{
+	struct pcp_option	*po;
+	struct pcp_filter	*pf;
+	size_t			 off, olen;
+
+	memset(pkt, 0, sizeof(struct pcp_packet));
+
+	/* The common header is the same size either way */
+	if (len < sizeof(struct pcp_common_request) ||
+	    len > PCP_MAX_PACKET_SIZE || len % 4)
+		return (PCP_MALFORMED_REQUEST);
+
+	if (buf[0] != PCP_MAX_VERSION)
+		return (PCP_UNSUPP_VERSION);
+
+	if (!(buf[1] & PCP_OPCODE_RESPONSE) != !response)
+		return (PCP_MALFORMED_REQUEST);
+
+	pkt->opcode = buf[1] & ~PCP_OPCODE_RESPONSE;
+	if (pkt->opcode >= PCP_OPCODE_MAX)
+		return (PCP_UNSUPP_OPCODE);
+
+	if (response)
+		pkt->response = (struct pcp_common_response *)buf;
+	else
+		pkt->request = (struct pcp_common_request *)buf;
+	off = sizeof(struct pcp_common_request);
+
+	if (len - off < pcp_opcode_length[pkt->opcode]) {
+		if (response && pkt->response->result != PCP_SUCCESS)
+			return (PCP_SUCCESS);
+		return (PCP_MALFORMED_REQUEST);
+	}
+
+	switch (pkt->opcode) {
+	case PCP_OPCODE_MAP:
+		pkt->map = (struct pcp_map *)(buf + off);
+		break;
+	case PCP_OPCODE_PEER:
+		pkt->peer = (struct pcp_peer *)(buf + off);
+		break;
+	}
+	off += pcp_opcode_length[pkt->opcode];
+
+	/* RFC 6887 section 7.3, options follow the opcode data, each one
+	 * padded to a multiple of four. Those that are only allowed once,
+	 * or only with some opcodes, are checked as they are found
+	 */
+	while (off < len) {
+		if (len - off < sizeof(struct pcp_option))
+			return (PCP_MALFORMED_OPTION);
+
+		po = (struct pcp_option *)(buf + off);
+		off += sizeof(struct pcp_option);
+		olen = ntohs(po->length);
+		if (len - off < ((olen + 3) & ~3))
+			return (PCP_MALFORMED_OPTION);
+
+		switch (po->code) {
+		case PCP_OPTION_THIRD_PARTY:
+			if (pkt->opcode == PCP_OPCODE_ANNOUNCE)
+				return (PCP_UNSUPP_OPTION);
+			if (olen != sizeof(struct in6_addr) ||
+			    pkt->third_party != NULL)
+				return (PCP_MALFORMED_OPTION);
+			pkt->third_party = (struct in6_addr *)(buf + off);
+			break;
+		case PCP_OPTION_PREFER_FAILURE:
+			if (pkt->opcode != PCP_OPCODE_MAP)
+				return (PCP_UNSUPP_OPTION);
+			if (olen != 0 || pkt->prefer_failure)
+				return (PCP_MALFORMED_OPTION);
+			pkt->prefer_failure = 1;
+			break;
+		case PCP_OPTION_FILTER:
+			if (pkt->opcode != PCP_OPCODE_MAP)
+				return (PCP_UNSUPP_OPTION);
+			pf = (struct pcp_filter *)(buf + off);
+			if (olen != sizeof(struct pcp_filter) ||
+			    pf->prefix > 128)
+				return (PCP_MALFORMED_OPTION);
+			if (pkt->filters++ == 0)
+				pkt->filter = pf;
+			break;
+		default:
+			/* Only optional options may be skipped by a server,
+			 * a client ignores anything it doesn't know
+			 */
+			if (po->code < 128 && !response)
+				return (PCP_UNSUPP_OPTION);
+			break;
+		}
+
+		off += (olen + 3) & ~3;
+	}
+
+	return (PCP_SUCCESS);
+}
+
+/* Write the common header of a request, returning its length */
+size_t
+pcp_header(u_int8_t *buf, u_int8_t opcode, u_int32_t lifetime,
+    struct in6_addr *client)
+{
+	struct pcp_common_request	*cr = (struct pcp_common_request *)buf;
+
+	cr->version = PCP_MAX_VERSION;
+	cr->opcode = opcode;
+	cr->reserved = 0;
+	cr->lifetime = htonl(lifetime);
+	cr->client = *client;
+
+	return (sizeof(struct pcp_common_request));
+}
+
+/* Append an option at the given offset, returning the new length */
+size_t
+pcp_option(u_int8_t *buf, size_t off, u_int8_t code, const void *data,
+    u_int16_t len)
+{
+	struct pcp_option	*po = (struct pcp_option *)(buf + off);
+	size_t			 padded = (len + 3) & ~3;
+
+	po->code = code;
+	po->reserved = 0;
+	po->length = htons(len);
+	off += sizeof(struct pcp_option);
+
+	if (len)
+		memcpy(buf + off, data, len);
+	memset(buf + off + len, 0, padded - len);
+
+	return (off + padded);
+}
+
+/* Check a NAT-PMP response. Only a success has to carry the opcode's
+ * fields, anything else may stop after the epoch
+ */
+int
+natpmp_decode(u_int8_t *buf, size_t len, struct natpmp_response **rsp)
+{
+	struct natpmp_response	*nr = (struct natpmp_response *)buf;
+	size_t			 need;
+
+	if (len < 8 || len > NATPMP_MAX_PACKET_SIZE ||
+	    nr->version != NATPMP_MAX_VERSION ||
+	    !(nr->opcode & NATPMP_OPCODE_RESPONSE))
+		return (-1);
+
+	switch (nr->opcode & ~NATPMP_OPCODE_RESPONSE) {
+	case NATPMP_OPCODE_ADDRESS:
+		need = 12;
+		break;
+	case NATPMP_OPCODE_MAP_UDP:
+	case NATPMP_OPCODE_MAP_TCP:
+		need = 16;
+		break;
+	default:
+		return (-1);
+	}
+
+	if (len < need && ntohs(nr->result) == NATPMP_SUCCESS)
+		return (-1);
+
+	*rsp = nr;
+
+	return (0);
+}
+
+/* Write an ADDRESS or MAP request, returning its length */
+size_t
+natpmp_request(u_int8_t *buf, u_int8_t opcode, u_int16_t iport,
+    u_int16_t eport, u_int32_t lifetime)
+{
+	struct natpmp_request	*nr = (struct natpmp_request *)buf;
+
+	nr->version = NATPMP_MAX_VERSION;
+	nr->opcode = opcode;
+
+	if (opcode == NATPMP_OPCODE_ADDRESS)
+		return (2);
+
+	nr->reserved = 0;
+	nr->iport = htons(iport);
+	nr->eport = htons(eport);
+	nr->lifetime = htonl(lifetime);
+
+	return (sizeof(struct natpmp_request));
+}
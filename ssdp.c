@@ -73,7 +73,7 @@ struct ssdp_header {
 
 TAILQ_HEAD(ssdp_headers, ssdp_header);
 
-char			*ssdp_concat(char *, char *);
+char			*ssdp_concat(const char *, const char *);
 void			 ssdp_host_header(struct evbuffer *,
 			     struct listen_addr *, struct sockaddr_storage *);
 void			 ssdp_date_header(struct evbuffer *);
@@ -88,22 +88,25 @@ void			 ssdp_configid_header(struct evbuffer *,
 void			 ssdp_sendto(int, short, void *);
 struct ssdp_callback	*ssdp_callback_new(struct igdpcpd *);
 void			 ssdp_callback_free(struct ssdp_callback *);
-void			 ssdp_multicast(struct igdpcpd *, char *, char *);
+void			 ssdp_multicast(struct igdpcpd *,
+			     enum ssdp_callback_type, const char *, const char *);
+void			 ssdp_notify(struct igdpcpd *, enum ssdp_callback_type);
+void			 ssdp_next_boot(int, short, void *);
 struct ssdp_header	*ssdp_find_header(struct ssdp_headers *, char *);
 int			 ssdp_parse_packet(struct evbuffer *, char **,
 			     char **, char **, struct ssdp_headers *, char **);
 void			 ssdp_unicast(struct igdpcpd *, struct listen_addr *,
-			     struct sockaddr_storage, socklen_t, char *,
-			     char *, int);
+			     struct sockaddr_storage, socklen_t, const char *,
+			     const char *, int);
 
-extern struct sockaddr_in	 ssdp4;
-extern struct sockaddr_in6	 ssdp6;
+extern struct sockaddr_in	 ssdp4, event4;
+extern struct sockaddr_in6	 ssdp6, event6;
 extern struct utsname		 name;
 extern const char		*upnp_version;
 
 /* Construct SSDP header value of the form "lhs::rhs" */
 char *
-ssdp_concat(char *lhs, char *rhs)
+ssdp_concat(const char *lhs, const char *rhs)
 {
 	size_t	 len;
 	char	*str;
@@ -351,6 +354,8 @@ ssdp_callback_free(struct ssdp_callback *cb)
 	case SSDP_CALLBACK_NOTIFY_ALIVE:
 		/* FALLTHROUGH */
 	case SSDP_CALLBACK_NOTIFY_BYEBYE:
+		/* FALLTHROUGH */
+	case SSDP_CALLBACK_NOTIFY_UPDATE:
 		free(cb->nt);
 		free(cb->usn);
 		break;
@@ -372,7 +377,8 @@ ssdp_callback_free(struct ssdp_callback *cb)
  * given NT and USN values
  */
 void
-ssdp_multicast(struct igdpcpd *env, char *nt, char *usn)
+ssdp_multicast(struct igdpcpd *env, enum ssdp_callback_type type,
+    const char *nt, const char *usn)
 {
 	struct listen_addr	*la;
 	struct ssdp_callback	*cb;
@@ -384,7 +390,7 @@ ssdp_multicast(struct igdpcpd *env, char *nt, char *usn)
 		if ((cb = ssdp_callback_new(env)) == NULL)
 			fatal("ssdp_callback_new");
 
-		cb->type = SSDP_CALLBACK_NOTIFY_ALIVE;
+		cb->type = type;
 		cb->la = la;
 
 		switch (la->sa.ss_family) {
@@ -411,15 +417,15 @@ ssdp_multicast(struct igdpcpd *env, char *nt, char *usn)
 	}
 }
 
+/* Send one type of notification for every device and service */
 void
-ssdp_announce(int fd, short event, void *arg)
+ssdp_notify(struct igdpcpd *env, enum ssdp_callback_type nts)
 {
-	struct igdpcpd		*env = (struct igdpcpd *)arg;
 	struct ssdp_root	*root = env->sc_root;
 	struct ssdp_device	*device;
 	struct ssdp_service	*service;
-	char			*usn, *type;
-	struct timeval		 tv = { 900, 0 };
+	const char		*type;
+	char			*usn;
 
 	for (device = TAILQ_FIRST(&root->devices); device;
 	    device = TAILQ_NEXT(device, entry)) {
@@ -429,41 +435,158 @@ ssdp_announce(int fd, short event, void *arg)
 			    UPNP_ROOT_DEVICE)) == NULL)
 				fatalx("ssdp_concat");
 
-			ssdp_multicast(env, UPNP_ROOT_DEVICE, usn);
+			ssdp_multicast(env, nts, UPNP_ROOT_DEVICE, usn);
 
 			free(usn);
 		}
 
-		ssdp_multicast(env, device->uuid, device->uuid);
+		ssdp_multicast(env, nts, device->uuid, device->uuid);
 
-		if ((type = urn_to_string(device->urn)) == NULL)
-			fatalx("urn_to_string");
+		type = urn_atom_string(device->type);
 		if ((usn = ssdp_concat(device->uuid, type)) == NULL)
 			fatalx("ssdp_concat");
 
-		ssdp_multicast(env, type, usn);
+		ssdp_multicast(env, nts, type, usn);
 
-		free(type);
 		free(usn);
 	}
 
 	/* FIXME Should 'uniq' the list of services here */
 	for (service = TAILQ_FIRST(&root->services); service;
 	    service = TAILQ_NEXT(service, entry)) {
-		if ((type = urn_to_string(service->urn)) == NULL)
-			fatalx("urn_to_string");
+		type = urn_atom_string(service->type);
 		if ((usn = ssdp_concat(service->parent->uuid, type)) == NULL)
 			fatalx("ssdp_concat");
 
-		ssdp_multicast(env, type, usn);
+		ssdp_multicast(env, nts, type, usn);
 
-		free(type);
 		free(usn);
 	}
+}
+
+void
+ssdp_announce(int fd, short event, void *arg)
+{
+	struct igdpcpd		*env = (struct igdpcpd *)arg;
+	struct timeval		 tv = { 900, 0 };
+
+	ssdp_notify(env, SSDP_CALLBACK_NOTIFY_ALIVE);
 
 	evtimer_add(env->sc_announce_ev, &tv);
 }
 
+/* Let control points know something about the device has changed. The
+ * update carries the BOOTID that will be used from now on, which takes
+ * over once the updates have gone out
+ */
+void
+ssdp_update(struct igdpcpd *env)
+{
+#if UPNP_VERSION_NUMBER >= 0x0101
+	struct timeval	 tv = { 1, 0 };
+
+	/* Already on its way, this change is covered by it */
+	if (env->sc_nexttime.tv_sec > env->sc_boottime.tv_sec)
+		return;
+
+	env->sc_nexttime.tv_sec = env->sc_boottime.tv_sec + 1;
+
+	ssdp_notify(env, SSDP_CALLBACK_NOTIFY_UPDATE);
+
+	event_base_once(env->sc_base, -1, EV_TIMEOUT, ssdp_next_boot, env,
+	    &tv);
+#endif
+}
+
+/* Multicast an event from a service, UDA 1.1 section 4.3. The message is
+ * the same from every listening address bar the Host header, so the rest
+ * is rendered once and sent alongside it
+ */
+void
+ssdp_event(struct igdpcpd *env, struct ssdp_service *service,
+    const char *svcid, struct evbuffer *body)
+{
+#if UPNP_VERSION_NUMBER >= 0x0101
+	struct listen_addr	*la;
+	struct evbuffer		*output;
+	struct sockaddr_storage	 ss;
+	struct msghdr		 msg;
+	struct iovec		 iov[2];
+	char			 host[64];
+	const char		*type;
+	int			 len;
+
+	if ((output = evbuffer_new()) == NULL)
+		fatal("evbuffer_new");
+
+	type = urn_atom_string(service->type);
+
+	evbuffer_add_printf(output,
+	    "Content-Type: text/xml; charset=\"utf-8\"\r\n");
+	evbuffer_add_printf(output, "USN: %s::%s\r\n", service->parent->uuid,
+	    type);
+	evbuffer_add_printf(output, "SVCID: %s\r\n", svcid);
+	evbuffer_add_printf(output, "NT: upnp:event\r\n");
+	evbuffer_add_printf(output, "NTS: upnp:propchange\r\n");
+	evbuffer_add_printf(output, "SEQ: %u\r\n", service->seq);
+	evbuffer_add_printf(output, "LVL: upnp:/info\r\n");
+	ssdp_bootid_header(output, env);
+	evbuffer_add_printf(output, "Content-Length: %zu\r\n\r\n",
+	    evbuffer_get_length(body));
+	evbuffer_add(output, evbuffer_pullup(body, -1),
+	    evbuffer_get_length(body));
+
+	/* Zero is only used once, like GENA */
+	service->seq = service->seq == UINT32_MAX ? 1 : service->seq + 1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &ss;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	iov[0].iov_base = host;
+	iov[1].iov_base = evbuffer_pullup(output, -1);
+	iov[1].iov_len = evbuffer_get_length(output);
+
+	for (la = TAILQ_FIRST(&env->listen_addrs); la;
+	    la = TAILQ_NEXT(la, entry)) {
+		switch (la->sa.ss_family) {
+		case AF_INET:
+			memcpy(&ss, &event4, sizeof(event4));
+			msg.msg_namelen = sizeof(event4);
+			len = snprintf(host, sizeof(host),
+			    "NOTIFY * HTTP/1.0\r\nHost: %s:%u\r\n",
+			    log_sockaddr((struct sockaddr *)&ss), EVENT_PORT);
+			break;
+		case AF_INET6:
+			memcpy(&ss, &event6, sizeof(event6));
+			msg.msg_namelen = sizeof(event6);
+			len = snprintf(host, sizeof(host),
+			    "NOTIFY * HTTP/1.0\r\nHost: [%s]:%u\r\n",
+			    log_sockaddr((struct sockaddr *)&ss), EVENT_PORT);
+			break;
+		default:
+			/* NOTREACHED */
+			continue;
+		}
+		iov[0].iov_len = len;
+
+		if (sendmsg(la->fd, &msg, 0) == -1)
+			log_warn("sendmsg");
+	}
+
+	evbuffer_free(output);
+#endif
+}
+
+void
+ssdp_next_boot(int fd, short event, void *arg)
+{
+	struct igdpcpd	*env = (struct igdpcpd *)arg;
+
+	env->sc_boottime = env->sc_nexttime;
+}
+
 struct ssdp_header *
 ssdp_find_header(struct ssdp_headers *headers, char *key)
 {
@@ -605,7 +728,8 @@ cleanup:
 /* Schedule unicast SSDP response for given ST and USN values */
 void
 ssdp_unicast(struct igdpcpd *env, struct listen_addr *la,
-    struct sockaddr_storage ss, socklen_t slen, char *st, char *usn, int mx)
+    struct sockaddr_storage ss, socklen_t slen, const char *st,
+    const char *usn, int mx)
 {
 	struct ssdp_callback	*cb;
 	struct timeval		 tv = { 0, 0 };
@@ -659,12 +783,17 @@ ssdp_recvmsg(int fd, short event, void *arg)
 	char			*body = NULL;
 	int			 mx;
 	const char		*errstr;
-	struct urn		*urn;
-	struct upnp_nss		*nss;
+	struct urn_view		 urn;
+	struct upnp_nss_view	 nss;
+	const char		*str;
+	char			 decoded[URN_VIEW_MAX];
+	size_t			 nsslen;
+	int			 n;
 	struct ssdp_root	*root = env->sc_root;
 	struct ssdp_device	*device;
 	struct ssdp_service	*service;
-	char			*usn, *type;
+	const char		*type;
+	char			*usn;
 
 	iov[0].iov_base = buf;
 	iov[0].iov_len = sizeof(buf);
@@ -798,23 +927,20 @@ ssdp_recvmsg(int fd, short event, void *arg)
 			ssdp_unicast(env, la, ss, msg.msg_namelen,
 			    device->uuid, device->uuid, mx);
 
-			if ((type = urn_to_string(device->urn)) == NULL)
-				fatalx("urn_to_string");
+			type = urn_atom_string(device->type);
 			if ((usn = ssdp_concat(device->uuid, type)) == NULL)
 				fatalx("ssdp_concat");
 
 			ssdp_unicast(env, la, ss, msg.msg_namelen, type, usn,
 			    mx);
 
-			free(type);
 			free(usn);
 		}
 
 		/* FIXME Should 'uniq' the list of services here */
 		for (service = TAILQ_FIRST(&root->services); service;
 		    service = TAILQ_NEXT(service, entry)) {
-			if ((type = urn_to_string(service->urn)) == NULL)
-				fatalx("urn_to_string");
+			type = urn_atom_string(service->type);
 			if ((usn = ssdp_concat(service->parent->uuid,
 			    type)) == NULL)
 				fatalx("ssdp_concat");
@@ -822,7 +948,6 @@ ssdp_recvmsg(int fd, short event, void *arg)
 			ssdp_unicast(env, la, ss, msg.msg_namelen, type, usn,
 			    mx);
 
-			free(type);
 			free(usn);
 		}
 	} else if (strcmp(header->value, UPNP_ROOT_DEVICE) == 0) {
@@ -849,21 +974,20 @@ ssdp_recvmsg(int fd, short event, void *arg)
 		    header->value, mx);
 	} else if (strncasecmp(header->value, "urn:", 4) == 0) {
 		/* Send matching device or service of type */
-		if ((urn = urn_from_string(header->value)) == NULL)
+		if (urn_view_from_string(header->value, strlen(header->value),
+		    &urn) == -1 || (str = urn_view_nss(&urn, decoded,
+		    sizeof(decoded), &nsslen)) == NULL ||
+		    upnp_nss_view_from_string(str, nsslen, &nss) == -1 ||
+		    (n = upnp_type_find(&nss)) == -1)
 			goto cleanup;
-		if ((nss = upnp_nss_from_string(urn->nss)) == NULL) {
-			urn_free(urn);
-			goto cleanup;
-		}
 
-		switch (nss->type) {
+		switch (nss.type) {
 		case UPNP_TYPE_DEVICE:
 			for (device = TAILQ_FIRST(&root->devices);
 			    device; device = TAILQ_NEXT(device, entry))
-				if (strcmp(urn->nid, device->urn->nid) == 0 &&
-				    nss->type == device->nss->type &&
-				    strcmp(nss->name, device->nss->name) == 0 &&
-				    nss->version <= device->nss->version) {
+				if (device->device == n &&
+				    urn.atom == device->urn->atom &&
+				    nss.version <= device->nss->version) {
 					if ((usn = ssdp_concat(device->uuid,
 					    header->value)) == NULL)
 						fatalx("ssdp_concat");
@@ -878,10 +1002,9 @@ ssdp_recvmsg(int fd, short event, void *arg)
 		case UPNP_TYPE_SERVICE:
 			for (service = TAILQ_FIRST(&root->services);
 			    service; service = TAILQ_NEXT(service, entry))
-				if (strcmp(urn->nid, service->urn->nid) == 0 &&
-				    nss->type == service->nss->type &&
-				    strcmp(nss->name, service->nss->name) == 0 &&
-				    nss->version <= service->nss->version) {
+				if (service->service == n &&
+				    urn.atom == service->urn->atom &&
+				    nss.version <= service->nss->version) {
 					if ((usn = ssdp_concat(
 					    service->parent->uuid,
 					    header->value)) == NULL)
@@ -897,10 +1020,6 @@ ssdp_recvmsg(int fd, short event, void *arg)
 		default:
 			break;
 		}
-
-		upnp_nss_free(nss);
-		urn_free(urn);
-
 	} else
 		log_warnx("unknown ST header value: %s", header->value);
 
@@ -0,0 +1,495 @@
+/*
+ * Copyright (c) 2014 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Mappings are persisted as a snapshot of the whole table plus a journal
+ * of every change made since. Both are a header followed by records; a
+ * record is the fixed part below followed by the description.
+ *
+ * Journal records are absolute (the new state of a mapping, or that it
+ * has gone), so replaying a journal over a snapshot that already includes
+ * it gives the same table. That makes it safe to crash between writing a
+ * new snapshot and truncating the journal.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "igdpcpd.h"
+
+/* Relative to the chroot */
+#define	STORE_DIR		 "/db"
+#define	STORE_SNAPSHOT		 STORE_DIR "/mappings"
+#define	STORE_SNAPSHOT_TEMP	 STORE_DIR "/mappings.tmp"
+#define	STORE_JOURNAL		 STORE_DIR "/journal"
+
+#define	STORE_SNAPSHOT_MAGIC	 0x49474453	/* "IGDS" */
+#define	STORE_JOURNAL_MAGIC	 0x4947444a	/* "IGDJ" */
+#define	STORE_VERSION		 2
+
+/* Seconds between syncing the journal to disk */
+#define	STORE_SYNC_INTERVAL	 1
+
+/* Journal records before compacting into a new snapshot, at least this
+ * many or as many as there are mappings, whichever is greater
+ */
+#define	STORE_COMPACT_MINIMUM	 1024
+
+enum store_types {
+	STORE_TYPE_UPDATE = 1,
+	STORE_TYPE_DELETE,
+};
+
+struct store_header {
+	u_int32_t	 magic;
+	u_int32_t	 version;
+};
+
+struct store_record {
+	u_int32_t	 check;		/* Covers the rest of the record */
+	u_int16_t	 length;	/* Of the description */
+	u_int8_t	 type;
+	u_int8_t	 protocol;
+	u_int16_t	 eport;
+	u_int16_t	 iport;
+	u_int32_t	 remote;
+	u_int32_t	 client;
+	u_int32_t	 lease;
+	u_int8_t	 enabled;
+	u_int8_t	 spare[3];
+	u_int8_t	 nonce[PCP_NONCE_LENGTH];
+	int64_t		 expires;	/* Wall clock, zero is permanent */
+};
+
+u_int32_t	 store_check(struct store_record *, const char *);
+void		 store_record_fill(struct store_record *, struct mapping *,
+		     enum store_types);
+int		 store_replay(struct igdpcpd *, u_int8_t *, size_t, size_t *,
+		     u_int32_t, time_t);
+int		 store_apply(struct igdpcpd *, struct store_record *,
+		     const char *, time_t);
+int		 store_header_write(int, u_int32_t);
+void		 store_append(struct mapping *, enum store_types);
+void		 store_sync(int, short, void *);
+
+/* FNV-1a over everything after the check field, enough to catch a torn
+ * or partially written record at the end of the journal
+ */
+u_int32_t
+store_check(struct store_record *sr, const char *description)
+{
+	u_int8_t	*p;
+	u_int32_t	 hash = 2166136261U;
+	size_t		 i;
+
+	p = (u_int8_t *)sr + sizeof(sr->check);
+	for (i = sizeof(sr->check); i < sizeof(struct store_record); i++)
+		hash = (hash ^ *p++) * 16777619U;
+
+	for (i = 0; i < sr->length; i++)
+		hash = (hash ^ (u_int8_t)description[i]) * 16777619U;
+
+	return (hash);
+}
+
+void
+store_record_fill(struct store_record *sr, struct mapping *m,
+    enum store_types type)
+{
+	size_t	 length;
+
+	memset(sr, 0, sizeof(struct store_record));
+	sr->type = type;
+	sr->protocol = m->protocol;
+	sr->eport = m->eport;
+	sr->remote = m->remote.s_addr;
+
+	if (type == STORE_TYPE_DELETE)
+		return;
+
+	sr->iport = m->iport;
+	sr->client = m->client.s_addr;
+	sr->lease = m->lease;
+	sr->enabled = m->enabled;
+	memcpy(sr->nonce, m->nonce, sizeof(sr->nonce));
+	if (m->expires)
+		sr->expires = time(NULL) + mapping_remaining(m);
+
+	length = m->description ? strlen(m->description) : 0;
+	sr->length = length > USHRT_MAX ? USHRT_MAX : length;
+}
+
+/* Create the store directory inside the chroot, while still root */
+void
+store_setup(struct passwd *pw)
+{
+	char	 path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "%s%s", pw->pw_dir,
+	    STORE_DIR) >= (int)sizeof(path)) {
+		log_warnx("store directory path too long");
+		return;
+	}
+
+	if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+		log_warn("mkdir %s", path);
+		return;
+	}
+
+	if (chown(path, pw->pw_uid, pw->pw_gid) == -1)
+		log_warn("chown %s", path);
+}
+
+/* Apply a single record to the table */
+int
+store_apply(struct igdpcpd *env, struct store_record *sr,
+    const char *description, time_t now)
+{
+	struct mapping	*m;
+	struct in_addr	 remote;
+
+	if (sr->protocol >= MAPPING_PROTOCOL_MAX)
+		return (-1);
+
+	remote.s_addr = sr->remote;
+
+	/* Whatever the record says, it replaces what is already there */
+	if ((m = mapping_find(env, sr->protocol, sr->eport, &remote)) != NULL)
+		mapping_delete(m);
+
+	switch (sr->type) {
+	case STORE_TYPE_DELETE:
+		return (0);
+	case STORE_TYPE_UPDATE:
+		break;
+	default:
+		return (-1);
+	}
+
+	/* Expired while we weren't running */
+	if (sr->expires && sr->expires <= now)
+		return (0);
+
+	if ((m = mapping_new(env)) == NULL)
+		fatal("mapping_new");
+
+	m->protocol = sr->protocol;
+	m->eport = sr->eport;
+	m->remote = remote;
+	m->iport = sr->iport;
+	m->client.s_addr = sr->client;
+	m->enabled = sr->enabled;
+	m->lease = sr->lease;
+	memcpy(m->nonce, sr->nonce, sizeof(m->nonce));
+	if ((m->description = strndup(description, sr->length)) == NULL)
+		fatal("strndup");
+
+	if (mapping_add(m) == -1)
+		fatal("mapping_add");
+
+	/* Only what was left of the lease */
+	if (sr->expires)
+		mapping_schedule(m, sr->expires - now);
+
+	return (0);
+}
+
+/* Apply records until the end of the buffer or the first one that fails
+ * validation. Returns the number applied, with the offset just past the
+ * last good record in *end
+ */
+int
+store_replay(struct igdpcpd *env, u_int8_t *buf, size_t len, size_t *end,
+    u_int32_t magic, time_t now)
+{
+	struct store_header	 sh;
+	struct store_record	 sr;
+	const char		*description;
+	size_t			 off;
+	int			 count = 0;
+
+	*end = 0;
+
+	if (len < sizeof(sh))
+		return (0);
+
+	memcpy(&sh, buf, sizeof(sh));
+	if (sh.magic != magic || sh.version != STORE_VERSION) {
+		log_warnx("ignoring %s with unknown format",
+		    magic == STORE_JOURNAL_MAGIC ? "journal" : "snapshot");
+		return (0);
+	}
+
+	for (off = sizeof(sh); off + sizeof(sr) <= len; count++) {
+		/* Records aren't aligned, so copy the fixed part out */
+		memcpy(&sr, buf + off, sizeof(sr));
+		if (off + sizeof(sr) + sr.length > len)
+			break;
+		description = (const char *)buf + off + sizeof(sr);
+		if (store_check(&sr, description) != sr.check ||
+		    store_apply(env, &sr, description, now) == -1)
+			break;
+		off += sizeof(sr) + sr.length;
+	}
+
+	*end = off;
+
+	return (count);
+}
+
+int
+store_header_write(int fd, u_int32_t magic)
+{
+	struct store_header	 sh;
+
+	sh.magic = magic;
+	sh.version = STORE_VERSION;
+
+	if (write(fd, &sh, sizeof(sh)) != sizeof(sh))
+		return (-1);
+
+	return (0);
+}
+
+/* Rebuild the table from the snapshot and journal, then start journalling
+ * any further changes
+ */
+void
+store_load(struct igdpcpd *env)
+{
+	struct store	*store = &env->sc_store;
+	struct stat	 st;
+	u_int8_t	*buf;
+	size_t		 end;
+	time_t		 now;
+	int		 fd, snapshot = 0, journal = 0;
+
+	store->fd = -1;
+	store->records = 0;
+	if ((store->ev = evtimer_new(env->sc_base, store_sync, env)) == NULL)
+		fatalx("evtimer_new");
+
+	now = time(NULL);
+
+	if ((fd = open(STORE_SNAPSHOT, O_RDONLY)) != -1) {
+		if (fstat(fd, &st) == -1)
+			fatal("fstat");
+		if (st.st_size > 0) {
+			if ((buf = mmap(NULL, st.st_size, PROT_READ,
+			    MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+				fatal("mmap");
+			snapshot = store_replay(env, buf, st.st_size, &end,
+			    STORE_SNAPSHOT_MAGIC, now);
+			if (end != (size_t)st.st_size)
+				log_warnx("snapshot truncated after %d records",
+				    snapshot);
+			munmap(buf, st.st_size);
+		}
+		close(fd);
+	} else if (errno != ENOENT) {
+		log_warn("open %s", STORE_SNAPSHOT);
+		return;
+	}
+
+	if ((fd = open(STORE_JOURNAL, O_RDWR|O_APPEND|O_CREAT, 0600)) == -1) {
+		log_warn("open %s, mappings will not persist", STORE_JOURNAL);
+		return;
+	}
+
+	if (fstat(fd, &st) == -1)
+		fatal("fstat");
+
+	end = 0;
+	if (st.st_size > 0) {
+		if ((buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+		    fd, 0)) == MAP_FAILED)
+			fatal("mmap");
+		journal = store_replay(env, buf, st.st_size, &end,
+		    STORE_JOURNAL_MAGIC, now);
+		munmap(buf, st.st_size);
+	}
+
+	/* Drop a torn record left by a crash so appends follow the last
+	 * good one, or start a fresh journal
+	 */
+	if (end == 0) {
+		if (ftruncate(fd, 0) == -1 ||
+		    store_header_write(fd, STORE_JOURNAL_MAGIC) == -1) {
+			log_warn("%s, mappings will not persist",
+			    STORE_JOURNAL);
+			close(fd);
+			return;
+		}
+	} else if (end != (size_t)st.st_size) {
+		log_warnx("journal truncated after %d records", journal);
+		if (ftruncate(fd, end) == -1)
+			fatal("ftruncate");
+	}
+
+	store->fd = fd;
+	store->records = journal;
+
+	log_info("restored %u mappings from %d snapshot and %d journal "
+	    "records", env->sc_mappings.count, snapshot, journal);
+
+	/* Start the next restart from a single snapshot */
+	if (journal)
+		store_compact(env);
+}
+
+void
+store_append(struct mapping *m, enum store_types type)
+{
+	struct store		*store = &m->env->sc_store;
+	struct store_record	 sr;
+	struct iovec		 iov[2];
+	struct timeval		 tv = { STORE_SYNC_INTERVAL, 0 };
+	ssize_t			 len;
+
+	if (store->fd == -1)
+		return;
+
+	store_record_fill(&sr, m, type);
+	sr.check = store_check(&sr, m->description);
+
+	iov[0].iov_base = &sr;
+	iov[0].iov_len = sizeof(sr);
+	iov[1].iov_base = m->description;
+	iov[1].iov_len = sr.length;
+
+	/* A short write is discarded as a torn record on the next start */
+	if ((len = writev(store->fd, iov, sr.length ? 2 : 1)) == -1 ||
+	    (size_t)len != sizeof(sr) + sr.length) {
+		log_warn("journal write");
+		return;
+	}
+
+	store->records++;
+
+	if (!evtimer_pending(store->ev, NULL))
+		evtimer_add(store->ev, &tv);
+}
+
+/* Record the current state of a mapping */
+void
+store_update(struct mapping *m)
+{
+	store_append(m, STORE_TYPE_UPDATE);
+}
+
+/* Record that a mapping has gone */
+void
+store_delete(struct mapping *m)
+{
+	store_append(m, STORE_TYPE_DELETE);
+}
+
+/* Journal writes are already in the kernel so survive us crashing; this
+ * bounds what a power cut can lose
+ */
+void
+store_sync(int fd, short event, void *arg)
+{
+	struct igdpcpd	*env = (struct igdpcpd *)arg;
+	struct store	*store = &env->sc_store;
+
+	if (store->fd == -1)
+		return;
+
+	if (store->records > MAX(STORE_COMPACT_MINIMUM,
+	    env->sc_mappings.count)) {
+		store_compact(env);
+		return;
+	}
+
+	if (fsync(store->fd) == -1)
+		log_warn("journal fsync");
+}
+
+/* Write the whole table out as a new snapshot and empty the journal */
+void
+store_compact(struct igdpcpd *env)
+{
+	struct store		*store = &env->sc_store;
+	struct store_header	 sh;
+	struct store_record	 sr;
+	struct mapping		*m;
+	FILE			*fp;
+	int			 fd, i;
+
+	if (store->fd == -1)
+		return;
+
+	if ((fd = open(STORE_SNAPSHOT_TEMP, O_WRONLY|O_CREAT|O_TRUNC,
+	    0600)) == -1 || (fp = fdopen(fd, "w")) == NULL) {
+		log_warn("open %s", STORE_SNAPSHOT_TEMP);
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+
+	sh.magic = STORE_SNAPSHOT_MAGIC;
+	sh.version = STORE_VERSION;
+	fwrite(&sh, sizeof(sh), 1, fp);
+
+	for (i = 0; i < MAPPING_PROTOCOL_MAX; i++)
+		RB_FOREACH(m, mapping_tree, &env->sc_mappings.tree[i]) {
+			store_record_fill(&sr, m, STORE_TYPE_UPDATE);
+			sr.check = store_check(&sr, m->description);
+			fwrite(&sr, sizeof(sr), 1, fp);
+			fwrite(m->description, sr.length, 1, fp);
+		}
+
+	if (fflush(fp) == EOF || ferror(fp) || fsync(fileno(fp)) == -1) {
+		log_warn("write %s", STORE_SNAPSHOT_TEMP);
+		fclose(fp);
+		unlink(STORE_SNAPSHOT_TEMP);
+		return;
+	}
+	fclose(fp);
+
+	if (rename(STORE_SNAPSHOT_TEMP, STORE_SNAPSHOT) == -1) {
+		log_warn("rename %s", STORE_SNAPSHOT_TEMP);
+		unlink(STORE_SNAPSHOT_TEMP);
+		return;
+	}
+
+	/* The journal is opened for appending, so carries on after the
+	 * header once truncated
+	 */
+	if (ftruncate(store->fd, sizeof(sh)) == -1 || fsync(store->fd) == -1)
+		log_warn("journal truncate");
+
+	store->records = 0;
+	evtimer_del(store->ev);
+
+	log_debug("compacted %u mappings", env->sc_mappings.count);
+}
@@ -17,6 +17,10 @@
 #include <sys/limits.h>
 #include <sys/utsname.h>
 
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,49 +29,7 @@
 #include <uuid.h>
 
 #include "igdpcpd.h"
-
-#define	UPNP_NID		 "upnp-org"
-#define	UPNP_SCHEMA_NID		 "schemas-upnp-org"
-#define	UPNP_DEVICE_TYPE	 "device"
-#define	UPNP_SERVICE_TYPE	 "service"
-#define	UPNP_CONTROL_TYPE	 "control"
-#define	UPNP_EVENT_TYPE		 "event"
-
-/* Macro expansion fun */
-#define	UPNP_STRING(x)		 __STRING(x)
-
-#define	UPNP_URN(nid, nss)	("urn:" nid ":" nss)
-
-#define	UPNP_TYPE_URN(nid, type, name, version) \
-	(UPNP_URN(nid, type ":" name ":" UPNP_STRING(version)))
-#define	UPNP_SCHEMA_URN(nid, type, major, minor) \
-	(UPNP_URN(nid, type "-" UPNP_STRING(major) "-" UPNP_STRING(minor)))
-#define	UPNP_SERVICE_ID_URN(nid, type, instance) \
-	(UPNP_URN(nid, "serviceId:" type UPNP_STRING(instance)))
-
-#define	UPNP_DEVICE_SCHEMA_URN \
-	(UPNP_SCHEMA_URN(UPNP_SCHEMA_NID, UPNP_DEVICE_TYPE, 1, 0))
-#define	UPNP_SERVICE_SCHEMA_URN \
-	(UPNP_SCHEMA_URN(UPNP_SCHEMA_NID, UPNP_SERVICE_TYPE, 1, 0))
-#define	UPNP_CONTROL_SCHEMA_URN \
-	(UPNP_SCHEMA_URN(UPNP_SCHEMA_NID, UPNP_CONTROL_TYPE, 1, 0))
-#define	UPNP_EVENT_SCHEMA_URN \
-	(UPNP_SCHEMA_URN(UPNP_SCHEMA_NID, UPNP_EVENT_TYPE, 1, 0))
-
-#define	UPNP_VERSION_INTERNET_GATEWAY_DEVICE		 2
-#define	UPNP_VERSION_WAN_COMMON_INTERFACE_CONFIG	 1
-
-#if UPNP_VERSION_INTERNET_GATEWAY_DEVICE >= 2
-#define UPNP_VERSION_WAN_DEVICE				 2
-#define	UPNP_VERSION_WAN_CONNECTION_DEVICE		 2
-#define	UPNP_VERSION_WAN_IP_CONNECTION			 2
-#else
-#define	UPNP_VERSION_WAN_DEVICE				 1
-#define	UPNP_VERSION_WAN_CONNECTION_DEVICE		 1
-#define	UPNP_VERSION_WAN_IP_CONNECTION			 1
-#endif
-
-#define	XML_INDENT_TREE					 1
+#include "upnp.h"
 
 #define	SOAP_ENVELOPE_URI \
 	"http://schemas.xmlsoap.org/soap/envelope/"
@@ -76,135 +38,6 @@
 #define	SOAP_NAMESPACE_PREFIX				 "s"
 #define	UPNP_NAMESPACE_PREFIX				 "u"
 
-enum upnp_variable_types {
-	UPNP_VARIABLE_TYPE_UI1 = 0,
-	UPNP_VARIABLE_TYPE_UI2,
-	UPNP_VARIABLE_TYPE_UI4,
-	UPNP_VARIABLE_TYPE_I1,
-	UPNP_VARIABLE_TYPE_I2,
-	UPNP_VARIABLE_TYPE_I4,
-	UPNP_VARIABLE_TYPE_INT,
-	UPNP_VARIABLE_TYPE_R4,
-	UPNP_VARIABLE_TYPE_R8,
-	UPNP_VARIABLE_TYPE_NUMBER,
-	UPNP_VARIABLE_TYPE_FIXED_14_4,
-	UPNP_VARIABLE_TYPE_FLOAT,
-	UPNP_VARIABLE_TYPE_CHAR,
-	UPNP_VARIABLE_TYPE_STRING,
-	UPNP_VARIABLE_TYPE_DATE,
-	UPNP_VARIABLE_TYPE_DATE_TIME,
-	UPNP_VARIABLE_TYPE_DATE_TIME_TZ,
-	UPNP_VARIABLE_TYPE_TIME,
-	UPNP_VARIABLE_TYPE_TIME_TZ,
-	UPNP_VARIABLE_TYPE_BOOLEAN,
-	UPNP_VARIABLE_TYPE_BIN_BASE64,
-	UPNP_VARIABLE_TYPE_BIN_HEX,
-	UPNP_VARIABLE_TYPE_URI,
-	UPNP_VARIABLE_TYPE_UUID,
-	UPNP_VARIABLE_TYPE_MAX,
-};
-
-enum upnp_variables {
-	UPNP_VARIABLE_EOL = -1,
-	/* WANCommonInterfaceConfig */
-	UPNP_VARIABLE_WAN_ACCESS_TYPE = 0,
-	UPNP_VARIABLE_LAYER_1_UPSTREAM_MAX_BIT_RATE,
-	UPNP_VARIABLE_LAYER_1_DOWNSTREAM_MAX_BIT_RATE,
-	UPNP_VARIABLE_PHYSICAL_LINK_STATUS,
-	/* WANIPConnection */
-	UPNP_VARIABLE_CONNECTION_TYPE,
-	UPNP_VARIABLE_POSSIBLE_CONNECTION_TYPES,
-	UPNP_VARIABLE_CONNECTION_STATUS,
-	UPNP_VARIABLE_UPTIME,
-	UPNP_VARIABLE_LAST_CONNECTION_ERROR,
-	UPNP_VARIABLE_RSIP_AVAILABLE,
-	UPNP_VARIABLE_NAT_ENABLED,
-	UPNP_VARIABLE_EXTERNAL_IP_ADDRESS,
-	UPNP_VARIABLE_PORT_MAPPING_NUMBER_OF_ENTRIES,
-	UPNP_VARIABLE_PORT_MAPPING_ENABLED,
-	UPNP_VARIABLE_PORT_MAPPING_LEASE_DURATION,
-	UPNP_VARIABLE_REMOTE_HOST,
-	UPNP_VARIABLE_EXTERNAL_PORT,
-	UPNP_VARIABLE_INTERNAL_PORT,
-	UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
-	UPNP_VARIABLE_INTERNAL_CLIENT,
-	UPNP_VARIABLE_PORT_MAPPING_DESCRIPTION,
-	UPNP_VARIABLE_SYSTEM_UPDATE_ID,
-	UPNP_VARIABLE_A_ARG_TYPE_MANAGE,
-	UPNP_VARIABLE_A_ARG_TYPE_PORT_LISTING,
-	UPNP_VARIABLE_MAX,
-};
-
-#define	UPNP_VARIABLE_FLAG_EVENT	(1<<0)
-#define	UPNP_VARIABLE_FLAG_MULTICAST	(1<<1)
-
-struct upnp_variable {
-	char				 *name;
-	enum upnp_variable_types	  type;
-	unsigned int			  flags;
-	char				**values;
-	/* Probably shouldn't be char */
-	char				 *value;
-	char				 *minimum;
-	char				 *maximum;
-	char				 *step;
-};
-
-#define	UPNP_ARGUMENT_FLAG_RETURN	(1<<0)
-
-struct upnp_argument {
-	char				*name;
-	unsigned int			 flags;
-	enum upnp_variables		 related;
-};
-
-enum upnp_actions {
-	UPNP_ACTION_EOL = -1,
-	/* WANCommonInterfaceConfig */
-	UPNP_ACTION_GET_COMMON_LINK_PROPERTIES = 0,
-	/* WANIPConnection */
-	UPNP_ACTION_SET_CONNECTION_TYPE,
-	UPNP_ACTION_GET_CONNECTION_TYPE_INFO,
-	UPNP_ACTION_REQUEST_CONNECTION,
-	UPNP_ACTION_FORCE_TERMINATION,
-	UPNP_ACTION_GET_STATUS_INFO,
-	UPNP_ACTION_GET_NAT_RSIP_STATUS,
-	UPNP_ACTION_GET_GENERIC_PORT_MAPPING_ENTRY,
-	UPNP_ACTION_GET_SPECIFIC_PORT_MAPPING_ENTRY,
-	UPNP_ACTION_ADD_PORT_MAPPING,
-	UPNP_ACTION_ADD_ANY_PORT_MAPPING,
-	UPNP_ACTION_DELETE_PORT_MAPPING,
-	UPNP_ACTION_DELETE_PORT_MAPPING_RANGE,
-	UPNP_ACTION_GET_EXTERNAL_IP_ADDRESS,
-	UPNP_ACTION_GET_LIST_OF_PORT_MAPPINGS,
-	UPNP_ACTION_MAX,
-};
-
-struct upnp_action {
-	char			*name;
-	unsigned int		 version, cin, cout;
-	struct upnp_argument 	*in;
-	struct upnp_argument 	*out;
-};
-
-struct upnp_service {
-	char			*nid;
-	struct upnp_nss		 nss;
-	char			*id;
-	char			*scpd;
-	char			*control;
-	char			*event;
-	enum upnp_actions	*actions;
-	enum upnp_variables	*variables;
-};
-
-struct upnp_device {
-	char			*nid;
-	struct upnp_nss		 nss;
-	enum upnp_services	*services;
-	enum upnp_devices	*devices;
-};
-
 enum upnp_errors {
 	UPNP_ERROR_INVALID_ACTION = 0,
 	UPNP_ERROR_INVALID_ARGS,
@@ -222,6 +55,21 @@ enum upnp_errors {
 	UPNP_ERROR_INVALID_SEQUENCE,
 	UPNP_ERROR_INVALID_CONTROL_URL,
 	UPNP_ERROR_NO_SUCH_SESSION,
+	/* WANIPConnection */
+	UPNP_ERROR_SPECIFIED_ARRAY_INDEX_INVALID,
+	UPNP_ERROR_NO_SUCH_ENTRY_IN_ARRAY,
+	UPNP_ERROR_WILD_CARD_NOT_PERMITTED_IN_SRC_IP,
+	UPNP_ERROR_WILD_CARD_NOT_PERMITTED_IN_EXT_PORT,
+	UPNP_ERROR_CONFLICT_IN_MAPPING_ENTRY,
+	UPNP_ERROR_SAME_PORT_VALUES_REQUIRED,
+	UPNP_ERROR_ONLY_PERMANENT_LEASES_SUPPORTED,
+	UPNP_ERROR_REMOTE_HOST_ONLY_SUPPORTS_WILDCARD,
+	UPNP_ERROR_EXTERNAL_PORT_ONLY_SUPPORTS_WILDCARD,
+	UPNP_ERROR_NO_PORT_MAPS_AVAILABLE,
+	UPNP_ERROR_CONFLICT_WITH_OTHER_MECHANISMS,
+	UPNP_ERROR_PORT_MAPPING_NOT_FOUND,
+	UPNP_ERROR_WILD_CARD_NOT_PERMITTED_IN_INT_PORT,
+	UPNP_ERROR_INCONSISTENT_PARAMETERS,
 	UPNP_ERROR_MAX,
 };
 
@@ -230,17 +78,61 @@ struct upnp_error {
 	char			*string;
 };
 
-void		 upnp_add_configid(xmlNodePtr, u_int32_t);
-void		 upnp_add_version(xmlNodePtr);
-void		 upnp_add_action(xmlNodePtr, const struct upnp_action *);
-void		 upnp_add_variable(xmlNodePtr, const struct upnp_variable *);
-xmlDocPtr	 upnp_service_xml(u_int32_t, enum upnp_services);
-void		 upnp_add_service(xmlNodePtr, u_int32_t, enum upnp_services,
-		     struct evhttp *, struct ssdp_device *,
-		     struct ssdp_services *);
-void		 upnp_add_device(xmlNodePtr, u_int32_t, enum upnp_devices,
-		     struct evhttp *, struct ssdp_devices *,
-		     struct ssdp_services *);
+#define	UPNP_MAX_ARGUMENTS	 8
+
+/* A single SOAP action invocation */
+struct upnp_request {
+	struct igdpcpd			*env;
+	struct evhttp_request		*req;
+	const struct upnp_action	*action;
+	char				*urn;
+	char				*in[UPNP_MAX_ARGUMENTS];
+	struct in_addr			 peer;
+};
+
+#define	UPNP_MAXIMUM_LEASE	 604800
+#define	UPNP_LISTING_CHUNK	 32
+
+#define	UPNP_PORT_LISTING_URN	 "urn:schemas-upnp-org:gw:WANIPConnection"
+#define	UPNP_PORT_LISTING_XSD \
+	"http://www.upnp.org/schemas/gw/WANIPConnection-v2.xsd"
+#define	XML_SCHEMA_INSTANCE_URI	 "http://www.w3.org/2001/XMLSchema-instance"
+
+/* How long a control point is kept waiting on a PCP server, in seconds */
+#define	UPNP_PCP_DURATION	 20
+
+/* A request whose reply waits on something else, such as a PCP server */
+struct upnp_deferred {
+	struct upnp_request		 ur;	/* Own copy of urn, no in[] */
+	struct evhttp_connection	*evcon;
+	u_int8_t			 any;
+};
+
+/* State for streaming a PortListing a chunk at a time */
+struct upnp_listing {
+	struct igdpcpd			*env;
+	struct evhttp_request		*req;
+	struct evhttp_connection	*evcon;
+	const struct upnp_action	*action;
+	struct evbuffer			*buffer;
+	enum mapping_protocols		 protocol;
+	u_int16_t			 eport;
+	struct in_addr			 remote;
+	int				 resume;
+	u_int16_t			 end;
+	u_int8_t			 manage;
+	struct in_addr			 client;
+	unsigned int			 left;
+};
+
+int		 upnp_lookup(const struct upnp_hash *, const char *, size_t);
+void		 upnp_fill(struct upnp_description *,
+		     const struct upnp_template *, struct igdpcpd *,
+		     struct ssdp_devices *);
+void		 upnp_add_service(struct igdpcpd *, enum upnp_services,
+		     struct ssdp_device *, struct ssdp_services *);
+void		 upnp_add_device(struct igdpcpd *, enum upnp_devices,
+		     struct ssdp_devices *, struct ssdp_services *);
 void		 upnp_add_xml(struct evbuffer *, xmlDocPtr);
 void		 upnp_content_length_header(struct evhttp_request *,
 		     struct evbuffer *);
@@ -249,865 +141,49 @@ void		 upnp_date_header(struct evhttp_request *);
 void		 upnp_server_header(struct evhttp_request *);
 void		 upnp_describe(struct evhttp_request *, void *);
 void		 upnp_soap_error(struct evhttp_request *, enum upnp_errors);
+void		 upnp_soap_response(struct upnp_request *, char **);
+void		 upnp_escape(struct evbuffer *, const char *, int);
+void		 upnp_peer(struct evhttp_request *, struct in_addr *);
+int		 upnp_parse_ui2(const char *, u_int16_t *);
+int		 upnp_parse_ui4(const char *, u_int32_t *);
+int		 upnp_parse_boolean(const char *, u_int8_t *);
+int		 upnp_parse_protocol(const char *, enum mapping_protocols *);
+int		 upnp_parse_address(const char *, struct in_addr *);
+int		 upnp_parse_callback(const char *, struct in_addr *,
+		     struct in_addr *, u_int16_t *, char **);
+int		 upnp_manager(struct upnp_request *);
+struct upnp_deferred	*upnp_defer(struct upnp_request *);
+void		 upnp_deferred_close(struct evhttp_connection *, void *);
+void		 upnp_deferred_free(struct upnp_deferred *);
+enum upnp_errors	 upnp_pcp_error(int, int);
+void		 upnp_add_mapping(struct upnp_request *, int);
+void		 upnp_add_mapping_done(struct pcp_request *, void *);
+void		 upnp_action_add_port_mapping(struct upnp_request *);
+void		 upnp_action_add_any_port_mapping(struct upnp_request *);
+void		 upnp_action_delete_port_mapping(struct upnp_request *);
+void		 upnp_action_delete_port_mapping_range(struct upnp_request *);
+void		 upnp_action_get_external_ip_address(struct upnp_request *);
+void		 upnp_action_get_list_of_port_mappings(struct upnp_request *);
+struct mapping	*upnp_listing_next(struct upnp_listing *);
+void		 upnp_listing_element(struct evbuffer *, const char *,
+		     const char *);
+void		 upnp_listing_entry(struct evbuffer *, struct mapping *);
+void		 upnp_listing_send(struct upnp_listing *);
+void		 upnp_listing_cb(struct evhttp_connection *, void *);
+void		 upnp_listing_close(struct evhttp_connection *, void *);
+void		 upnp_listing_free(struct upnp_listing *);
 void		 upnp_control(struct evhttp_request *, void *);
 void		 upnp_event(struct evhttp_request *, void *);
+void		 upnp_subscribe(struct evhttp_request *, struct igdpcpd *,
+		     enum upnp_services);
+void		 upnp_unsubscribe(struct evhttp_request *, struct igdpcpd *,
+		     enum upnp_services);
+const char	*upnp_variable_value(struct igdpcpd *, enum upnp_variables,
+		     char *, size_t);
 
 extern struct utsname	 name;
 const char		*upnp_version = UPNP_VERSION_STRING;
 
-/* Used for parsing and generating URN NSS */
-const char	*upnp_type[UPNP_TYPE_MAX] = {
-	UPNP_DEVICE_TYPE,
-	UPNP_SERVICE_TYPE,
-};
-
-/* UPnP variable types */
-const char	*upnp_variable_type[UPNP_VARIABLE_TYPE_MAX] = {
-	"ui1",
-	"ui2",
-	"ui4",
-	"i1",
-	"i2",
-	"i4",
-	"int",
-	"r4",
-	"r8",
-	"number",
-	"fixed.14.4",
-	"float",
-	"char",
-	"string",
-	"date",
-	"dateTime",
-	"dateTime.tz",
-	"time",
-	"time.tz",
-	"boolean",
-	"bin.base64",
-	"bin.hex",
-	"uri",
-	"uuid",
-};
-
-/* UPnP state variables */
-const struct upnp_variable	 upnp_variable[UPNP_VARIABLE_MAX] = {
-	/* WANCommonInterfaceConfig */
-	{
-		"WANAccessType",
-		UPNP_VARIABLE_TYPE_STRING,
-		0,
-		(char *[]){
-			"DSL",
-			"POTS",
-			"Cable",
-			"Ethernet",
-			NULL,
-		},
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"Layer1UpstreamMaxBitRate",
-		UPNP_VARIABLE_TYPE_UI4,
-		0,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"Layer1DownstreamMaxBitRate",
-		UPNP_VARIABLE_TYPE_UI4,
-		0,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"PhysicalLinkStatus",
-		UPNP_VARIABLE_TYPE_STRING,
-		UPNP_VARIABLE_FLAG_EVENT,
-		(char *[]){
-			"Up",
-			"Down",
-			NULL,
-		},
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	/* WANIPConnection */
-	{
-		"ConnectionType",
-		UPNP_VARIABLE_TYPE_STRING,
-		0,
-		(char *[]){
-			"Unconfigured",
-			"IP_Routed",
-			"IP_Bridged",
-			NULL,
-		},
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"PossibleConnectionTypes",
-		UPNP_VARIABLE_TYPE_STRING,
-		UPNP_VARIABLE_FLAG_EVENT,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"ConnectionStatus",
-		UPNP_VARIABLE_TYPE_STRING,
-		UPNP_VARIABLE_FLAG_EVENT,
-		(char *[]){
-			"Unconfigured",
-			"Connected",
-			"Disconnected",
-			NULL,
-		},
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"Uptime",
-		UPNP_VARIABLE_TYPE_UI4,
-		0,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"LastConnectionError",
-		UPNP_VARIABLE_TYPE_STRING,
-		0,
-		(char *[]){
-			"ERROR_NONE",
-			NULL,
-		},
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"RSIPAvailable",
-		UPNP_VARIABLE_TYPE_BOOLEAN,
-		0,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"NATEnabled",
-		UPNP_VARIABLE_TYPE_BOOLEAN,
-		0,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"ExternalIPAddress",
-		UPNP_VARIABLE_TYPE_STRING,
-		UPNP_VARIABLE_FLAG_EVENT,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"PortMappingNumberOfEntries",
-		UPNP_VARIABLE_TYPE_UI2,
-		UPNP_VARIABLE_FLAG_EVENT,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"PortMappingEnabled",
-		UPNP_VARIABLE_TYPE_BOOLEAN,
-		0,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"PortMappingLeaseDuration",
-		UPNP_VARIABLE_TYPE_UI4,
-		0,
-		NULL,
-		"3600", /* XXX */
-		"0",
-		"604800",
-		NULL,
-	},
-	{
-		"RemoteHost",
-		UPNP_VARIABLE_TYPE_STRING,
-		0,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"ExternalPort",
-		UPNP_VARIABLE_TYPE_UI2,
-		0,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"InternalPort",
-		UPNP_VARIABLE_TYPE_UI2,
-		0,
-		NULL,
-		NULL,
-		"1",
-		"65535",
-		NULL,
-	},
-	{
-		"PortMappingProtocol",
-		UPNP_VARIABLE_TYPE_STRING,
-		0,
-		(char *[]){
-			"TCP",
-			"UDP",
-			NULL,
-		},
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"InternalClient",
-		UPNP_VARIABLE_TYPE_STRING,
-		0,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"PortMappingDescription",
-		UPNP_VARIABLE_TYPE_STRING,
-		0,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"SystemUpdateID",
-		UPNP_VARIABLE_TYPE_UI4,
-		UPNP_VARIABLE_FLAG_EVENT,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"A_ARG_TYPE_Manage",
-		UPNP_VARIABLE_TYPE_BOOLEAN,
-		0,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-	{
-		"A_ARG_TYPE_PortListing",
-		UPNP_VARIABLE_TYPE_STRING,
-		0,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-		NULL,
-	},
-};
-
-/* UPnP actions */
-const struct upnp_action	 upnp_action[UPNP_ACTION_MAX] = {
-	/* WANCommonInterfaceConfig */
-	{
-		"GetCommonLinkProperties",
-		1, 0, 4,
-		NULL,
-		(struct upnp_argument[]){
-			{
-				"NewWANAccessType",
-				0,
-				UPNP_VARIABLE_WAN_ACCESS_TYPE,
-			},
-			{
-				"NewLayer1UpstreamMaxBitRate",
-				0,
-				UPNP_VARIABLE_LAYER_1_UPSTREAM_MAX_BIT_RATE,
-			},
-			{
-				"NewLayer1DownstreamMaxBitRate",
-				0,
-				UPNP_VARIABLE_LAYER_1_DOWNSTREAM_MAX_BIT_RATE,
-			},
-			{
-				"NewPhysicalLinkStatus",
-				0,
-				UPNP_VARIABLE_PHYSICAL_LINK_STATUS,
-			},
-		},
-	},
-	/* WANIPConnection */
-	{
-		"SetConnectionType",
-		1, 1, 0,
-		(struct upnp_argument[]){
-			{
-				"NewConnectionType",
-				0,
-				UPNP_VARIABLE_CONNECTION_TYPE,
-			},
-		},
-		NULL,
-	},
-	{
-		"GetConnectionTypeInfo",
-		1, 0, 2,
-		NULL,
-		(struct upnp_argument[]){
-			{
-				"NewConnectionType",
-				0,
-				UPNP_VARIABLE_CONNECTION_TYPE,
-			},
-			{
-				"NewPossibleConnectionTypes",
-				0,
-				UPNP_VARIABLE_POSSIBLE_CONNECTION_TYPES,
-			},
-		},
-	},
-	{
-		"RequestConnection",
-		1, 0, 0,
-		NULL,
-		NULL,
-	},
-	{
-		"ForceTermination",
-		1, 0, 0,
-		NULL,
-		NULL,
-	},
-	{
-		"GetStatusInfo",
-		1, 0, 3,
-		NULL,
-		(struct upnp_argument[]){
-			{
-				"NewConnectionStatus",
-				0,
-				UPNP_VARIABLE_CONNECTION_STATUS,
-			},
-			{
-				"NewLastConnectionError",
-				0,
-				UPNP_VARIABLE_LAST_CONNECTION_ERROR,
-			},
-			{
-				"NewUptime",
-				0,
-				UPNP_VARIABLE_UPTIME,
-			},
-		},
-	},
-	{
-		"GetNATRSIPStatus",
-		1, 0, 2,
-		NULL,
-		(struct upnp_argument[]){
-			{
-				"NewRSIPAvailable",
-				0,
-				UPNP_VARIABLE_RSIP_AVAILABLE,
-			},
-			{
-				"NewNATEnabled",
-				0,
-				UPNP_VARIABLE_NAT_ENABLED,
-			},
-		},
-	},
-	{
-		"GetGenericPortMappingEntry",
-		1, 1, 8,
-		(struct upnp_argument[]){
-			{
-				"NewPortMappingIndex",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_NUMBER_OF_ENTRIES,
-			},
-		},
-		(struct upnp_argument[]){
-			{
-				"NewRemoteHost",
-				0,
-				UPNP_VARIABLE_REMOTE_HOST,
-			},
-			{
-				"NewExternalPort",
-				0,
-				UPNP_VARIABLE_EXTERNAL_PORT,
-			},
-			{
-				"NewProtocol",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
-			},
-			{
-				"NewInternalPort",
-				0,
-				UPNP_VARIABLE_INTERNAL_PORT,
-			},
-			{
-				"NewInternalClient",
-				0,
-				UPNP_VARIABLE_INTERNAL_CLIENT,
-			},
-			{
-				"NewEnabled",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_ENABLED,
-			},
-			{
-				"NewPortMappingDescription",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_DESCRIPTION,
-			},
-			{
-				"NewLeaseDuration",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_LEASE_DURATION,
-			},
-		},
-	},
-	{
-		"GetSpecificPortMappingEntry",
-		1, 3, 5,
-		(struct upnp_argument[]){
-			{
-				"NewRemoteHost",
-				0,
-				UPNP_VARIABLE_REMOTE_HOST,
-			},
-			{
-				"NewExternalPort",
-				0,
-				UPNP_VARIABLE_EXTERNAL_PORT,
-			},
-			{
-				"NewProtocol",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
-			},
-		},
-		(struct upnp_argument[]){
-			{
-				"NewInternalPort",
-				0,
-				UPNP_VARIABLE_INTERNAL_PORT,
-			},
-			{
-				"NewInternalClient",
-				0,
-				UPNP_VARIABLE_INTERNAL_CLIENT,
-			},
-			{
-				"NewEnabled",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_ENABLED,
-			},
-			{
-				"NewPortMappingDescription",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_DESCRIPTION,
-			},
-			{
-				"NewLeaseDuration",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_LEASE_DURATION,
-			},
-		},
-	},
-	{
-		"AddPortMapping",
-		1, 8, 0,
-		(struct upnp_argument[]){
-			{
-				"NewRemoteHost",
-				0,
-				UPNP_VARIABLE_REMOTE_HOST,
-			},
-			{
-				"NewExternalPort",
-				0,
-				UPNP_VARIABLE_EXTERNAL_PORT,
-			},
-			{
-				"NewProtocol",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
-			},
-			{
-				"NewInternalPort",
-				0,
-				UPNP_VARIABLE_INTERNAL_PORT,
-			},
-			{
-				"NewInternalClient",
-				0,
-				UPNP_VARIABLE_INTERNAL_CLIENT,
-			},
-			{
-				"NewEnabled",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_ENABLED,
-			},
-			{
-				"NewPortMappingDescription",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_DESCRIPTION,
-			},
-			{
-				"NewLeaseDuration",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_LEASE_DURATION,
-			},
-		},
-		NULL,
-	},
-	{
-		"AddAnyPortMapping",
-		2, 8, 1,
-		(struct upnp_argument[]){
-			{
-				"NewRemoteHost",
-				0,
-				UPNP_VARIABLE_REMOTE_HOST,
-			},
-			{
-				"NewExternalPort",
-				0,
-				UPNP_VARIABLE_EXTERNAL_PORT,
-			},
-			{
-				"NewProtocol",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
-			},
-			{
-				"NewInternalPort",
-				0,
-				UPNP_VARIABLE_INTERNAL_PORT,
-			},
-			{
-				"NewInternalClient",
-				0,
-				UPNP_VARIABLE_INTERNAL_CLIENT,
-			},
-			{
-				"NewEnabled",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_ENABLED,
-			},
-			{
-				"NewPortMappingDescription",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_DESCRIPTION,
-			},
-			{
-				"NewLeaseDuration",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_LEASE_DURATION,
-			},
-		},
-		(struct upnp_argument[]){
-			{
-				"NewReservedPort",
-				0,
-				UPNP_VARIABLE_EXTERNAL_PORT,
-			},
-		},
-	},
-	{
-		"DeletePortMapping",
-		1, 3, 0,
-		(struct upnp_argument[]){
-			{
-				"NewRemoteHost",
-				0,
-				UPNP_VARIABLE_REMOTE_HOST,
-			},
-			{
-				"NewExternalPort",
-				0,
-				UPNP_VARIABLE_EXTERNAL_PORT,
-			},
-			{
-				"NewProtocol",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
-			},
-		},
-		NULL,
-	},
-	{
-		"DeletePortMappingRange",
-		2, 4, 0,
-		(struct upnp_argument[]){
-			{
-				"NewStartPort",
-				0,
-				UPNP_VARIABLE_EXTERNAL_PORT,
-			},
-			{
-				"NewEndPort",
-				0,
-				UPNP_VARIABLE_EXTERNAL_PORT,
-			},
-			{
-				"NewProtocol",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
-			},
-			{
-				"NewManage",
-				0,
-				UPNP_VARIABLE_A_ARG_TYPE_MANAGE,
-			},
-		},
-		NULL,
-	},
-	{
-		"GetExternalIPAddress",
-		1, 0, 1,
-		NULL,
-		(struct upnp_argument[]){
-			{
-				"NewExternalIPAddress",
-				0,
-				UPNP_VARIABLE_EXTERNAL_IP_ADDRESS,
-			},
-		},
-	},
-	{
-		"GetListOfPortMappings",
-		2, 5, 1,
-		(struct upnp_argument[]){
-			{
-				"NewStartPort",
-				0,
-				UPNP_VARIABLE_EXTERNAL_PORT,
-			},
-			{
-				"NewEndPort",
-				0,
-				UPNP_VARIABLE_EXTERNAL_PORT,
-			},
-			{
-				"NewProtocol",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
-			},
-			{
-				"NewManage",
-				0,
-				UPNP_VARIABLE_A_ARG_TYPE_MANAGE,
-			},
-			{
-				"NewNumberOfPorts",
-				0,
-				UPNP_VARIABLE_PORT_MAPPING_NUMBER_OF_ENTRIES,
-			},
-		},
-		(struct upnp_argument[]){
-			{
-				"NewPortListing",
-				0,
-				UPNP_VARIABLE_A_ARG_TYPE_PORT_LISTING,
-			},
-		},
-	},
-};
-
-/* UPnP services */
-const struct upnp_service	 upnp_service[UPNP_SERVICE_MAX] = {
-	{
-		UPNP_SCHEMA_NID,
-		{
-			UPNP_TYPE_SERVICE,
-			"WANCommonInterfaceConfig",
-			UPNP_VERSION_WAN_COMMON_INTERFACE_CONFIG,
-		},
-		UPNP_SERVICE_ID_URN(UPNP_NID, "WANCommonIFC", 1),
-		"/describe/WANCommonInterfaceConfig.xml",
-		"/control/WANCommonInterfaceConfig",
-		"/event/WANCommonInterfaceConfig",
-		(enum upnp_actions[]){
-			UPNP_ACTION_GET_COMMON_LINK_PROPERTIES,
-			UPNP_ACTION_EOL,
-		},
-		(enum upnp_variables[]){
-			UPNP_VARIABLE_WAN_ACCESS_TYPE,
-			UPNP_VARIABLE_LAYER_1_UPSTREAM_MAX_BIT_RATE,
-			UPNP_VARIABLE_LAYER_1_DOWNSTREAM_MAX_BIT_RATE,
-			UPNP_VARIABLE_PHYSICAL_LINK_STATUS,
-			UPNP_VARIABLE_EOL,
-		},
-	},
-	{
-		UPNP_SCHEMA_NID,
-		{
-			UPNP_TYPE_SERVICE,
-			"WANIPConnection",
-			UPNP_VERSION_WAN_IP_CONNECTION,
-		},
-		UPNP_SERVICE_ID_URN(UPNP_NID, "WANIPConn", 1),
-		"/describe/WANIPConnection.xml",
-		"/control/WANIPConnection",
-		"/event/WANIPConnection",
-		(enum upnp_actions[]){
-			UPNP_ACTION_SET_CONNECTION_TYPE,
-			UPNP_ACTION_GET_CONNECTION_TYPE_INFO,
-			UPNP_ACTION_REQUEST_CONNECTION,
-			UPNP_ACTION_FORCE_TERMINATION,
-			UPNP_ACTION_GET_STATUS_INFO,
-			UPNP_ACTION_GET_NAT_RSIP_STATUS,
-			UPNP_ACTION_GET_GENERIC_PORT_MAPPING_ENTRY,
-			UPNP_ACTION_GET_SPECIFIC_PORT_MAPPING_ENTRY,
-			UPNP_ACTION_ADD_PORT_MAPPING,
-#if UPNP_VERSION_WAN_IP_CONNECTION >= 2
-			UPNP_ACTION_ADD_ANY_PORT_MAPPING,
-#endif
-			UPNP_ACTION_DELETE_PORT_MAPPING,
-#if UPNP_VERSION_WAN_IP_CONNECTION >= 2
-			UPNP_ACTION_DELETE_PORT_MAPPING_RANGE,
-#endif
-			UPNP_ACTION_GET_EXTERNAL_IP_ADDRESS,
-#if UPNP_VERSION_WAN_IP_CONNECTION >= 2
-			UPNP_ACTION_GET_LIST_OF_PORT_MAPPINGS,
-#endif
-			UPNP_ACTION_EOL,
-		},
-		(enum upnp_variables[]){
-			UPNP_VARIABLE_CONNECTION_TYPE,
-			UPNP_VARIABLE_POSSIBLE_CONNECTION_TYPES,
-			UPNP_VARIABLE_CONNECTION_STATUS,
-			UPNP_VARIABLE_UPTIME,
-			UPNP_VARIABLE_LAST_CONNECTION_ERROR,
-			UPNP_VARIABLE_RSIP_AVAILABLE,
-			UPNP_VARIABLE_NAT_ENABLED,
-			UPNP_VARIABLE_EXTERNAL_IP_ADDRESS,
-			UPNP_VARIABLE_PORT_MAPPING_NUMBER_OF_ENTRIES,
-			UPNP_VARIABLE_PORT_MAPPING_ENABLED,
-			UPNP_VARIABLE_PORT_MAPPING_LEASE_DURATION,
-			UPNP_VARIABLE_REMOTE_HOST,
-			UPNP_VARIABLE_EXTERNAL_PORT,
-			UPNP_VARIABLE_INTERNAL_PORT,
-			UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
-			UPNP_VARIABLE_INTERNAL_CLIENT,
-			UPNP_VARIABLE_PORT_MAPPING_DESCRIPTION,
-#if UPNP_VERSION_WAN_IP_CONNECTION >= 2
-			UPNP_VARIABLE_SYSTEM_UPDATE_ID,
-			UPNP_VARIABLE_A_ARG_TYPE_MANAGE,
-			UPNP_VARIABLE_A_ARG_TYPE_PORT_LISTING,
-#endif
-			UPNP_VARIABLE_EOL,
-		},
-	},
-};
-
-/* UPnP devices */
-const struct upnp_device	upnp_device[UPNP_DEVICE_MAX] = {
-	{
-		UPNP_SCHEMA_NID,
-		{
-			UPNP_TYPE_DEVICE,
-			"InternetGatewayDevice",
-			UPNP_VERSION_INTERNET_GATEWAY_DEVICE,
-		},
-		NULL,
-		(enum upnp_devices[]){
-			UPNP_DEVICE_WAN_DEVICE,
-			UPNP_DEVICE_EOL,
-		},
-	},
-	{
-		UPNP_SCHEMA_NID,
-		{
-			UPNP_TYPE_DEVICE,
-			"WANDevice",
-			UPNP_VERSION_WAN_DEVICE,
-		},
-		(enum upnp_services[]){
-			UPNP_SERVICE_WAN_COMMON_INTERFACE_CONFIG,
-			UPNP_SERVICE_EOL,
-		},
-		(enum upnp_devices[]){
-			UPNP_DEVICE_WAN_CONNECTION_DEVICE,
-			UPNP_DEVICE_EOL,
-		},
-	},
-	{
-		UPNP_SCHEMA_NID,
-		{
-			UPNP_TYPE_DEVICE,
-			"WANConnectionDevice",
-			UPNP_VERSION_WAN_CONNECTION_DEVICE,
-		},
-		(enum upnp_services[]){
-			UPNP_SERVICE_WAN_IP_CONNECTION,
-			UPNP_SERVICE_EOL,
-		},
-		NULL,
-	},
-};
-
 /* UPnP errors */
 const struct upnp_error		 upnp_error[UPNP_ERROR_MAX] = {
 	{ 401, "Invalid Action" },
@@ -1126,6 +202,42 @@ const struct upnp_error		 upnp_error[UPNP_ERROR_MAX] = {
 	{ 610, "Invalid sequence" },
 	{ 611, "Invalid control URL" },
 	{ 612, "No such session" },
+	/* WANIPConnection */
+	{ 713, "SpecifiedArrayIndexInvalid" },
+	{ 714, "NoSuchEntryInArray" },
+	{ 715, "WildCardNotPermittedInSrcIP" },
+	{ 716, "WildCardNotPermittedInExtPort" },
+	{ 718, "ConflictInMappingEntry" },
+	{ 724, "SamePortValuesRequired" },
+	{ 725, "OnlyPermanentLeasesSupported" },
+	{ 726, "RemoteHostOnlySupportsWildcard" },
+	{ 727, "ExternalPortOnlySupportsWildcard" },
+	{ 728, "NoPortMapsAvailable" },
+	{ 729, "ConflictWithOtherMechanisms" },
+	{ 730, "PortMappingNotFound" },
+	{ 732, "WildCardNotPermittedInIntPort" },
+	{ 733, "InconsistentParameters" },
+};
+
+/* UPnP action handlers, NULL if not implemented */
+void (* const upnp_handler[UPNP_ACTION_MAX])(struct upnp_request *) = {
+	/* WANCommonInterfaceConfig */
+	NULL,					/* GetCommonLinkProperties */
+	/* WANIPConnection */
+	NULL,					/* SetConnectionType */
+	NULL,					/* GetConnectionTypeInfo */
+	NULL,					/* RequestConnection */
+	NULL,					/* ForceTermination */
+	NULL,					/* GetStatusInfo */
+	NULL,					/* GetNATRSIPStatus */
+	NULL,					/* GetGenericPortMappingEntry */
+	NULL,					/* GetSpecificPortMappingEntry */
+	upnp_action_add_port_mapping,		/* AddPortMapping */
+	upnp_action_add_any_port_mapping,	/* AddAnyPortMapping */
+	upnp_action_delete_port_mapping,	/* DeletePortMapping */
+	upnp_action_delete_port_mapping_range,	/* DeletePortMappingRange */
+	upnp_action_get_external_ip_address,	/* GetExternalIPAddress */
+	upnp_action_get_list_of_port_mappings,	/* GetListOfPortMappings */
 };
 
 /* Return the string representation of the UPnP NSS structure */
@@ -1196,170 +308,138 @@ upnp_nss_from_string(char *str)
 	return (nss);
 }
 
-/* Free a UPnP NSS structure */
-void
-upnp_nss_free(struct upnp_nss *nss)
+/* Parse a UPnP NSS in place, the view points into str */
+int
+upnp_nss_view_from_string(const char *str, size_t len,
+    struct upnp_nss_view *nv)
 {
-	free(nss->name);
-	free(nss);
-}
+	const char	*p, *end = str + len;
+	u_int64_t	 version = 0;
+	size_t		 n;
+	int		 i;
 
-void
-upnp_add_configid(xmlNodePtr node, u_int32_t version)
-{
-	size_t	 len;
-	char	*str;
+	for (i = 0; i < UPNP_TYPE_MAX; i++) {
+		n = strlen(upnp_type[i]);
+		if (len >= n && !strncmp(str, upnp_type[i], n))
+			break;
+	}
 
-	len = snprintf(NULL, 0, "%d", version);
-	if ((str = calloc(len + 1, sizeof(char))) == NULL)
-		fatal("calloc");
-	snprintf(str, len + 1, "%d", version);
+	if (i == UPNP_TYPE_MAX)
+		return (-1);
 
-	xmlNewProp(node, "configId", "1");
+	nv->type = i;
+	str += n;
 
-	free(str);
-}
+	if (str == end || *str != ':')
+		return (-1);
 
-void
-upnp_add_version(xmlNodePtr node)
-{
-	xmlNodePtr	 version;
+	p = ++str;
+	while (p < end && isalnum((unsigned char)*p))
+		p++;
+	if (p == end || *p != ':')
+		return (-1);
+
+	nv->name = str;
+	nv->name_len = p - str;
+
+	/* Same as strtonum(3) from 1 to UINT_MAX, digits only */
+	if (++p == end)
+		return (-1);
+	for (; p < end; p++) {
+		if (!isdigit((unsigned char)*p) ||
+		    (version = (version * 10) + (*p - '0')) > UINT_MAX)
+			return (-1);
+	}
+	if (version == 0)
+		return (-1);
 
-	version = xmlNewChild(node, NULL, "specVersion", NULL);
+	nv->version = version;
 
-	xmlNewChild(version, NULL, "major", UPNP_STRING(UPNP_VERSION_MAJOR));
-	xmlNewChild(version, NULL, "minor", UPNP_STRING(UPNP_VERSION_MINOR));
+	return (0);
 }
 
+/* Free a UPnP NSS structure */
 void
-upnp_add_action(xmlNodePtr node, const struct upnp_action *parent)
+upnp_nss_free(struct upnp_nss *nss)
 {
-	xmlNodePtr			 action, arguments, argument;
-	const struct upnp_argument	*arg;
-	unsigned int			 i;
-
-	action = xmlNewChild(node, NULL, "action", NULL);
-
-	xmlNewChild(action, NULL, "name", parent->name);
-
-	if (parent->cin || parent->cout) {
-		arguments = xmlNewChild(action, NULL, "argumentList", NULL);
-
-		for (i = 0, arg = parent->in; i < parent->cin; i++, arg++) {
-			argument = xmlNewChild(arguments, NULL, "argument",
-			    NULL);
-			xmlNewChild(argument, NULL, "name", arg->name);
-			xmlNewChild(argument, NULL, "direction", "in");
-			if (arg->flags & UPNP_ARGUMENT_FLAG_RETURN)
-				xmlNewChild(argument, NULL, "retval", NULL);
-			xmlNewChild(argument, NULL, "relatedStateVariable",
-			    upnp_variable[arg->related].name);
-		}
-
-		for (i = 0, arg = parent->out; i < parent->cout; i++, arg++) {
-			argument = xmlNewChild(arguments, NULL, "argument",
-			    NULL);
-			xmlNewChild(argument, NULL, "name", arg->name);
-			xmlNewChild(argument, NULL, "direction", "out");
-			if (arg->flags & UPNP_ARGUMENT_FLAG_RETURN)
-				xmlNewChild(argument, NULL, "retval", NULL);
-			xmlNewChild(argument, NULL, "relatedStateVariable",
-			    upnp_variable[arg->related].name);
-		}
-	}
+	free(nss->name);
+	free(nss);
 }
 
-void
-upnp_add_variable(xmlNodePtr node, const struct upnp_variable *parent)
+/* Look a name up in one of the generated perfect hashes, -1 if it isn't
+ * there
+ */
+int
+upnp_lookup(const struct upnp_hash *hash, const char *key, size_t len)
 {
-	xmlNodePtr	 variable, type, values, range;
-	int		 i;
-
-	variable = xmlNewChild(node, NULL, "stateVariable", NULL);
-	if (!(parent->flags & UPNP_VARIABLE_FLAG_EVENT))
-		xmlNewProp(variable, "sendEvents", "no");
-
-#if UPNP_VERSION_NUMBER >= 0x0101
-	if (parent->flags & UPNP_VARIABLE_FLAG_MULTICAST)
-		xmlNewProp(variable, "multicast", "yes");
-#endif
-
-	xmlNewChild(variable, NULL, "name", parent->name);
-	type = xmlNewChild(variable, NULL, "dataType",
-	    upnp_variable_type[parent->type]);
-
-#if UPNP_VERSION_NUMBER >= 0x0101
-	/* FIXME type= */
-#endif
-
-	if (parent->value)
-		xmlNewChild(variable, NULL, "defaultValue", parent->value);
+	const struct upnp_slot	*slot;
 
-	if (parent->type == UPNP_VARIABLE_TYPE_STRING && parent->values) {
-		values = xmlNewChild(variable, NULL, "allowedValueList", NULL);
-		for (i = 0; parent->values[i]; i++)
-			xmlNewChild(values, NULL, "allowedValue",
-			    parent->values[i]);
-	}
+	slot = &hash->slots[upnp_hash(hash->seed, key, len) & hash->mask];
+	if (slot->key == NULL || slot->len != len ||
+	    memcmp(slot->key, key, len))
+		return (-1);
 
-	if (parent->minimum && parent->maximum) {
-		range = xmlNewChild(variable, NULL, "allowedValueRange", NULL);
-		xmlNewChild(range, NULL, "minimum", parent->minimum);
-		xmlNewChild(range, NULL, "maximum", parent->maximum);
-		if (parent->step)
-			xmlNewChild(range, NULL, "step", parent->step);
-	}
+	return (slot->value);
 }
 
-xmlDocPtr
-upnp_service_xml(u_int32_t version, enum upnp_services service)
+/* The device or service an NSS names, -1 if it isn't one of ours */
+int
+upnp_type_find(struct upnp_nss_view *nv)
 {
-	xmlDocPtr	 document;
-	xmlNodePtr	 scpd, actions, variables;
-	xmlNsPtr	 ns;
-	int		 i;
-
-	document = xmlNewDoc("1.0");
-	scpd = xmlNewNode(NULL, "scpd");
-	xmlDocSetRootElement(document, scpd);
-
-	/* From this point, every child node inherits the namespace */
-	ns = xmlNewNs(scpd, UPNP_SERVICE_SCHEMA_URN, NULL);
-	xmlSetNs(scpd, ns);
-
-#if UPNP_VERSION_NUMBER >= 0x0101
-	upnp_add_configid(scpd, version);
-#endif
-
-	upnp_add_version(scpd);
+	return (upnp_lookup(&upnp_type_hash[nv->type], nv->name,
+	    nv->name_len));
+}
 
-	/* Actions are optional */
-	if (upnp_service[service].actions) {
-		actions = xmlNewChild(scpd, NULL, "actionList", NULL);
-		for (i = 0;
-		    upnp_service[service].actions[i] != UPNP_ACTION_EOL; i++)
-			upnp_add_action(actions,
-			    &upnp_action[upnp_service[service].actions[i]]);
-	}
+/* Fill in the holes in a generated template, the result is kept and
+ * handed to every GET. UDNs are taken from the devices in the order
+ * upnp_add_device() made them, which is the order upnpgen numbered them
+ */
+void
+upnp_fill(struct upnp_description *description,
+    const struct upnp_template *t, struct igdpcpd *env,
+    struct ssdp_devices *devices)
+{
+	struct evbuffer		*buffer;
+	struct ssdp_device	*device = NULL;
+	unsigned int		 i;
 
-	/* Variables are mandatory */
-	variables = xmlNewChild(scpd, NULL, "serviceStateTable", NULL);
-	for (i = 0; upnp_service[service].variables[i] != UPNP_VARIABLE_EOL;
-	    i++)
-		upnp_add_variable(variables,
-		    &upnp_variable[upnp_service[service].variables[i]]);
+	if ((buffer = evbuffer_new()) == NULL)
+		fatal("evbuffer_new");
 
-	xmlSaveFormatFileEnc("-", document, NULL, XML_INDENT_TREE);
+	for (; t->field != UPNP_FIELD_END; t++)
+		switch (t->field) {
+		case UPNP_FIELD_TEXT:
+			evbuffer_add(buffer, t->text, t->len);
+			break;
+		case UPNP_FIELD_CONFIGID:
+			evbuffer_add_printf(buffer, "%u", env->sc_version);
+			break;
+		case UPNP_FIELD_UDN:
+			if (devices != NULL)
+				for (i = 0, device = TAILQ_FIRST(devices);
+				    device && i < t->device;
+				    i++, device = TAILQ_NEXT(device, entry))
+					;
+			if (device == NULL)
+				fatalx("no device for UDN");
+			evbuffer_add(buffer, device->uuid,
+			    strlen(device->uuid));
+			break;
+		default:
+			break;
+		}
 
-	return (document);
+	description->len = evbuffer_get_length(buffer);
+	if ((description->xml = malloc(description->len)) == NULL)
+		fatal("malloc");
+	evbuffer_remove(buffer, description->xml, description->len);
+	evbuffer_free(buffer);
 }
 
 void
-upnp_add_service(xmlNodePtr node, u_int32_t version, enum upnp_services type,
-    struct evhttp *http, struct ssdp_device *parent,
-    struct ssdp_services *services)
+upnp_add_service(struct igdpcpd *env, enum upnp_services type,
+    struct ssdp_device *parent, struct ssdp_services *services)
 {
-	xmlNodePtr		 service;
 	struct ssdp_service	*ssdp;
 	char			*urn;
 
@@ -1368,7 +448,8 @@ upnp_add_service(xmlNodePtr node, u_int32_t version, enum upnp_services type,
 		fatal("calloc");
 
 	ssdp->parent = parent;
-	ssdp->document = upnp_service_xml(version, type);
+	ssdp->service = type;
+	upnp_fill(&ssdp->description, upnp_scpd_template[type], env, NULL);
 	if ((ssdp->nss = calloc(1, sizeof(struct upnp_nss))) == NULL)
 		fatal("calloc");
 	memcpy(ssdp->nss, &upnp_service[type].nss, sizeof(struct upnp_nss));
@@ -1378,34 +459,27 @@ upnp_add_service(xmlNodePtr node, u_int32_t version, enum upnp_services type,
 		fatalx("upnp_nss_to_string");
 	if ((ssdp->urn->nid = strdup(upnp_service[type].nid)) == NULL)
 		fatal("strdup");
+	ssdp->urn->atom = urn_intern(ssdp->urn->nid);
 
 	if ((urn = urn_to_string(ssdp->urn)) == NULL)
 		fatalx("urn_to_string");
-
-	service = xmlNewChild(node, NULL, "service", NULL);
-
-	xmlNewChild(service, NULL, "serviceType", urn);
-	xmlNewChild(service, NULL, "serviceId", upnp_service[type].id);
-	xmlNewChild(service, NULL, "SCPDURL", upnp_service[type].scpd);
-	xmlNewChild(service, NULL, "controlURL", upnp_service[type].control);
-	xmlNewChild(service, NULL, "eventSubURL", upnp_service[type].event);
-
+	ssdp->type = urn_intern(urn);
 	free(urn);
 
 	TAILQ_INSERT_TAIL(services, ssdp, entry);
 
-	evhttp_set_cb(http, upnp_service[type].scpd, upnp_describe,
-	    ssdp->document);
-	evhttp_set_cb(http, upnp_service[type].control, upnp_control, NULL);
-	evhttp_set_cb(http, upnp_service[type].event, upnp_event, NULL);
+	evhttp_set_cb(env->sc_httpd, upnp_service[type].scpd, upnp_describe,
+	    &ssdp->description);
+	evhttp_set_cb(env->sc_httpd, upnp_service[type].control, upnp_control,
+	    env);
+	evhttp_set_cb(env->sc_httpd, upnp_service[type].event, upnp_event,
+	    env);
 }
 
 void
-upnp_add_device(xmlNodePtr node, u_int32_t version, enum upnp_devices type,
-    struct evhttp *http, struct ssdp_devices *devices,
-    struct ssdp_services *services)
+upnp_add_device(struct igdpcpd *env, enum upnp_devices type,
+    struct ssdp_devices *devices, struct ssdp_services *services)
 {
-	xmlNodePtr		 device, icons, servicelist, devicelist;
 	uuid_t			*uuid;
 	char			*str, *ptr = NULL, *urn;
 	struct ssdp_device	*ssdp;
@@ -1415,6 +489,7 @@ upnp_add_device(xmlNodePtr node, u_int32_t version, enum upnp_devices type,
 	if ((ssdp = calloc(1, sizeof(struct ssdp_device))) == NULL)
 		fatal("calloc");
 
+	ssdp->device = type;
 	if ((ssdp->nss = calloc(1, sizeof(struct upnp_nss))) == NULL)
 		fatal("calloc");
 	memcpy(ssdp->nss, &upnp_device[type].nss, sizeof(struct upnp_nss));
@@ -1424,22 +499,12 @@ upnp_add_device(xmlNodePtr node, u_int32_t version, enum upnp_devices type,
 		fatalx("upnp_nss_to_string");
 	if ((ssdp->urn->nid = strdup(upnp_device[type].nid)) == NULL)
 		fatal("strdup");
+	ssdp->urn->atom = urn_intern(ssdp->urn->nid);
 
 	if ((urn = urn_to_string(ssdp->urn)) == NULL)
 		fatalx("urn_to_string");
-
-	device = xmlNewChild(node, NULL, "device", NULL);
-
-	xmlNewChild(device, NULL, "deviceType", urn);
-
-	/* FIXME */
-	xmlNewChild(device, NULL, "friendlyName", "test");
-	xmlNewChild(device, NULL, "manufacturer", "test");
-	xmlNewChild(device, NULL, "modelDescription", "test");
-	xmlNewChild(device, NULL, "modelName", "test");
-	xmlNewChild(device, NULL, "modelNumber", "test");
-	xmlNewChild(device, NULL, "modelURL", "test");
-	xmlNewChild(device, NULL, "serialNumber", "test");
+	ssdp->type = urn_intern(urn);
+	free(urn);
 
 	if (uuid_create(&uuid) != 0)
 		fatalx("uuid_create");
@@ -1456,49 +521,33 @@ upnp_add_device(xmlNodePtr node, u_int32_t version, enum upnp_devices type,
 	strlcat(str, ptr, UUID_LEN_STR + 6);
 	free(ptr);
 
-	xmlNewChild(device, NULL, "UDN", str);
-
 	if (uuid_destroy(uuid) != 0)
 		fatalx("uuid_destroy");
 
-	/* FIXME */
-	xmlNewChild(device, NULL, "UPC", "test");
-	icons = xmlNewChild(device, NULL, "iconList", NULL);
-
 	ssdp->uuid = str;
 
-	free(urn);
-
 	TAILQ_INSERT_TAIL(devices, ssdp, entry);
 
-	if (upnp_device[type].services) {
-		servicelist = xmlNewChild(device, NULL, "serviceList", NULL);
+	if (upnp_device[type].services)
 		for (i = 0; upnp_device[type].services[i] != UPNP_SERVICE_EOL;
 		    i++)
-			upnp_add_service(servicelist, version,
-			    upnp_device[type].services[i], http, ssdp,
-			    services);
-	}
+			upnp_add_service(env, upnp_device[type].services[i],
+			    ssdp, services);
 
-	if (upnp_device[type].devices) {
-		devicelist = xmlNewChild(device, NULL, "deviceList", NULL);
+	if (upnp_device[type].devices)
 		for (i = 0; upnp_device[type].devices[i] != UPNP_DEVICE_EOL;
 		    i++)
-			upnp_add_device(devicelist, version,
-			    upnp_device[type].devices[i], http, devices,
-			    services);
-	}
-
-	xmlNewChild(device, NULL, "presentationURL", "/");
+			upnp_add_device(env, upnp_device[type].devices[i],
+			    devices, services);
 }
 
+/* The description documents come from templates upnpgen made of the
+ * tables at build time, only the configId and UDNs are filled in here
+ */
 struct ssdp_root *
-upnp_root_device(u_int32_t version, enum upnp_devices type,
-    struct evhttp *http)
+upnp_root_device(struct igdpcpd *env, enum upnp_devices type)
 {
 	struct ssdp_root	*root;
-	xmlNodePtr		 node;
-	xmlNsPtr		 ns;
 
 	if ((root = calloc(1, sizeof(struct ssdp_root))) == NULL)
 		return (NULL);
@@ -1506,25 +555,13 @@ upnp_root_device(u_int32_t version, enum upnp_devices type,
 	TAILQ_INIT(&root->devices);
 	TAILQ_INIT(&root->services);
 
-	root->document = xmlNewDoc("1.0");
-	node = xmlNewNode(NULL, "root");
-	xmlDocSetRootElement(root->document, node);
-
-	/* From this point, every child node inherits the namespace */
-	ns = xmlNewNs(node, UPNP_DEVICE_SCHEMA_URN, NULL);
-	xmlSetNs(node, ns);
-
-#if UPNP_VERSION_NUMBER >= 0x0101
-	upnp_add_configid(node, version);
-#endif
-
-	upnp_add_version(node);
+	upnp_add_device(env, type, &root->devices, &root->services);
 
-	upnp_add_device(node, version, type, http, &root->devices,
-	    &root->services);
+	upnp_fill(&root->description, upnp_root_template[type], env,
+	    &root->devices);
 
-	evhttp_set_cb(http, "/describe/root.xml", upnp_describe,
-	    root->document);
+	evhttp_set_cb(env->sc_httpd, "/describe/root.xml", upnp_describe,
+	    &root->description);
 
 	return (root);
 }
@@ -1609,8 +646,8 @@ upnp_server_header(struct evhttp_request *req)
 void
 upnp_describe(struct evhttp_request *req, void *arg)
 {
-	xmlDocPtr	 document = (xmlDocPtr)arg;
-	struct evbuffer	*output;
+	struct upnp_description	*description = arg;
+	struct evbuffer		*output;
 
 	if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
 		evhttp_add_header(evhttp_request_get_output_headers(req),
@@ -1626,7 +663,9 @@ upnp_describe(struct evhttp_request *req, void *arg)
 	if ((output = evbuffer_new()) == NULL)
 		return;
 
-	upnp_add_xml(output, document);
+	/* The bytes outlive every request, so nothing is copied */
+	evbuffer_add_reference(output, description->xml, description->len,
+	    NULL, NULL);
 
 	/* Add Content-Language header if Accept-Language is present */
 
@@ -1698,98 +737,929 @@ upnp_soap_error(struct evhttp_request *req, enum upnp_errors error)
 	evbuffer_free(output);
 }
 
-/* UPnP control (SOAP) */
+/* Generate and return a successful UPnP SOAP response, out holds a value
+ * for each output argument of the action
+ */
 void
-upnp_control(struct evhttp_request *req, void *arg)
+upnp_soap_response(struct upnp_request *ur, char **out)
 {
-	const char			*header;
-	char				*copy, *p, *service, *action;
-	struct urn			*urn;
-	struct upnp_nss			*nss;
-	unsigned int			 i, j;
-	xmlDocPtr			 document;
-	xmlNodePtr			 root, body, request, argument;
-	xmlChar				*encoding;
-	xmlNsPtr			 ns;
-	const struct upnp_action	*a;
-
+	xmlDocPtr	 document;
+	xmlNodePtr	 node;
+	xmlNsPtr	 ns;
+	size_t		 len;
+	char		*str;
+	unsigned int	 i;
+	struct evbuffer	*output;
 
-	if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
-		evhttp_add_header(evhttp_request_get_output_headers(req),
-		    "Allow", "POST");
-		evhttp_send_reply(req, HTTP_BADMETHOD, "Bad Method", NULL);
-		return;
-	}
+	document = xmlNewDoc("1.0");
+	node = xmlNewNode(NULL, "Envelope");
+	xmlDocSetRootElement(document, node);
 
-	/* Content-Type should be present and set to "text/xml" */
-	if ((header = evhttp_find_header(evhttp_request_get_input_headers(req),
-	    "content-type")) == NULL ||
-	    strcmp(header, "text/xml; charset=\"utf-8\"")) {
-		evhttp_send_reply(req, 415, "Unsupported Media Type", NULL);
-		return;
-	}
+	ns = xmlNewNs(node, SOAP_ENVELOPE_URI, SOAP_NAMESPACE_PREFIX);
+	xmlSetNs(node, ns);
+	xmlNewNsProp(node, ns, "encodingStyle", SOAP_ENCODING_URI);
 
-	if ((header = evhttp_find_header(evhttp_request_get_input_headers(req),
-	    "soapaction")) == NULL)
-		goto bad;
+	node = xmlNewChild(node, NULL, "Body", NULL);
 
-	if ((copy = strdup(header)) == NULL)
-		fatal("strdup");
+	len = snprintf(NULL, 0, "%sResponse", ur->action->name);
+	if ((str = calloc(len + 1, sizeof(char))) == NULL)
+		fatal("calloc");
+	snprintf(str, len + 1, "%sResponse", ur->action->name);
 
-	p = copy;
+	node = xmlNewChild(node, NULL, str, NULL);
+	ns = xmlNewNs(node, ur->urn, UPNP_NAMESPACE_PREFIX);
+	xmlSetNs(node, ns);
 
-	if (*p != '"' || strlen(++p) == 0) {
-		free(copy);
-		goto bad;
-	}
+	free(str);
 
-	service = p;
+	/* Output arguments are unqualified */
+	for (i = 0; i < ur->action->cout; i++)
+		xmlSetNs(xmlNewTextChild(node, NULL, ur->action->out[i].name,
+		    out[i]), NULL);
 
-	if ((p = strchr(p, '#')) == NULL) {
-		free(copy);
-		goto bad;
+	if ((output = evbuffer_new()) == NULL) {
+		xmlFreeDoc(document);
+		return;
 	}
 
-	/* service is now NULL-terminated */
-	*p = '\0';
+	upnp_add_xml(output, document);
+	xmlFreeDoc(document);
 
-	action = ++p;
+	upnp_content_length_header(ur->req, output);
+	upnp_content_type_header(ur->req);
+	upnp_date_header(ur->req);
 
-	if (strlen(service) == 0 || (p = strchr(p, '"')) == NULL ||
-	    strlen(p) != 1) {
-		free(copy);
-		goto bad;
-	}
+	evhttp_send_reply(ur->req, HTTP_OK, "OK", output);
+	evbuffer_free(output);
+}
 
-	/* action is now NULL-terminated */
-	*p = '\0';
+/* Add a string to an evbuffer with the XML special characters escaped,
+ * depth is how many times the string is nested as text within XML
+ */
+void
+upnp_escape(struct evbuffer *buffer, const char *str, int depth)
+{
+	const char	*entity;
+	size_t		 len;
+	int		 i;
 
-	if (strlen(action) == 0 || (urn = urn_from_string(service)) == NULL) {
-		free(copy);
-		goto bad;
-	}
+	while (*str) {
+		/* Copy any run of plain characters in one go */
+		len = strcspn(str, "<>&\"");
+		evbuffer_add(buffer, str, len);
+		str += len;
 
-	if ((nss = upnp_nss_from_string(urn->nss)) == NULL) {
-		urn_free(urn);
-		free(copy);
-		goto bad;
-	}
+		switch (*str) {
+		case '<':
+			entity = "lt;";
+			break;
+		case '>':
+			entity = "gt;";
+			break;
+		case '&':
+			entity = "amp;";
+			break;
+		case '"':
+			entity = "quot;";
+			break;
+		default:
+			/* End of string */
+			continue;
+		}
 
-	/* At this point we have the service URN and intended action */
-	if ((document = xmlReadMemory(evbuffer_pullup(evhttp_request_get_input_buffer(req), -1),
-	    evbuffer_get_length(evhttp_request_get_input_buffer(req)), NULL, NULL, 0)) == NULL) {
-		upnp_nss_free(nss);
-		urn_free(urn);
-		free(copy);
-		goto bad;
+		evbuffer_add(buffer, "&", 1);
+		for (i = 1; i < depth; i++)
+			evbuffer_add(buffer, "amp;", 4);
+		evbuffer_add(buffer, entity, strlen(entity));
+		str++;
 	}
+}
 
-	xmlSaveFormatFileEnc("-", document, NULL, XML_INDENT_TREE);
+/* Find the IPv4 address of the control point making the request */
+void
+upnp_peer(struct evhttp_request *req, struct in_addr *peer)
+{
+	const struct sockaddr	*sa;
+	const struct in6_addr	*in6;
 
-	root = xmlDocGetRootElement(document);
+	peer->s_addr = INADDR_NONE;
 
-	for (ns = root->nsDef; ns; ns = ns->next)
-		if (!strcmp(ns->href, SOAP_ENVELOPE_URI))
+	if ((sa = evhttp_connection_get_addr(
+	    evhttp_request_get_connection(req))) == NULL)
+		return;
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		*peer = ((const struct sockaddr_in *)sa)->sin_addr;
+		break;
+	case AF_INET6:
+		in6 = &((const struct sockaddr_in6 *)sa)->sin6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(in6))
+			memcpy(peer, &in6->s6_addr[12],
+			    sizeof(struct in_addr));
+		break;
+	default:
+		break;
+	}
+}
+
+/* Parse a ui2 argument */
+int
+upnp_parse_ui2(const char *str, u_int16_t *value)
+{
+	const char	*errstr;
+
+	*value = strtonum(str, 0, USHRT_MAX, &errstr);
+	if (errstr)
+		return (-1);
+
+	return (0);
+}
+
+/* Parse a ui4 argument */
+int
+upnp_parse_ui4(const char *str, u_int32_t *value)
+{
+	const char	*errstr;
+
+	*value = strtonum(str, 0, UINT_MAX, &errstr);
+	if (errstr)
+		return (-1);
+
+	return (0);
+}
+
+/* Parse a boolean argument */
+int
+upnp_parse_boolean(const char *str, u_int8_t *value)
+{
+	if (!strcmp(str, "1") || !strcasecmp(str, "true") ||
+	    !strcasecmp(str, "yes"))
+		*value = 1;
+	else if (!strcmp(str, "0") || !strcasecmp(str, "false") ||
+	    !strcasecmp(str, "no"))
+		*value = 0;
+	else
+		return (-1);
+
+	return (0);
+}
+
+/* Parse a PortMappingProtocol argument */
+int
+upnp_parse_protocol(const char *str, enum mapping_protocols *protocol)
+{
+	int	 i;
+
+	for (i = 0; i < MAPPING_PROTOCOL_MAX; i++)
+		if (!strcmp(str, mapping_protocol[i]))
+			break;
+
+	if (i == MAPPING_PROTOCOL_MAX)
+		return (-1);
+
+	*protocol = i;
+
+	return (0);
+}
+
+/* Parse an IPv4 address argument, the empty string is the wildcard */
+int
+upnp_parse_address(const char *str, struct in_addr *addr)
+{
+	if (*str == '\0') {
+		addr->s_addr = INADDR_ANY;
+		return (0);
+	}
+
+	if (inet_pton(AF_INET, str, addr) != 1)
+		return (-1);
+
+	return (0);
+}
+
+/* Parse a GENA CALLBACK header, one or more URLs each in angle brackets.
+ * The first that is plain HTTP to the control point itself is used, as
+ * anywhere else would have NOTIFY requests sent on behalf of whoever
+ * asked. The path is allocated
+ */
+int
+upnp_parse_callback(const char *str, struct in_addr *peer,
+    struct in_addr *addr, u_int16_t *port, char **path)
+{
+	struct evhttp_uri	*uri;
+	const char		*end, *host, *p, *query;
+	char			*url;
+	int			 rv;
+
+	for (; (str = strchr(str, '<')) != NULL; str = end + 1) {
+		if ((end = strchr(++str, '>')) == NULL)
+			break;
+
+		if ((url = strndup(str, end - str)) == NULL)
+			fatal("strndup");
+		uri = evhttp_uri_parse(url);
+		free(url);
+		if (uri == NULL)
+			continue;
+
+		if ((p = evhttp_uri_get_scheme(uri)) == NULL ||
+		    strcasecmp(p, "http") ||
+		    (host = evhttp_uri_get_host(uri)) == NULL ||
+		    inet_pton(AF_INET, host, addr) != 1 ||
+		    addr->s_addr != peer->s_addr ||
+		    evhttp_uri_get_port(uri) == 0) {
+			evhttp_uri_free(uri);
+			continue;
+		}
+
+		*port = evhttp_uri_get_port(uri) == -1 ? 80 :
+		    evhttp_uri_get_port(uri);
+		if ((p = evhttp_uri_get_path(uri)) == NULL || *p == '\0')
+			p = "/";
+		if ((query = evhttp_uri_get_query(uri)) != NULL)
+			rv = asprintf(path, "%s?%s", p, query);
+		else
+			rv = asprintf(path, "%s", p);
+		evhttp_uri_free(uri);
+		if (rv == -1)
+			fatal("asprintf");
+
+		return (0);
+	}
+
+	return (-1);
+}
+
+/* AddPortMapping and AddAnyPortMapping, the latter picks another free
+ * external port if the requested one is taken
+ */
+void
+upnp_add_mapping(struct upnp_request *ur, int any)
+{
+	struct igdpcpd		*env = ur->env;
+	struct in_addr		 remote, client;
+	u_int16_t		 eport, iport;
+	enum mapping_protocols	 protocol;
+	u_int8_t		 enabled;
+	u_int32_t		 lease;
+	char			*description, str[6]; /* "65535" + '\0' */
+	char			*out[1] = { str };
+	struct mapping		*m;
+	struct upnp_deferred	*ud;
+
+	if (upnp_parse_address(ur->in[0], &remote) ||
+	    upnp_parse_ui2(ur->in[1], &eport) ||
+	    upnp_parse_protocol(ur->in[2], &protocol) ||
+	    upnp_parse_ui2(ur->in[3], &iport) ||
+	    upnp_parse_address(ur->in[4], &client) ||
+	    upnp_parse_boolean(ur->in[5], &enabled) ||
+	    upnp_parse_ui4(ur->in[7], &lease)) {
+		upnp_soap_error(ur->req, UPNP_ERROR_ARGUMENT_VALUE_INVALID);
+		return;
+	}
+
+	/* AddAnyPortMapping treats zero as "any port" */
+	if (eport == 0 && !any) {
+		upnp_soap_error(ur->req,
+		    UPNP_ERROR_WILD_CARD_NOT_PERMITTED_IN_EXT_PORT);
+		return;
+	}
+
+	if (iport == 0) {
+		upnp_soap_error(ur->req,
+		    UPNP_ERROR_WILD_CARD_NOT_PERMITTED_IN_INT_PORT);
+		return;
+	}
+
+	/* Control points may only create mappings for themselves */
+	if (client.s_addr != ur->peer.s_addr) {
+		upnp_soap_error(ur->req, UPNP_ERROR_ACTION_NOT_AUTHORIZED);
+		return;
+	}
+
+	/* Zero means the maximum lease for WANIPConnection:2 */
+	if (lease == 0 || lease > UPNP_MAXIMUM_LEASE)
+		lease = UPNP_MAXIMUM_LEASE;
+
+	if ((m = mapping_find(env, protocol, eport, &remote)) != NULL &&
+	    m->client.s_addr != client.s_addr) {
+		if (!any) {
+			upnp_soap_error(ur->req,
+			    UPNP_ERROR_CONFLICT_IN_MAPPING_ENTRY);
+			return;
+		}
+		m = NULL;
+		eport = mapping_allocate(env, protocol, eport);
+	} else if (m == NULL && !mapping_permitted(env, eport)) {
+		if (!any) {
+			upnp_soap_error(ur->req,
+			    UPNP_ERROR_ACTION_NOT_AUTHORIZED);
+			return;
+		}
+		eport = mapping_allocate(env, protocol, eport);
+	}
+
+	if (eport == 0) {
+		upnp_soap_error(ur->req, UPNP_ERROR_NO_PORT_MAPS_AVAILABLE);
+		return;
+	}
+
+	/* Updating an existing mapping doesn't count against the quotas */
+	if (m == NULL && mapping_admit(env, &client) == -1) {
+		upnp_soap_error(ur->req, UPNP_ERROR_NO_PORT_MAPS_AVAILABLE);
+		return;
+	}
+
+	if ((description = strdup(ur->in[6])) == NULL) {
+		upnp_soap_error(ur->req, UPNP_ERROR_OUT_OF_MEMORY);
+		return;
+	}
+
+	snprintf(str, sizeof(str), "%u", eport);
+
+	if (m != NULL) {
+		/* Same client, so update the existing mapping */
+		if (m->pcp != NULL && m->iport != iport)
+			pcp_unmap(m);
+		m->iport = iport;
+		m->enabled = enabled;
+		free(m->description);
+		m->description = description;
+		mapping_refresh(m, lease);
+
+		/* Upstream catches up in the background */
+		if (m->pcp != NULL)
+			pcp_refresh(m);
+		else if (pcp_enabled(env) && pcp_map(m, 1, 0, NULL, NULL) == -1)
+			log_warnx("cannot map %s port %u upstream",
+			    inet_ntoa(m->client), m->iport);
+
+		env->sc_mappings.updateid++;
+		upnp_mappings_changed(env);
+
+		upnp_soap_response(ur, out);
+		return;
+	}
+
+	if ((m = mapping_new(env)) == NULL) {
+		free(description);
+		upnp_soap_error(ur->req, UPNP_ERROR_OUT_OF_MEMORY);
+		return;
+	}
+
+	m->protocol = protocol;
+	m->eport = eport;
+	m->remote = remote;
+	m->iport = iport;
+	m->client = client;
+	m->enabled = enabled;
+	m->description = description;
+	m->lease = lease;
+
+	if (mapping_add(m) == -1) {
+		mapping_free(m);
+		upnp_soap_error(ur->req, UPNP_ERROR_ACTION_FAILED);
+		return;
+	}
+
+	/* Hold the port locally and reply once the PCP server has answered.
+	 * AddPortMapping needs exactly the requested port upstream too
+	 */
+	if (pcp_enabled(env)) {
+		if ((ud = upnp_defer(ur)) == NULL) {
+			mapping_delete(m);
+			upnp_soap_error(ur->req, UPNP_ERROR_OUT_OF_MEMORY);
+			return;
+		}
+		ud->any = any;
+
+		if (pcp_map(m, !any, UPNP_PCP_DURATION, upnp_add_mapping_done,
+		    ud) == -1) {
+			upnp_deferred_free(ud);
+			mapping_delete(m);
+			upnp_soap_error(ur->req, UPNP_ERROR_OUT_OF_MEMORY);
+		}
+		return;
+	}
+
+	upnp_soap_response(ur, out);
+}
+
+/* The PCP server has answered, or not, for a new mapping */
+void
+upnp_add_mapping_done(struct pcp_request *req, void *arg)
+{
+	struct upnp_deferred	*ud = (struct upnp_deferred *)arg;
+	struct mapping		*m = req->m;
+	enum upnp_errors	 error;
+	char			 str[6]; /* "65535" + '\0' */
+	char			*out[1] = { str };
+
+	if (m == NULL) {
+		/* Deleted while waiting */
+		error = UPNP_ERROR_ACTION_FAILED;
+	} else if (req->result != PCP_SUCCESS) {
+		error = upnp_pcp_error(req->result, ud->any);
+		mapping_delete(m);
+	} else if (req->eport != m->eport &&
+	    (!ud->any || mapping_move(m, req->eport) == -1)) {
+		/* Can't have the port the server picked */
+		error = UPNP_ERROR_CONFLICT_WITH_OTHER_MECHANISMS;
+		mapping_delete(m);
+	} else {
+		snprintf(str, sizeof(str), "%u", m->eport);
+		upnp_soap_response(&ud->ur, out);
+		upnp_deferred_free(ud);
+		return;
+	}
+
+	upnp_soap_error(ud->ur.req, error);
+	upnp_deferred_free(ud);
+}
+
+/* Map a PCP result code to the nearest UPnP error, RFC 6970 section 5.6 */
+enum upnp_errors
+upnp_pcp_error(int result, int any)
+{
+	switch (result) {
+	case PCP_NOT_AUTHORISED:
+		return (UPNP_ERROR_ACTION_NOT_AUTHORIZED);
+	case PCP_NO_RESOURCES:
+	case PCP_USER_EX_QUOTA:
+		return (UPNP_ERROR_NO_PORT_MAPS_AVAILABLE);
+	case PCP_CANNOT_PROVIDE_EXTERNAL:
+		return (any ? UPNP_ERROR_NO_PORT_MAPS_AVAILABLE :
+		    UPNP_ERROR_CONFLICT_IN_MAPPING_ENTRY);
+	default:
+		return (UPNP_ERROR_ACTION_FAILED);
+	}
+}
+
+/* Keep what is needed to reply later, as the arguments and the document
+ * they came from are freed as soon as the handler returns
+ */
+struct upnp_deferred *
+upnp_defer(struct upnp_request *ur)
+{
+	struct upnp_deferred	*ud;
+
+	if ((ud = calloc(1, sizeof(struct upnp_deferred))) == NULL)
+		return (NULL);
+
+	ud->ur = *ur;
+	memset(ud->ur.in, 0, sizeof(ud->ur.in));
+	if ((ud->ur.urn = strdup(ur->urn)) == NULL) {
+		free(ud);
+		return (NULL);
+	}
+
+	ud->evcon = evhttp_request_get_connection(ur->req);
+	evhttp_connection_set_closecb(ud->evcon, upnp_deferred_close, ud);
+
+	return (ud);
+}
+
+void
+upnp_deferred_close(struct evhttp_connection *evcon, void *arg)
+{
+	struct upnp_deferred	*ud = (struct upnp_deferred *)arg;
+
+	log_debug("control point went away before the reply");
+
+	/* The request is left without a connection, replying frees it */
+	ud->evcon = NULL;
+}
+
+void
+upnp_deferred_free(struct upnp_deferred *ud)
+{
+	if (ud->evcon != NULL)
+		evhttp_connection_set_closecb(ud->evcon, NULL, NULL);
+	free(ud->ur.urn);
+	free(ud);
+}
+
+/* AddPortMapping */
+void
+upnp_action_add_port_mapping(struct upnp_request *ur)
+{
+	upnp_add_mapping(ur, 0);
+}
+
+/* AddAnyPortMapping */
+void
+upnp_action_add_any_port_mapping(struct upnp_request *ur)
+{
+	upnp_add_mapping(ur, 1);
+}
+
+/* DeletePortMapping */
+void
+upnp_action_delete_port_mapping(struct upnp_request *ur)
+{
+	struct in_addr		 remote;
+	u_int16_t		 eport;
+	enum mapping_protocols	 protocol;
+	struct mapping		*m;
+
+	if (upnp_parse_address(ur->in[0], &remote) ||
+	    upnp_parse_ui2(ur->in[1], &eport) ||
+	    upnp_parse_protocol(ur->in[2], &protocol)) {
+		upnp_soap_error(ur->req, UPNP_ERROR_ARGUMENT_VALUE_INVALID);
+		return;
+	}
+
+	if ((m = mapping_find(ur->env, protocol, eport, &remote)) == NULL) {
+		upnp_soap_error(ur->req, UPNP_ERROR_NO_SUCH_ENTRY_IN_ARRAY);
+		return;
+	}
+
+	if (m->client.s_addr != ur->peer.s_addr) {
+		upnp_soap_error(ur->req, UPNP_ERROR_ACTION_NOT_AUTHORIZED);
+		return;
+	}
+
+	mapping_delete(m);
+
+	upnp_soap_response(ur, NULL);
+}
+
+/* Manage=1 reaches every client's mappings. That needs the control
+ * point to be authorized through DeviceProtection, which isn't
+ * implemented, so no control point is a manager and the action is
+ * refused rather than quietly restricted to its own mappings
+ */
+int
+upnp_manager(struct upnp_request *ur)
+{
+	return (0);
+}
+
+/* DeletePortMappingRange */
+void
+upnp_action_delete_port_mapping_range(struct upnp_request *ur)
+{
+	u_int16_t		 start, end;
+	enum mapping_protocols	 protocol;
+	u_int8_t		 manage;
+	struct in_addr		 remote;
+	struct mapping		*m, *next;
+	unsigned int		 count = 0;
+
+	if (upnp_parse_ui2(ur->in[0], &start) ||
+	    upnp_parse_ui2(ur->in[1], &end) ||
+	    upnp_parse_protocol(ur->in[2], &protocol) ||
+	    upnp_parse_boolean(ur->in[3], &manage)) {
+		upnp_soap_error(ur->req, UPNP_ERROR_ARGUMENT_VALUE_INVALID);
+		return;
+	}
+
+	if (start > end) {
+		upnp_soap_error(ur->req, UPNP_ERROR_INCONSISTENT_PARAMETERS);
+		return;
+	}
+
+	if (manage && !upnp_manager(ur)) {
+		upnp_soap_error(ur->req, UPNP_ERROR_ACTION_NOT_AUTHORIZED);
+		return;
+	}
+
+	remote.s_addr = INADDR_ANY;
+
+	/* Without Manage, only walk the control point's own mappings */
+	for (m = mapping_range(ur->env, protocol, manage ? NULL : &ur->peer,
+	    start, &remote); m && m->eport <= end; m = next) {
+		next = mapping_range_next(m, !manage);
+		mapping_delete(m);
+		count++;
+	}
+
+	if (count == 0) {
+		upnp_soap_error(ur->req, UPNP_ERROR_PORT_MAPPING_NOT_FOUND);
+		return;
+	}
+
+	upnp_soap_response(ur, NULL);
+}
+
+/* GetExternalIPAddress, answered from the cached copy so polling never
+ * goes upstream. The empty string means it isn't known yet
+ */
+void
+upnp_action_get_external_ip_address(struct upnp_request *ur)
+{
+	char	*out[1] = { ur->env->sc_external.str };
+
+	upnp_soap_response(ur, out);
+}
+
+/* GetListOfPortMappings, the PortListing is streamed straight from the
+ * mapping table in chunks so memory use doesn't depend on the table size
+ */
+void
+upnp_action_get_list_of_port_mappings(struct upnp_request *ur)
+{
+	struct upnp_listing	*ul;
+	u_int16_t		 start, end, number;
+	enum mapping_protocols	 protocol;
+	u_int8_t		 manage;
+
+	if (upnp_parse_ui2(ur->in[0], &start) ||
+	    upnp_parse_ui2(ur->in[1], &end) ||
+	    upnp_parse_protocol(ur->in[2], &protocol) ||
+	    upnp_parse_boolean(ur->in[3], &manage) ||
+	    upnp_parse_ui2(ur->in[4], &number)) {
+		upnp_soap_error(ur->req, UPNP_ERROR_ARGUMENT_VALUE_INVALID);
+		return;
+	}
+
+	if (start > end) {
+		upnp_soap_error(ur->req, UPNP_ERROR_INCONSISTENT_PARAMETERS);
+		return;
+	}
+
+	if (manage && !upnp_manager(ur)) {
+		upnp_soap_error(ur->req, UPNP_ERROR_ACTION_NOT_AUTHORIZED);
+		return;
+	}
+
+	if ((ul = calloc(1, sizeof(struct upnp_listing))) == NULL) {
+		upnp_soap_error(ur->req, UPNP_ERROR_OUT_OF_MEMORY);
+		return;
+	}
+
+	ul->env = ur->env;
+	ul->req = ur->req;
+	ul->evcon = evhttp_request_get_connection(ur->req);
+	ul->action = ur->action;
+	ul->protocol = protocol;
+	ul->eport = start;
+	ul->remote.s_addr = INADDR_ANY;
+	ul->end = end;
+	ul->manage = manage;
+	ul->client = ur->peer;
+	ul->left = number ? number : UINT_MAX;
+
+	if (upnp_listing_next(ul) == NULL) {
+		free(ul);
+		upnp_soap_error(ur->req, UPNP_ERROR_PORT_MAPPING_NOT_FOUND);
+		return;
+	}
+
+	if ((ul->buffer = evbuffer_new()) == NULL) {
+		free(ul);
+		upnp_soap_error(ur->req, UPNP_ERROR_OUT_OF_MEMORY);
+		return;
+	}
+
+	/* No Content-Length, the response is chunked */
+	upnp_content_type_header(ur->req);
+	upnp_date_header(ur->req);
+
+	evhttp_send_reply_start(ur->req, HTTP_OK, "OK");
+
+	/* If the control point goes away mid-stream, clean up */
+	evhttp_connection_set_closecb(ul->evcon, upnp_listing_close, ul);
+
+	evbuffer_add_printf(ul->buffer, "<?xml version=\"1.0\"?>\n"
+	    "<%s:Envelope xmlns:%s=\"%s\" %s:encodingStyle=\"%s\">"
+	    "<%s:Body><%s:%sResponse xmlns:%s=\"",
+	    SOAP_NAMESPACE_PREFIX, SOAP_NAMESPACE_PREFIX, SOAP_ENVELOPE_URI,
+	    SOAP_NAMESPACE_PREFIX, SOAP_ENCODING_URI, SOAP_NAMESPACE_PREFIX,
+	    UPNP_NAMESPACE_PREFIX, ur->action->name, UPNP_NAMESPACE_PREFIX);
+	upnp_escape(ul->buffer, ur->urn, 1);
+	evbuffer_add_printf(ul->buffer, "\"><%s>",
+	    ur->action->out[0].name);
+
+	/* The PortListing is itself an XML document, so escape it */
+	evbuffer_add_printf(ul->buffer,
+	    "&lt;?xml version=\"1.0\" encoding=\"UTF-8\"?&gt;"
+	    "&lt;p:PortMappingList xmlns:p=\"%s\" xmlns:xsi=\"%s\" "
+	    "xsi:schemaLocation=\"%s %s\"&gt;", UPNP_PORT_LISTING_URN,
+	    XML_SCHEMA_INSTANCE_URI, UPNP_PORT_LISTING_URN,
+	    UPNP_PORT_LISTING_XSD);
+
+	upnp_listing_send(ul);
+}
+
+/* Find the next mapping to list after the current resume point */
+struct mapping *
+upnp_listing_next(struct upnp_listing *ul)
+{
+	struct mapping	*m;
+
+	/* Without Manage, only walk the control point's own mappings */
+	for (m = mapping_range(ul->env, ul->protocol,
+	    ul->manage ? NULL : &ul->client, ul->eport, &ul->remote);
+	    m && m->eport <= ul->end; m = mapping_range_next(m, !ul->manage))
+		/* Skip the entry that was listed last */
+		if (!ul->resume || m->eport != ul->eport ||
+		    m->remote.s_addr != ul->remote.s_addr)
+			return (m);
+
+	return (NULL);
+}
+
+/* Add a PortListing element, the value is escaped twice as it is text
+ * within an XML document that is itself text within the SOAP response
+ */
+void
+upnp_listing_element(struct evbuffer *buffer, const char *element,
+    const char *value)
+{
+	evbuffer_add_printf(buffer, "&lt;p:%s&gt;", element);
+	upnp_escape(buffer, value, 2);
+	evbuffer_add_printf(buffer, "&lt;/p:%s&gt;", element);
+}
+
+/* Add a PortListing entry for a mapping */
+void
+upnp_listing_entry(struct evbuffer *buffer, struct mapping *m)
+{
+	char	 str[11]; /* "4294967295" + '\0' */
+
+	evbuffer_add_printf(buffer, "&lt;p:PortMappingEntry&gt;");
+
+	upnp_listing_element(buffer, "NewRemoteHost",
+	    m->remote.s_addr == INADDR_ANY ? "" : inet_ntoa(m->remote));
+	snprintf(str, sizeof(str), "%u", m->eport);
+	upnp_listing_element(buffer, "NewExternalPort", str);
+	upnp_listing_element(buffer, "NewProtocol",
+	    mapping_protocol[m->protocol]);
+	snprintf(str, sizeof(str), "%u", m->iport);
+	upnp_listing_element(buffer, "NewInternalPort", str);
+	upnp_listing_element(buffer, "NewInternalClient",
+	    inet_ntoa(m->client));
+	upnp_listing_element(buffer, "NewEnabled", m->enabled ? "1" : "0");
+	upnp_listing_element(buffer, "NewDescription", m->description);
+	snprintf(str, sizeof(str), "%u", mapping_remaining(m));
+	upnp_listing_element(buffer, "NewLeaseTime", str);
+
+	evbuffer_add_printf(buffer, "&lt;/p:PortMappingEntry&gt;");
+}
+
+/* Send the next chunk of the PortListing, or the remainder of it */
+void
+upnp_listing_send(struct upnp_listing *ul)
+{
+	struct mapping	*m;
+	unsigned int	 i;
+
+	for (i = 0; i < UPNP_LISTING_CHUNK && ul->left; i++, ul->left--) {
+		if ((m = upnp_listing_next(ul)) == NULL)
+			break;
+
+		upnp_listing_entry(ul->buffer, m);
+
+		/* Remember where to carry on from, not the mapping itself as
+		 * that might go away before the next chunk
+		 */
+		ul->eport = m->eport;
+		ul->remote = m->remote;
+		ul->resume = 1;
+	}
+
+	if (i == UPNP_LISTING_CHUNK && ul->left) {
+		/* Wait for this chunk to be written before the next */
+		evhttp_send_reply_chunk_with_cb(ul->req, ul->buffer,
+		    upnp_listing_cb, ul);
+		return;
+	}
+
+	evbuffer_add_printf(ul->buffer, "&lt;/p:PortMappingList&gt;"
+	    "</%s></%s:%sResponse></%s:Body></%s:Envelope>\n",
+	    ul->action->out[0].name, UPNP_NAMESPACE_PREFIX, ul->action->name,
+	    SOAP_NAMESPACE_PREFIX, SOAP_NAMESPACE_PREFIX);
+
+	evhttp_send_reply_chunk(ul->req, ul->buffer);
+
+	evhttp_connection_set_closecb(ul->evcon, NULL, NULL);
+	evhttp_send_reply_end(ul->req);
+
+	upnp_listing_free(ul);
+}
+
+void
+upnp_listing_cb(struct evhttp_connection *evcon, void *arg)
+{
+	upnp_listing_send((struct upnp_listing *)arg);
+}
+
+void
+upnp_listing_close(struct evhttp_connection *evcon, void *arg)
+{
+	struct upnp_listing	*ul = (struct upnp_listing *)arg;
+
+	log_debug("control point went away during PortListing");
+
+	/* The request is left without a connection, ending it frees it */
+	evhttp_send_reply_end(ul->req);
+	upnp_listing_free(ul);
+}
+
+void
+upnp_listing_free(struct upnp_listing *ul)
+{
+	evbuffer_free(ul->buffer);
+	free(ul);
+}
+
+/* UPnP control (SOAP) */
+void
+upnp_control(struct evhttp_request *req, void *arg)
+{
+	struct igdpcpd			*env = (struct igdpcpd *)arg;
+	const char			*header;
+	char				*copy, *p, *service, *action;
+	struct urn_view			 urn;
+	struct upnp_nss_view		 nss;
+	struct ssdp_service		*s;
+	const char			*str;
+	char				 decoded[URN_VIEW_MAX];
+	size_t				 len;
+	unsigned int			 i;
+	int				 n;
+	xmlDocPtr			 document;
+	xmlNodePtr			 root, body, request, argument;
+	xmlChar				*encoding;
+	xmlNsPtr			 ns;
+	const struct upnp_action	*a;
+	enum upnp_actions		 type;
+	struct upnp_request		 ur;
+
+	if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    "Allow", "POST");
+		evhttp_send_reply(req, HTTP_BADMETHOD, "Bad Method", NULL);
+		return;
+	}
+
+	/* Content-Type should be present and set to "text/xml" */
+	if ((header = evhttp_find_header(evhttp_request_get_input_headers(req),
+	    "content-type")) == NULL ||
+	    strcmp(header, "text/xml; charset=\"utf-8\"")) {
+		evhttp_send_reply(req, 415, "Unsupported Media Type", NULL);
+		return;
+	}
+
+	if ((header = evhttp_find_header(evhttp_request_get_input_headers(req),
+	    "soapaction")) == NULL)
+		goto bad;
+
+	if ((copy = strdup(header)) == NULL)
+		fatal("strdup");
+
+	p = copy;
+
+	if (*p != '"' || strlen(++p) == 0) {
+		free(copy);
+		goto bad;
+	}
+
+	service = p;
+
+	if ((p = strchr(p, '#')) == NULL) {
+		free(copy);
+		goto bad;
+	}
+
+	/* service is now NULL-terminated */
+	*p = '\0';
+
+	action = ++p;
+
+	if (strlen(service) == 0 || (p = strchr(p, '"')) == NULL ||
+	    strlen(p) != 1) {
+		free(copy);
+		goto bad;
+	}
+
+	/* action is now NULL-terminated */
+	*p = '\0';
+
+	if (strlen(action) == 0 ||
+	    urn_view_from_string(service, strlen(service), &urn) == -1 ||
+	    (str = urn_view_nss(&urn, decoded, sizeof(decoded),
+	    &len)) == NULL ||
+	    upnp_nss_view_from_string(str, len, &nss) == -1) {
+		free(copy);
+		goto bad;
+	}
+
+	/* At this point we have the service URN and intended action */
+	if ((document = xmlReadMemory(evbuffer_pullup(evhttp_request_get_input_buffer(req), -1),
+	    evbuffer_get_length(evhttp_request_get_input_buffer(req)), NULL, NULL, 0)) == NULL) {
+		free(copy);
+		goto bad;
+	}
+
+	xmlSaveFormatFileEnc("-", document, NULL, XML_INDENT_TREE);
+
+	root = xmlDocGetRootElement(document);
+
+	for (ns = root->nsDef; ns; ns = ns->next)
+		if (!strcmp(ns->href, SOAP_ENVELOPE_URI))
 			break;
 	encoding = xmlGetNsProp(root, "encodingStyle", SOAP_ENVELOPE_URI);
 	for (body = root->children; body; body = body->next)
@@ -1804,8 +1674,6 @@ upnp_control(struct evhttp_request *req, void *arg)
 		log_warnx("malformed envelope");
 		xmlFreeDoc(document);
 		xmlFree(encoding);
-		upnp_nss_free(nss);
-		urn_free(urn);
 		free(copy);
 		goto bad;
 	}
@@ -1825,42 +1693,35 @@ upnp_control(struct evhttp_request *req, void *arg)
 	    request->ns != ns) {
 		log_warnx("malformed request");
 		xmlFreeDoc(document);
-		upnp_nss_free(nss);
-		urn_free(urn);
 		free(copy);
 		goto bad;
 	}
 
-	for (i = 0; i < nitems(upnp_service); i++)
-		if (!strcmp(urn->nid, upnp_service[i].nid) &&
-		    nss->type == upnp_service[i].nss.type &&
-		    !strcmp(nss->name, upnp_service[i].nss.name) &&
-		    nss->version <= upnp_service[i].nss.version)
+	/* The service and then the action come from the perfect hashes that
+	 * upnpgen made, the version asked for has to have the action
+	 */
+	n = nss.type == UPNP_TYPE_SERVICE ? upnp_type_find(&nss) : -1;
+	for (s = TAILQ_FIRST(&env->sc_root->services); s;
+	    s = TAILQ_NEXT(s, entry))
+		if (s->service == n && urn.atom == s->urn->atom &&
+		    nss.version <= s->nss->version)
 			break;
 
-	if (i != nitems(upnp_service))
-		for (j = 0; upnp_service[i].actions[j] != UPNP_ACTION_EOL;
-		    j++) {
-			a = &upnp_action[upnp_service[i].actions[j]];
-
-			if (!strcmp(action, a->name) &&
-			    nss->version >= a->version)
-				break;
-		}
-
+	type = s == NULL ? UPNP_ACTION_EOL :
+	    upnp_lookup(&upnp_action_hash[s->service], action, strlen(action));
 
 	/* Can't find the service or action */
-	if (i == nitems(upnp_service) ||
-	    upnp_service[i].actions[j] == UPNP_ACTION_EOL) {
+	if (type == UPNP_ACTION_EOL ||
+	    nss.version < (a = &upnp_action[type])->version) {
 		log_warnx("invalid action");
 		upnp_soap_error(req, UPNP_ERROR_INVALID_ACTION);
 		xmlFreeDoc(document);
-		upnp_nss_free(nss);
-		urn_free(urn);
 		free(copy);
 		return;
 	}
 
+	memset(&ur, 0, sizeof(ur));
+
 	/* First argument in action definition */
 	i = 0;
 
@@ -1876,11 +1737,16 @@ upnp_control(struct evhttp_request *req, void *arg)
 		if (strcmp(argument->name, a->in[i].name))
 			break;
 
-		/* Check there is a sole text child node under the argument */
-		if (argument->children == NULL ||
-		    argument->children->type != XML_TEXT_NODE ||
+		/* Check there is a sole text child node under the argument,
+		 * an empty element is an empty string
+		 */
+		if (argument->children == NULL)
+			ur.in[i] = "";
+		else if (argument->children->type != XML_TEXT_NODE ||
 		    argument->children->next != NULL)
 			break;
+		else
+			ur.in[i] = argument->children->content;
 
 		/* Find next element node */
 		for (argument = argument->next; argument;
@@ -1897,29 +1763,26 @@ upnp_control(struct evhttp_request *req, void *arg)
 		log_warnx("invalid arguments");
 		upnp_soap_error(req, UPNP_ERROR_INVALID_ARGS);
 		xmlFreeDoc(document);
-		upnp_nss_free(nss);
-		urn_free(urn);
 		free(copy);
 		return;
 	}
 
-	log_debug("found it!");
+	if (upnp_handler[type] == NULL) {
+		log_warnx("action %s not implemented", a->name);
+		upnp_soap_error(req, UPNP_ERROR_OPTIONAL_ACTION_NOT_IMPLEMENTED);
+	} else {
+		ur.env = env;
+		ur.req = req;
+		ur.action = a;
+		ur.urn = service;
+		upnp_peer(req, &ur.peer);
+
+		/* Handler is responsible for sending the reply */
+		upnp_handler[type](&ur);
+	}
 
 	xmlFreeDoc(document);
 
-#if 0
-	document = xmlNewDoc("1.0");
-	envelope = xmlNewNode(NULL, "Envelope");
-	xmlDocSetRootElement(document, envelope);
-
-	ns = xmlNewNs(envelope, SOAP_ENVELOPE_URI, SOAP_NAMESPACE_PREFIX);
-	xmlSetNs(envelope, ns);
-	xmlNewProp(envelope, "encodingStyle", SOAP_ENCODING_URI);
-	xmlNewChild(envelope, NULL, "Body", NULL);
-#endif
-
-	upnp_nss_free(nss);
-	urn_free(urn);
 	free(copy);
 
 	return;
@@ -1928,20 +1791,254 @@ bad:
 	evhttp_send_reply(req, HTTP_BADREQUEST, "Bad Request", NULL);
 }
 
+/* GENA, UDA 1.1 section 4.1. SUBSCRIBE and UNSUBSCRIBE look the same to
+ * libevent, which doesn't keep the method, so they are told apart by their
+ * headers: a cancellation only ever has the SID, a renewal in practice
+ * also has a TIMEOUT. A renewal without one is taken as a cancellation,
+ * and the control point gets 412 when it next renews and subscribes again
+ */
 void
 upnp_event(struct evhttp_request *req, void *arg)
 {
-	struct evkeyval	*header;
+	struct igdpcpd		*env = (struct igdpcpd *)arg;
+	struct evkeyvalq	*headers = evhttp_request_get_input_headers(req);
+	const char		*path;
+	int			 i;
 
-	log_debug("%d %s", evhttp_request_get_command(req),
-	    evhttp_request_get_uri(req));
+	if (evhttp_request_get_command(req) != GENA_REQ_UNKNOWN) {
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    "Allow", "SUBSCRIBE, UNSUBSCRIBE");
+		evhttp_send_reply(req, HTTP_BADMETHOD, "Bad Method", NULL);
+		return;
+	}
 
-	for (header = TAILQ_FIRST(evhttp_request_get_input_headers(req));
-	    header; header = TAILQ_NEXT(header, next))
-		log_debug("%s: %s", header->key, header->value);
-		
-	log_debug("%.*s", evbuffer_get_length(evhttp_request_get_input_buffer(req)), evbuffer_pullup(evhttp_request_get_input_buffer(req), -1));
-	evhttp_send_reply(req, HTTP_INTERNAL, "Internal Server Error", NULL);
+	path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+	for (i = 0; i < UPNP_SERVICE_MAX; i++)
+		if (path != NULL && !strcmp(path, upnp_service[i].event))
+			break;
+
+	if (i == UPNP_SERVICE_MAX) {
+		evhttp_send_reply(req, HTTP_NOTFOUND, "Not Found", NULL);
+		return;
+	}
+
+	if (evhttp_find_header(headers, "CALLBACK") != NULL ||
+	    evhttp_find_header(headers, "NT") != NULL ||
+	    evhttp_find_header(headers, "TIMEOUT") != NULL)
+		upnp_subscribe(req, env, i);
+	else
+		upnp_unsubscribe(req, env, i);
+}
+
+/* A new subscription, or renewing one */
+void
+upnp_subscribe(struct evhttp_request *req, struct igdpcpd *env,
+    enum upnp_services type)
+{
+	struct evkeyvalq		*headers;
+	struct gena_subscription	*gs;
+	struct evbuffer			*body;
+	struct in_addr			 peer, addr;
+	const char			*callback, *nt, *str;
+	u_int8_t			 sid[GENA_SID_LENGTH];
+	u_int16_t			 port;
+	u_int32_t			 timeout;
+	char				*path, buf[GENA_SID_STRLEN];
+
+	headers = evhttp_request_get_input_headers(req);
+	callback = evhttp_find_header(headers, "CALLBACK");
+	nt = evhttp_find_header(headers, "NT");
+	timeout = gena_timeout(evhttp_find_header(headers, "TIMEOUT"));
+
+	if ((str = evhttp_find_header(headers, "SID")) != NULL) {
+		if (callback != NULL || nt != NULL) {
+			evhttp_send_reply(req, HTTP_BADREQUEST,
+			    "Incompatible Header Fields", NULL);
+			return;
+		}
+
+		if (gena_sid_from_string(str, sid) ||
+		    (gs = gena_find(env, sid)) == NULL ||
+		    gs->service != type) {
+			evhttp_send_reply(req, HTTP_PRECONDITION_FAILED,
+			    "Precondition Failed", NULL);
+			return;
+		}
+
+		gena_renew(env, gs, timeout);
+	} else {
+		upnp_peer(req, &peer);
+
+		if (callback == NULL || nt == NULL ||
+		    strcmp(nt, "upnp:event") ||
+		    upnp_parse_callback(callback, &peer, &addr, &port,
+		    &path)) {
+			evhttp_send_reply(req, HTTP_PRECONDITION_FAILED,
+			    "Precondition Failed", NULL);
+			return;
+		}
+
+		gs = gena_subscribe(env, type, &addr, port, path, timeout);
+		free(path);
+		if (gs == NULL) {
+			log_warnx("too many subscriptions");
+			evhttp_send_reply(req, HTTP_SERVUNAVAIL,
+			    "Service Unavailable", NULL);
+			return;
+		}
+	}
+
+	gena_sid_to_string(gs->sid, buf);
+	evhttp_add_header(evhttp_request_get_output_headers(req), "SID", buf);
+	snprintf(buf, sizeof(buf), "Second-%u", timeout);
+	evhttp_add_header(evhttp_request_get_output_headers(req), "TIMEOUT",
+	    buf);
+	upnp_date_header(req);
+	upnp_server_header(req);
+
+	evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+
+	/* A new subscriber is sent every evented variable */
+	if (gs->seq == 0) {
+		body = upnp_propertyset(env, type, UPNP_VARIABLES_ALL);
+		gena_send(env, gs, body, UPNP_VARIABLES_ALL);
+		evbuffer_free(body);
+	}
+}
+
+void
+upnp_unsubscribe(struct evhttp_request *req, struct igdpcpd *env,
+    enum upnp_services type)
+{
+	struct gena_subscription	*gs;
+	const char			*str;
+	u_int8_t			 sid[GENA_SID_LENGTH];
+
+	if ((str = evhttp_find_header(evhttp_request_get_input_headers(req),
+	    "SID")) == NULL || gena_sid_from_string(str, sid) ||
+	    (gs = gena_find(env, sid)) == NULL || gs->service != type) {
+		evhttp_send_reply(req, HTTP_PRECONDITION_FAILED,
+		    "Precondition Failed", NULL);
+		return;
+	}
+
+	log_debug("subscription %s cancelled", str);
+	gena_cancel(env, gs);
+
+	evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+}
+
+/* The current value of an evented variable */
+const char *
+upnp_variable_value(struct igdpcpd *env, enum upnp_variables variable,
+    char *buf, size_t len)
+{
+	switch (variable) {
+	case UPNP_VARIABLE_PHYSICAL_LINK_STATUS:
+		return ("Up");
+	case UPNP_VARIABLE_POSSIBLE_CONNECTION_TYPES:
+		return ("IP_Routed");
+	case UPNP_VARIABLE_CONNECTION_STATUS:
+		return ("Connected");
+	case UPNP_VARIABLE_EXTERNAL_IP_ADDRESS:
+		return (env->sc_external.str);
+	case UPNP_VARIABLE_PORT_MAPPING_NUMBER_OF_ENTRIES:
+		snprintf(buf, len, "%u", env->sc_mappings.count);
+		return (buf);
+	case UPNP_VARIABLE_SYSTEM_UPDATE_ID:
+		snprintf(buf, len, "%u", env->sc_mappings.updateid);
+		return (buf);
+	default:
+		return ("");
+	}
+}
+
+/* Render a propertyset with the evented variables of the service that
+ * are in the mask, each variable is a bit
+ */
+struct evbuffer *
+upnp_propertyset(struct igdpcpd *env, enum upnp_services type,
+    u_int32_t mask)
+{
+	const struct upnp_variable	*v;
+	struct evbuffer			*body;
+	enum upnp_variables		*variable;
+	char				 buf[11]; /* "4294967295" + '\0' */
+
+	if ((body = evbuffer_new()) == NULL)
+		fatal("evbuffer_new");
+
+	evbuffer_add_printf(body, "<?xml version=\"1.0\"?>\n"
+	    "<e:propertyset xmlns:e=\"%s\">\n", UPNP_EVENT_SCHEMA_URN);
+
+	for (variable = upnp_service[type].variables;
+	    *variable != UPNP_VARIABLE_EOL; variable++) {
+		v = &upnp_variable[*variable];
+		if (!(v->flags & UPNP_VARIABLE_FLAG_EVENT) ||
+		    !(mask & (1 << *variable)))
+			continue;
+
+		evbuffer_add_printf(body, "<e:property><%s>", v->name);
+		upnp_escape(body, upnp_variable_value(env, *variable, buf,
+		    sizeof(buf)), 1);
+		evbuffer_add_printf(body, "</%s></e:property>\n", v->name);
+	}
+
+	evbuffer_add_printf(body, "</e:propertyset>\n");
+
+	return (body);
+}
+
+/* Variables marked for it are also multicast, once for all the control
+ * points listening, UDA 1.1 section 4.3
+ */
+void
+upnp_multicast(struct igdpcpd *env, enum upnp_services type,
+    u_int32_t mask)
+{
+#if UPNP_VERSION_NUMBER >= 0x0101
+	struct ssdp_service	*service;
+	struct evbuffer		*body;
+	enum upnp_variables	*variable;
+	u_int32_t		 multicast = 0;
+
+	for (variable = upnp_service[type].variables;
+	    *variable != UPNP_VARIABLE_EOL; variable++)
+		if (upnp_variable[*variable].flags &
+		    UPNP_VARIABLE_FLAG_MULTICAST)
+			multicast |= 1 << *variable;
+
+	if ((mask &= multicast) == 0)
+		return;
+
+	for (service = TAILQ_FIRST(&env->sc_root->services); service;
+	    service = TAILQ_NEXT(service, entry)) {
+		if (service->service != type)
+			continue;
+
+		body = upnp_propertyset(env, type, mask);
+		ssdp_event(env, service, upnp_service[type].id, body);
+		evbuffer_free(body);
+	}
+#endif
+}
+
+/* ExternalIPAddress has a new value */
+void
+upnp_external_changed(struct igdpcpd *env)
+{
+	ssdp_update(env);
+	gena_changed(env, UPNP_SERVICE_WAN_IP_CONNECTION,
+	    1 << UPNP_VARIABLE_EXTERNAL_IP_ADDRESS);
+}
+
+/* A port mapping has been added, deleted or changed */
+void
+upnp_mappings_changed(struct igdpcpd *env)
+{
+	gena_changed(env, UPNP_SERVICE_WAN_IP_CONNECTION,
+	    1 << UPNP_VARIABLE_PORT_MAPPING_NUMBER_OF_ENTRIES |
+	    1 << UPNP_VARIABLE_SYSTEM_UPDATE_ID);
 }
 
 void
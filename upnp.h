@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2014 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _UPNP_H
+#define _UPNP_H
+
+/* The device, service, action and variable tables are shared between the
+ * daemon and upnpgen, which turns them into the description templates and
+ * lookup tables in the generated upnpdesc.c
+ */
+
+#define	UPNP_NID		 "upnp-org"
+#define	UPNP_SCHEMA_NID		 "schemas-upnp-org"
+#define	UPNP_DEVICE_TYPE	 "device"
+#define	UPNP_SERVICE_TYPE	 "service"
+#define	UPNP_CONTROL_TYPE	 "control"
+#define	UPNP_EVENT_TYPE		 "event"
+
+/* Macro expansion fun */
+#define	UPNP_STRING(x)		 __STRING(x)
+
+#define	UPNP_URN(nid, nss)	("urn:" nid ":" nss)
+
+#define	UPNP_TYPE_URN(nid, type, name, version) \
+	(UPNP_URN(nid, type ":" name ":" UPNP_STRING(version)))
+#define	UPNP_SCHEMA_URN(nid, type, major, minor) \
+	(UPNP_URN(nid, type "-" UPNP_STRING(major) "-" UPNP_STRING(minor)))
+#define	UPNP_SERVICE_ID_URN(nid, type, instance) \
+	(UPNP_URN(nid, "serviceId:" type UPNP_STRING(instance)))
+
+#define	UPNP_DEVICE_SCHEMA_URN \
+	(UPNP_SCHEMA_URN(UPNP_SCHEMA_NID, UPNP_DEVICE_TYPE, 1, 0))
+#define	UPNP_SERVICE_SCHEMA_URN \
+	(UPNP_SCHEMA_URN(UPNP_SCHEMA_NID, UPNP_SERVICE_TYPE, 1, 0))
+#define	UPNP_CONTROL_SCHEMA_URN \
+	(UPNP_SCHEMA_URN(UPNP_SCHEMA_NID, UPNP_CONTROL_TYPE, 1, 0))
+#define	UPNP_EVENT_SCHEMA_URN \
+	(UPNP_SCHEMA_URN(UPNP_SCHEMA_NID, UPNP_EVENT_TYPE, 1, 0))
+
+#define	UPNP_VERSION_INTERNET_GATEWAY_DEVICE		 2
+#define	UPNP_VERSION_WAN_COMMON_INTERFACE_CONFIG	 1
+
+#if UPNP_VERSION_INTERNET_GATEWAY_DEVICE >= 2
+#define UPNP_VERSION_WAN_DEVICE				 2
+#define	UPNP_VERSION_WAN_CONNECTION_DEVICE		 2
+#define	UPNP_VERSION_WAN_IP_CONNECTION			 2
+#else
+#define	UPNP_VERSION_WAN_DEVICE				 1
+#define	UPNP_VERSION_WAN_CONNECTION_DEVICE		 1
+#define	UPNP_VERSION_WAN_IP_CONNECTION			 1
+#endif
+
+#define	XML_INDENT_TREE					 1
+
+enum upnp_variable_types {
+	UPNP_VARIABLE_TYPE_UI1 = 0,
+	UPNP_VARIABLE_TYPE_UI2,
+	UPNP_VARIABLE_TYPE_UI4,
+	UPNP_VARIABLE_TYPE_I1,
+	UPNP_VARIABLE_TYPE_I2,
+	UPNP_VARIABLE_TYPE_I4,
+	UPNP_VARIABLE_TYPE_INT,
+	UPNP_VARIABLE_TYPE_R4,
+	UPNP_VARIABLE_TYPE_R8,
+	UPNP_VARIABLE_TYPE_NUMBER,
+	UPNP_VARIABLE_TYPE_FIXED_14_4,
+	UPNP_VARIABLE_TYPE_FLOAT,
+	UPNP_VARIABLE_TYPE_CHAR,
+	UPNP_VARIABLE_TYPE_STRING,
+	UPNP_VARIABLE_TYPE_DATE,
+	UPNP_VARIABLE_TYPE_DATE_TIME,
+	UPNP_VARIABLE_TYPE_DATE_TIME_TZ,
+	UPNP_VARIABLE_TYPE_TIME,
+	UPNP_VARIABLE_TYPE_TIME_TZ,
+	UPNP_VARIABLE_TYPE_BOOLEAN,
+	UPNP_VARIABLE_TYPE_BIN_BASE64,
+	UPNP_VARIABLE_TYPE_BIN_HEX,
+	UPNP_VARIABLE_TYPE_URI,
+	UPNP_VARIABLE_TYPE_UUID,
+	UPNP_VARIABLE_TYPE_MAX,
+};
+
+enum upnp_variables {
+	UPNP_VARIABLE_EOL = -1,
+	/* WANCommonInterfaceConfig */
+	UPNP_VARIABLE_WAN_ACCESS_TYPE = 0,
+	UPNP_VARIABLE_LAYER_1_UPSTREAM_MAX_BIT_RATE,
+	UPNP_VARIABLE_LAYER_1_DOWNSTREAM_MAX_BIT_RATE,
+	UPNP_VARIABLE_PHYSICAL_LINK_STATUS,
+	/* WANIPConnection */
+	UPNP_VARIABLE_CONNECTION_TYPE,
+	UPNP_VARIABLE_POSSIBLE_CONNECTION_TYPES,
+	UPNP_VARIABLE_CONNECTION_STATUS,
+	UPNP_VARIABLE_UPTIME,
+	UPNP_VARIABLE_LAST_CONNECTION_ERROR,
+	UPNP_VARIABLE_RSIP_AVAILABLE,
+	UPNP_VARIABLE_NAT_ENABLED,
+	UPNP_VARIABLE_EXTERNAL_IP_ADDRESS,
+	UPNP_VARIABLE_PORT_MAPPING_NUMBER_OF_ENTRIES,
+	UPNP_VARIABLE_PORT_MAPPING_ENABLED,
+	UPNP_VARIABLE_PORT_MAPPING_LEASE_DURATION,
+	UPNP_VARIABLE_REMOTE_HOST,
+	UPNP_VARIABLE_EXTERNAL_PORT,
+	UPNP_VARIABLE_INTERNAL_PORT,
+	UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
+	UPNP_VARIABLE_INTERNAL_CLIENT,
+	UPNP_VARIABLE_PORT_MAPPING_DESCRIPTION,
+	UPNP_VARIABLE_SYSTEM_UPDATE_ID,
+	UPNP_VARIABLE_A_ARG_TYPE_MANAGE,
+	UPNP_VARIABLE_A_ARG_TYPE_PORT_LISTING,
+	UPNP_VARIABLE_MAX,
+};
+
+/* Masks of variables, one bit each, must fit in a u_int32_t */
+#define	UPNP_VARIABLES_ALL		0xffffffff
+
+#define	UPNP_VARIABLE_FLAG_EVENT	(1<<0)
+#define	UPNP_VARIABLE_FLAG_MULTICAST	(1<<1)
+
+struct upnp_variable {
+	char				 *name;
+	enum upnp_variable_types	  type;
+	unsigned int			  flags;
+	char				**values;
+	/* Probably shouldn't be char */
+	char				 *value;
+	char				 *minimum;
+	char				 *maximum;
+	char				 *step;
+};
+
+#define	UPNP_ARGUMENT_FLAG_RETURN	(1<<0)
+
+struct upnp_argument {
+	char				*name;
+	unsigned int			 flags;
+	enum upnp_variables		 related;
+};
+
+enum upnp_actions {
+	UPNP_ACTION_EOL = -1,
+	/* WANCommonInterfaceConfig */
+	UPNP_ACTION_GET_COMMON_LINK_PROPERTIES = 0,
+	/* WANIPConnection */
+	UPNP_ACTION_SET_CONNECTION_TYPE,
+	UPNP_ACTION_GET_CONNECTION_TYPE_INFO,
+	UPNP_ACTION_REQUEST_CONNECTION,
+	UPNP_ACTION_FORCE_TERMINATION,
+	UPNP_ACTION_GET_STATUS_INFO,
+	UPNP_ACTION_GET_NAT_RSIP_STATUS,
+	UPNP_ACTION_GET_GENERIC_PORT_MAPPING_ENTRY,
+	UPNP_ACTION_GET_SPECIFIC_PORT_MAPPING_ENTRY,
+	UPNP_ACTION_ADD_PORT_MAPPING,
+	UPNP_ACTION_ADD_ANY_PORT_MAPPING,
+	UPNP_ACTION_DELETE_PORT_MAPPING,
+	UPNP_ACTION_DELETE_PORT_MAPPING_RANGE,
+	UPNP_ACTION_GET_EXTERNAL_IP_ADDRESS,
+	UPNP_ACTION_GET_LIST_OF_PORT_MAPPINGS,
+	UPNP_ACTION_MAX,
+};
+
+struct upnp_action {
+	char			*name;
+	unsigned int		 version, cin, cout;
+	struct upnp_argument 	*in;
+	struct upnp_argument 	*out;
+};
+
+struct upnp_service {
+	char			*nid;
+	struct upnp_nss		 nss;
+	char			*id;
+	char			*scpd;
+	char			*control;
+	char			*event;
+	enum upnp_actions	*actions;
+	enum upnp_variables	*variables;
+};
+
+struct upnp_device {
+	char			*nid;
+	struct upnp_nss		 nss;
+	enum upnp_services	*services;
+	enum upnp_devices	*devices;
+};
+
+/* A description document is text with holes for the parts only known at
+ * startup, each template is a run of these ended by UPNP_FIELD_END
+ */
+enum upnp_fields {
+	UPNP_FIELD_END = 0,
+	UPNP_FIELD_TEXT,
+	UPNP_FIELD_CONFIGID,
+	UPNP_FIELD_UDN,
+};
+
+struct upnp_template {
+	enum upnp_fields	 field;
+	unsigned int		 device;	/* Which UDN, in tree order */
+	const char		*text;
+	size_t			 len;
+};
+
+/* A perfect hash, every key has a slot to itself so a lookup is one hash
+ * and one comparison. The seed is whatever upnpgen found first that
+ * doesn't collide
+ */
+struct upnp_slot {
+	const char		*key;
+	size_t			 len;
+	int			 value;
+};
+
+struct upnp_hash {
+	u_int32_t		 seed;
+	u_int32_t		 mask;
+	const struct upnp_slot	*slots;
+};
+
+/* upnptab.c */
+extern const char			*upnp_type[UPNP_TYPE_MAX];
+extern const char			*upnp_variable_type[UPNP_VARIABLE_TYPE_MAX];
+extern const struct upnp_variable	 upnp_variable[UPNP_VARIABLE_MAX];
+extern const struct upnp_action		 upnp_action[UPNP_ACTION_MAX];
+extern const struct upnp_service	 upnp_service[UPNP_SERVICE_MAX];
+extern const struct upnp_device		 upnp_device[UPNP_DEVICE_MAX];
+u_int32_t		 upnp_hash(u_int32_t, const char *, size_t);
+
+/* upnpdesc.c, generated */
+extern const struct upnp_template	*upnp_root_template[UPNP_DEVICE_MAX];
+extern const struct upnp_template	*upnp_scpd_template[UPNP_SERVICE_MAX];
+extern const struct upnp_hash		 upnp_type_hash[UPNP_TYPE_MAX];
+extern const struct upnp_hash		 upnp_action_hash[UPNP_SERVICE_MAX];
+extern const struct upnp_hash		 upnp_variable_hash[UPNP_SERVICE_MAX];
+
+#endif
@@ -0,0 +1,567 @@
+/*
+ * Copyright (c) 2014 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Run at build time to turn the tables in upnptab.c into C source for
+ * upnpdesc.c. Each description document is built with libxml2 once, here,
+ * and written out as a template with holes for the configId and the UDNs,
+ * which are only known at startup. Action, variable and device and service
+ * type names get a perfect hash each
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "igdpcpd.h"
+#include "upnp.h"
+
+/* Stand-ins for what startup fills in, cut back out of the serialized
+ * document. Nothing in the tables may use the mark
+ */
+#define	UPNPGEN_MARK		 '@'
+#define	UPNPGEN_CONFIGID	 "@CONFIGID@"
+#define	UPNPGEN_UDN		 "@UDN%u@"
+
+/* Enough keys for the biggest table */
+#define	UPNPGEN_KEYS \
+	MAX(MAX(UPNP_DEVICE_MAX, UPNP_SERVICE_MAX), \
+	MAX(UPNP_ACTION_MAX, UPNP_VARIABLE_MAX))
+
+/* Give up on a table size after this many seeds and try a bigger one */
+#define	UPNPGEN_SEEDS		 (1 << 20)
+
+void		 upnpgen_add_configid(xmlNodePtr);
+void		 upnpgen_add_version(xmlNodePtr);
+void		 upnpgen_add_action(xmlNodePtr, const struct upnp_action *);
+void		 upnpgen_add_variable(xmlNodePtr, const struct upnp_variable *);
+char		*upnpgen_urn(const char *, const struct upnp_nss *);
+xmlDocPtr	 upnpgen_service_xml(enum upnp_services);
+void		 upnpgen_add_service(xmlNodePtr, enum upnp_services);
+void		 upnpgen_add_device(xmlNodePtr, enum upnp_devices,
+		     unsigned int *);
+xmlDocPtr	 upnpgen_root_xml(enum upnp_devices);
+void		 upnpgen_string(const char *, size_t);
+void		 upnpgen_template(const char *, xmlDocPtr);
+void		 upnpgen_hash(const char *, const char **, const int *,
+		     unsigned int, struct upnp_hash *);
+void		 upnpgen_hashes(const char *, const char *,
+		     struct upnp_hash *, unsigned int);
+__dead void	 usage(void);
+int		 main(int, char *[]);
+
+void
+upnpgen_add_configid(xmlNodePtr node)
+{
+	xmlNewProp(node, "configId", UPNPGEN_CONFIGID);
+}
+
+void
+upnpgen_add_version(xmlNodePtr node)
+{
+	xmlNodePtr	 version;
+
+	version = xmlNewChild(node, NULL, "specVersion", NULL);
+
+	xmlNewChild(version, NULL, "major", UPNP_STRING(UPNP_VERSION_MAJOR));
+	xmlNewChild(version, NULL, "minor", UPNP_STRING(UPNP_VERSION_MINOR));
+}
+
+void
+upnpgen_add_action(xmlNodePtr node, const struct upnp_action *parent)
+{
+	xmlNodePtr			 action, arguments, argument;
+	const struct upnp_argument	*arg;
+	unsigned int			 i;
+
+	action = xmlNewChild(node, NULL, "action", NULL);
+
+	xmlNewChild(action, NULL, "name", parent->name);
+
+	if (parent->cin || parent->cout) {
+		arguments = xmlNewChild(action, NULL, "argumentList", NULL);
+
+		for (i = 0, arg = parent->in; i < parent->cin; i++, arg++) {
+			argument = xmlNewChild(arguments, NULL, "argument",
+			    NULL);
+			xmlNewChild(argument, NULL, "name", arg->name);
+			xmlNewChild(argument, NULL, "direction", "in");
+			if (arg->flags & UPNP_ARGUMENT_FLAG_RETURN)
+				xmlNewChild(argument, NULL, "retval", NULL);
+			xmlNewChild(argument, NULL, "relatedStateVariable",
+			    upnp_variable[arg->related].name);
+		}
+
+		for (i = 0, arg = parent->out; i < parent->cout; i++, arg++) {
+			argument = xmlNewChild(arguments, NULL, "argument",
+			    NULL);
+			xmlNewChild(argument, NULL, "name", arg->name);
+			xmlNewChild(argument, NULL, "direction", "out");
+			if (arg->flags & UPNP_ARGUMENT_FLAG_RETURN)
+				xmlNewChild(argument, NULL, "retval", NULL);
+			xmlNewChild(argument, NULL, "relatedStateVariable",
+			    upnp_variable[arg->related].name);
+		}
+	}
+}
+
+void
+upnpgen_add_variable(xmlNodePtr node, const struct upnp_variable *parent)
+{
+	xmlNodePtr	 variable, values, range;
+	int		 i;
+
+	variable = xmlNewChild(node, NULL, "stateVariable", NULL);
+	if (!(parent->flags & UPNP_VARIABLE_FLAG_EVENT))
+		xmlNewProp(variable, "sendEvents", "no");
+
+#if UPNP_VERSION_NUMBER >= 0x0101
+	if (parent->flags & UPNP_VARIABLE_FLAG_MULTICAST)
+		xmlNewProp(variable, "multicast", "yes");
+#endif
+
+	xmlNewChild(variable, NULL, "name", parent->name);
+	xmlNewChild(variable, NULL, "dataType",
+	    upnp_variable_type[parent->type]);
+
+#if UPNP_VERSION_NUMBER >= 0x0101
+	/* FIXME type= */
+#endif
+
+	if (parent->value)
+		xmlNewChild(variable, NULL, "defaultValue", parent->value);
+
+	if (parent->type == UPNP_VARIABLE_TYPE_STRING && parent->values) {
+		values = xmlNewChild(variable, NULL, "allowedValueList", NULL);
+		for (i = 0; parent->values[i]; i++)
+			xmlNewChild(values, NULL, "allowedValue",
+			    parent->values[i]);
+	}
+
+	if (parent->minimum && parent->maximum) {
+		range = xmlNewChild(variable, NULL, "allowedValueRange", NULL);
+		xmlNewChild(range, NULL, "minimum", parent->minimum);
+		xmlNewChild(range, NULL, "maximum", parent->maximum);
+		if (parent->step)
+			xmlNewChild(range, NULL, "step", parent->step);
+	}
+}
+
+/* The same string urn_to_string() makes of a device or service type */
+char *
+upnpgen_urn(const char *nid, const struct upnp_nss *nss)
+{
+	char	*urn;
+
+	if (asprintf(&urn, "urn:%s:%s:%s:%d", nid, upnp_type[nss->type],
+	    nss->name, nss->version) == -1)
+		err(1, "asprintf");
+
+	return (urn);
+}
+
+xmlDocPtr
+upnpgen_service_xml(enum upnp_services service)
+{
+	xmlDocPtr	 document;
+	xmlNodePtr	 scpd, actions, variables;
+	xmlNsPtr	 ns;
+	int		 i;
+
+	document = xmlNewDoc("1.0");
+	scpd = xmlNewNode(NULL, "scpd");
+	xmlDocSetRootElement(document, scpd);
+
+	/* From this point, every child node inherits the namespace */
+	ns = xmlNewNs(scpd, UPNP_SERVICE_SCHEMA_URN, NULL);
+	xmlSetNs(scpd, ns);
+
+#if UPNP_VERSION_NUMBER >= 0x0101
+	upnpgen_add_configid(scpd);
+#endif
+
+	upnpgen_add_version(scpd);
+
+	/* Actions are optional */
+	if (upnp_service[service].actions) {
+		actions = xmlNewChild(scpd, NULL, "actionList", NULL);
+		for (i = 0;
+		    upnp_service[service].actions[i] != UPNP_ACTION_EOL; i++)
+			upnpgen_add_action(actions,
+			    &upnp_action[upnp_service[service].actions[i]]);
+	}
+
+	/* Variables are mandatory */
+	variables = xmlNewChild(scpd, NULL, "serviceStateTable", NULL);
+	for (i = 0; upnp_service[service].variables[i] != UPNP_VARIABLE_EOL;
+	    i++)
+		upnpgen_add_variable(variables,
+		    &upnp_variable[upnp_service[service].variables[i]]);
+
+	return (document);
+}
+
+void
+upnpgen_add_service(xmlNodePtr node, enum upnp_services type)
+{
+	xmlNodePtr	 service;
+	char		*urn;
+
+	urn = upnpgen_urn(upnp_service[type].nid, &upnp_service[type].nss);
+
+	service = xmlNewChild(node, NULL, "service", NULL);
+
+	xmlNewChild(service, NULL, "serviceType", urn);
+	xmlNewChild(service, NULL, "serviceId", upnp_service[type].id);
+	xmlNewChild(service, NULL, "SCPDURL", upnp_service[type].scpd);
+	xmlNewChild(service, NULL, "controlURL", upnp_service[type].control);
+	xmlNewChild(service, NULL, "eventSubURL", upnp_service[type].event);
+
+	free(urn);
+}
+
+/* Devices are numbered in the order upnp_root_device() walks them, which
+ * is the order their UDNs are filled in
+ */
+void
+upnpgen_add_device(xmlNodePtr node, enum upnp_devices type,
+    unsigned int *count)
+{
+	xmlNodePtr	 device, servicelist, devicelist;
+	char		*urn, *udn;
+	int		 i;
+
+	urn = upnpgen_urn(upnp_device[type].nid, &upnp_device[type].nss);
+
+	device = xmlNewChild(node, NULL, "device", NULL);
+
+	xmlNewChild(device, NULL, "deviceType", urn);
+
+	/* FIXME */
+	xmlNewChild(device, NULL, "friendlyName", "test");
+	xmlNewChild(device, NULL, "manufacturer", "test");
+	xmlNewChild(device, NULL, "modelDescription", "test");
+	xmlNewChild(device, NULL, "modelName", "test");
+	xmlNewChild(device, NULL, "modelNumber", "test");
+	xmlNewChild(device, NULL, "modelURL", "test");
+	xmlNewChild(device, NULL, "serialNumber", "test");
+
+	if (asprintf(&udn, UPNPGEN_UDN, (*count)++) == -1)
+		err(1, "asprintf");
+	xmlNewChild(device, NULL, "UDN", udn);
+	free(udn);
+
+	/* FIXME */
+	xmlNewChild(device, NULL, "UPC", "test");
+	xmlNewChild(device, NULL, "iconList", NULL);
+
+	free(urn);
+
+	if (upnp_device[type].services) {
+		servicelist = xmlNewChild(device, NULL, "serviceList", NULL);
+		for (i = 0; upnp_device[type].services[i] != UPNP_SERVICE_EOL;
+		    i++)
+			upnpgen_add_service(servicelist,
+			    upnp_device[type].services[i]);
+	}
+
+	if (upnp_device[type].devices) {
+		devicelist = xmlNewChild(device, NULL, "deviceList", NULL);
+		for (i = 0; upnp_device[type].devices[i] != UPNP_DEVICE_EOL;
+		    i++)
+			upnpgen_add_device(devicelist,
+			    upnp_device[type].devices[i], count);
+	}
+
+	xmlNewChild(device, NULL, "presentationURL", "/");
+}
+
+xmlDocPtr
+upnpgen_root_xml(enum upnp_devices type)
+{
+	xmlDocPtr	 document;
+	xmlNodePtr	 node;
+	xmlNsPtr	 ns;
+	unsigned int	 count = 0;
+
+	document = xmlNewDoc("1.0");
+	node = xmlNewNode(NULL, "root");
+	xmlDocSetRootElement(document, node);
+
+	/* From this point, every child node inherits the namespace */
+	ns = xmlNewNs(node, UPNP_DEVICE_SCHEMA_URN, NULL);
+	xmlSetNs(node, ns);
+
+#if UPNP_VERSION_NUMBER >= 0x0101
+	upnpgen_add_configid(node);
+#endif
+
+	upnpgen_add_version(node);
+
+	upnpgen_add_device(node, type, &count);
+
+	return (document);
+}
+
+/* Print text as C string literals, one per line of the document */
+void
+upnpgen_string(const char *str, size_t len)
+{
+	unsigned char	 c;
+	int		 open = 0;
+
+	while (len--) {
+		if (!open) {
+			printf("\n\t    \"");
+			open = 1;
+		}
+
+		switch (c = *str++) {
+		case '"':
+		case '\\':
+			printf("\\%c", c);
+			break;
+		case '\n':
+			printf("\\n\"");
+			open = 0;
+			break;
+		default:
+			if (c < ' ' || c > '~')
+				printf("\\%03o", c);
+			else
+				putchar(c);
+			break;
+		}
+	}
+
+	if (open)
+		putchar('"');
+}
+
+void
+upnpgen_template(const char *name, xmlDocPtr document)
+{
+	xmlChar		*xml = NULL;
+	int		 len = 0, n;
+	const char	*p, *end, *mark;
+	unsigned int	 device;
+
+	xmlDocDumpFormatMemory(document, &xml, &len, XML_INDENT_TREE);
+	if (xml == NULL)
+		errx(1, "unable to serialize %s", name);
+	xmlFreeDoc(document);
+
+	printf("static const struct upnp_template\t%s[] = {\n", name);
+
+	for (p = (const char *)xml, end = p + len; p < end; p = mark) {
+		if ((mark = memchr(p, UPNPGEN_MARK, end - p)) == NULL)
+			mark = end;
+
+		if (mark > p) {
+			printf("\t{ UPNP_FIELD_TEXT, 0,");
+			upnpgen_string(p, mark - p);
+			printf(", %zu },\n", (size_t)(mark - p));
+		}
+
+		if (mark == end)
+			break;
+
+		n = 0;
+		if (!strncmp(mark, UPNPGEN_CONFIGID,
+		    strlen(UPNPGEN_CONFIGID))) {
+			printf("\t{ UPNP_FIELD_CONFIGID, 0, NULL, 0 },\n");
+			mark += strlen(UPNPGEN_CONFIGID);
+		} else if (sscanf(mark, UPNPGEN_UDN "%n", &device, &n) == 1 &&
+		    n > 0) {
+			printf("\t{ UPNP_FIELD_UDN, %u, NULL, 0 },\n", device);
+			mark += n;
+		} else
+			errx(1, "stray '%c' in %s", UPNPGEN_MARK, name);
+	}
+
+	printf("\t{ UPNP_FIELD_END, 0, NULL, 0 },\n};\n\n");
+
+	xmlFree(xml);
+}
+
+/* Find a table size and seed that give every key a slot to itself and
+ * print the slots
+ */
+void
+upnpgen_hash(const char *name, const char **keys, const int *values,
+    unsigned int n, struct upnp_hash *hash)
+{
+	int		*slot;
+	u_int32_t	 size, seed, h;
+	unsigned int	 i;
+
+	/* At most half full, a seed turns up quickly */
+	for (size = 1; size < n * 2; size <<= 1)
+		;
+
+	for (;;) {
+		if ((slot = reallocarray(NULL, size, sizeof(int))) == NULL)
+			err(1, "reallocarray");
+
+		for (seed = 0; seed < UPNPGEN_SEEDS; seed++) {
+			memset(slot, -1, size * sizeof(int));
+			for (i = 0; i < n; i++) {
+				h = upnp_hash(seed, keys[i],
+				    strlen(keys[i])) & (size - 1);
+				if (slot[h] != -1)
+					break;
+				slot[h] = i;
+			}
+			if (i == n)
+				break;
+		}
+
+		if (seed < UPNPGEN_SEEDS)
+			break;
+
+		free(slot);
+		size <<= 1;
+	}
+
+	printf("static const struct upnp_slot\t%s[%u] = {\n", name, size);
+	for (h = 0; h < size; h++)
+		if (slot[h] != -1)
+			printf("\t[%u] = { \"%s\", %zu, %d },\n", h,
+			    keys[slot[h]], strlen(keys[slot[h]]),
+			    values[slot[h]]);
+	printf("};\n\n");
+
+	free(slot);
+
+	hash->seed = seed;
+	hash->mask = size - 1;
+}
+
+void
+upnpgen_hashes(const char *name, const char *slots, struct upnp_hash *hash,
+    unsigned int n)
+{
+	unsigned int	 i;
+
+	printf("const struct upnp_hash\t%s[%u] = {\n", name, n);
+	for (i = 0; i < n; i++)
+		printf("\t{ %u, %u, %s_%u },\n", hash[i].seed, hash[i].mask,
+		    slots, i);
+	printf("};\n\n");
+}
+
+__dead void
+usage(void)
+{
+	extern char	*__progname;
+
+	fprintf(stderr, "usage: %s\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char		*keys[UPNPGEN_KEYS];
+	int			 values[UPNPGEN_KEYS];
+	struct upnp_hash	 type[UPNP_TYPE_MAX];
+	struct upnp_hash	 action[UPNP_SERVICE_MAX];
+	struct upnp_hash	 variable[UPNP_SERVICE_MAX];
+	char			 name[64];
+	unsigned int		 i, n;
+	int			 j;
+
+	if (argc != 1)
+		usage();
+
+	printf("/* Generated by upnpgen from the tables in upnptab.c, "
+	    "don't edit */\n\n"
+	    "#include <sys/types.h>\n\n"
+	    "#include \"igdpcpd.h\"\n"
+	    "#include \"upnp.h\"\n\n");
+
+	/* Description documents */
+	for (i = 0; i < UPNP_DEVICE_MAX; i++) {
+		snprintf(name, sizeof(name), "upnp_root_template_%u", i);
+		upnpgen_template(name, upnpgen_root_xml(i));
+	}
+	printf("const struct upnp_template\t*upnp_root_template"
+	    "[UPNP_DEVICE_MAX] = {\n");
+	for (i = 0; i < UPNP_DEVICE_MAX; i++)
+		printf("\tupnp_root_template_%u,\n", i);
+	printf("};\n\n");
+
+	for (i = 0; i < UPNP_SERVICE_MAX; i++) {
+		snprintf(name, sizeof(name), "upnp_scpd_template_%u", i);
+		upnpgen_template(name, upnpgen_service_xml(i));
+	}
+	printf("const struct upnp_template\t*upnp_scpd_template"
+	    "[UPNP_SERVICE_MAX] = {\n");
+	for (i = 0; i < UPNP_SERVICE_MAX; i++)
+		printf("\tupnp_scpd_template_%u,\n", i);
+	printf("};\n\n");
+
+	/* Device and service types by name, the NSS less its version */
+	for (n = 0; n < UPNP_DEVICE_MAX; n++) {
+		keys[n] = upnp_device[n].nss.name;
+		values[n] = n;
+	}
+	upnpgen_hash("upnp_type_slots_0", keys, values, n, &type[0]);
+	for (n = 0; n < UPNP_SERVICE_MAX; n++) {
+		keys[n] = upnp_service[n].nss.name;
+		values[n] = n;
+	}
+	upnpgen_hash("upnp_type_slots_1", keys, values, n, &type[1]);
+	upnpgen_hashes("upnp_type_hash", "upnp_type_slots", type,
+	    UPNP_TYPE_MAX);
+
+	/* Actions and variables of each service by name */
+	for (i = 0; i < UPNP_SERVICE_MAX; i++) {
+		n = 0;
+		if (upnp_service[i].actions)
+			for (j = 0; upnp_service[i].actions[j] !=
+			    UPNP_ACTION_EOL; j++, n++) {
+				keys[n] = upnp_action[upnp_service[i]
+				    .actions[j]].name;
+				values[n] = upnp_service[i].actions[j];
+			}
+		snprintf(name, sizeof(name), "upnp_action_slots_%u", i);
+		upnpgen_hash(name, keys, values, n, &action[i]);
+	}
+	upnpgen_hashes("upnp_action_hash", "upnp_action_slots",
+	    action, UPNP_SERVICE_MAX);
+
+	for (i = 0; i < UPNP_SERVICE_MAX; i++) {
+		for (n = 0; upnp_service[i].variables[n] != UPNP_VARIABLE_EOL;
+		    n++) {
+			keys[n] = upnp_variable[upnp_service[i]
+			    .variables[n]].name;
+			values[n] = upnp_service[i].variables[n];
+		}
+		snprintf(name, sizeof(name), "upnp_variable_slots_%u", i);
+		upnpgen_hash(name, keys, values, n, &variable[i]);
+	}
+	upnpgen_hashes("upnp_variable_hash", "upnp_variable_slots",
+	    variable, UPNP_SERVICE_MAX);
+
+	if (fflush(stdout) == EOF || ferror(stdout))
+		err(1, "stdout");
+
+	return (0);
+}
@@ -0,0 +1,895 @@
+/*
+ * Copyright (c) 2014 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* The UPnP device, service, action and variable tables. The daemon works
+ * from them at runtime and upnpgen builds the description documents and
+ * lookup tables from them at build time, so this file is linked into both
+ */
+
+#include <sys/types.h>
+
+#include "igdpcpd.h"
+#include "upnp.h"
+
+/* Used for parsing and generating URN NSS */
+const char	*upnp_type[UPNP_TYPE_MAX] = {
+	UPNP_DEVICE_TYPE,
+	UPNP_SERVICE_TYPE,
+};
+
+/* UPnP variable types */
+const char	*upnp_variable_type[UPNP_VARIABLE_TYPE_MAX] = {
+	"ui1",
+	"ui2",
+	"ui4",
+	"i1",
+	"i2",
+	"i4",
+	"int",
+	"r4",
+	"r8",
+	"number",
+	"fixed.14.4",
+	"float",
+	"char",
+	"string",
+	"date",
+	"dateTime",
+	"dateTime.tz",
+	"time",
+	"time.tz",
+	"boolean",
+	"bin.base64",
+	"bin.hex",
+	"uri",
+	"uuid",
+};
+
+/* UPnP state variables */
+const struct upnp_variable	 upnp_variable[UPNP_VARIABLE_MAX] = {
+	/* WANCommonInterfaceConfig */
+	{
+		"WANAccessType",
+		UPNP_VARIABLE_TYPE_STRING,
+		0,
+		(char *[]){
+			"DSL",
+			"POTS",
+			"Cable",
+			"Ethernet",
+			NULL,
+		},
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"Layer1UpstreamMaxBitRate",
+		UPNP_VARIABLE_TYPE_UI4,
+		0,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"Layer1DownstreamMaxBitRate",
+		UPNP_VARIABLE_TYPE_UI4,
+		0,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"PhysicalLinkStatus",
+		UPNP_VARIABLE_TYPE_STRING,
+		UPNP_VARIABLE_FLAG_EVENT,
+		(char *[]){
+			"Up",
+			"Down",
+			NULL,
+		},
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	/* WANIPConnection */
+	{
+		"ConnectionType",
+		UPNP_VARIABLE_TYPE_STRING,
+		0,
+		(char *[]){
+			"Unconfigured",
+			"IP_Routed",
+			"IP_Bridged",
+			NULL,
+		},
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"PossibleConnectionTypes",
+		UPNP_VARIABLE_TYPE_STRING,
+		UPNP_VARIABLE_FLAG_EVENT,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"ConnectionStatus",
+		UPNP_VARIABLE_TYPE_STRING,
+		UPNP_VARIABLE_FLAG_EVENT,
+		(char *[]){
+			"Unconfigured",
+			"Connected",
+			"Disconnected",
+			NULL,
+		},
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"Uptime",
+		UPNP_VARIABLE_TYPE_UI4,
+		0,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"LastConnectionError",
+		UPNP_VARIABLE_TYPE_STRING,
+		0,
+		(char *[]){
+			"ERROR_NONE",
+			NULL,
+		},
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"RSIPAvailable",
+		UPNP_VARIABLE_TYPE_BOOLEAN,
+		0,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"NATEnabled",
+		UPNP_VARIABLE_TYPE_BOOLEAN,
+		0,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"ExternalIPAddress",
+		UPNP_VARIABLE_TYPE_STRING,
+		UPNP_VARIABLE_FLAG_EVENT|UPNP_VARIABLE_FLAG_MULTICAST,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"PortMappingNumberOfEntries",
+		UPNP_VARIABLE_TYPE_UI2,
+		UPNP_VARIABLE_FLAG_EVENT,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"PortMappingEnabled",
+		UPNP_VARIABLE_TYPE_BOOLEAN,
+		0,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"PortMappingLeaseDuration",
+		UPNP_VARIABLE_TYPE_UI4,
+		0,
+		NULL,
+		"3600", /* XXX */
+		"0",
+		"604800",
+		NULL,
+	},
+	{
+		"RemoteHost",
+		UPNP_VARIABLE_TYPE_STRING,
+		0,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"ExternalPort",
+		UPNP_VARIABLE_TYPE_UI2,
+		0,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"InternalPort",
+		UPNP_VARIABLE_TYPE_UI2,
+		0,
+		NULL,
+		NULL,
+		"1",
+		"65535",
+		NULL,
+	},
+	{
+		"PortMappingProtocol",
+		UPNP_VARIABLE_TYPE_STRING,
+		0,
+		(char *[]){
+			"TCP",
+			"UDP",
+			NULL,
+		},
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"InternalClient",
+		UPNP_VARIABLE_TYPE_STRING,
+		0,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"PortMappingDescription",
+		UPNP_VARIABLE_TYPE_STRING,
+		0,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"SystemUpdateID",
+		UPNP_VARIABLE_TYPE_UI4,
+		UPNP_VARIABLE_FLAG_EVENT|UPNP_VARIABLE_FLAG_MULTICAST,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"A_ARG_TYPE_Manage",
+		UPNP_VARIABLE_TYPE_BOOLEAN,
+		0,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+	{
+		"A_ARG_TYPE_PortListing",
+		UPNP_VARIABLE_TYPE_STRING,
+		0,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+	},
+};
+
+/* UPnP actions */
+const struct upnp_action	 upnp_action[UPNP_ACTION_MAX] = {
+	/* WANCommonInterfaceConfig */
+	{
+		"GetCommonLinkProperties",
+		1, 0, 4,
+		NULL,
+		(struct upnp_argument[]){
+			{
+				"NewWANAccessType",
+				0,
+				UPNP_VARIABLE_WAN_ACCESS_TYPE,
+			},
+			{
+				"NewLayer1UpstreamMaxBitRate",
+				0,
+				UPNP_VARIABLE_LAYER_1_UPSTREAM_MAX_BIT_RATE,
+			},
+			{
+				"NewLayer1DownstreamMaxBitRate",
+				0,
+				UPNP_VARIABLE_LAYER_1_DOWNSTREAM_MAX_BIT_RATE,
+			},
+			{
+				"NewPhysicalLinkStatus",
+				0,
+				UPNP_VARIABLE_PHYSICAL_LINK_STATUS,
+			},
+		},
+	},
+	/* WANIPConnection */
+	{
+		"SetConnectionType",
+		1, 1, 0,
+		(struct upnp_argument[]){
+			{
+				"NewConnectionType",
+				0,
+				UPNP_VARIABLE_CONNECTION_TYPE,
+			},
+		},
+		NULL,
+	},
+	{
+		"GetConnectionTypeInfo",
+		1, 0, 2,
+		NULL,
+		(struct upnp_argument[]){
+			{
+				"NewConnectionType",
+				0,
+				UPNP_VARIABLE_CONNECTION_TYPE,
+			},
+			{
+				"NewPossibleConnectionTypes",
+				0,
+				UPNP_VARIABLE_POSSIBLE_CONNECTION_TYPES,
+			},
+		},
+	},
+	{
+		"RequestConnection",
+		1, 0, 0,
+		NULL,
+		NULL,
+	},
+	{
+		"ForceTermination",
+		1, 0, 0,
+		NULL,
+		NULL,
+	},
+	{
+		"GetStatusInfo",
+		1, 0, 3,
+		NULL,
+		(struct upnp_argument[]){
+			{
+				"NewConnectionStatus",
+				0,
+				UPNP_VARIABLE_CONNECTION_STATUS,
+			},
+			{
+				"NewLastConnectionError",
+				0,
+				UPNP_VARIABLE_LAST_CONNECTION_ERROR,
+			},
+			{
+				"NewUptime",
+				0,
+				UPNP_VARIABLE_UPTIME,
+			},
+		},
+	},
+	{
+		"GetNATRSIPStatus",
+		1, 0, 2,
+		NULL,
+		(struct upnp_argument[]){
+			{
+				"NewRSIPAvailable",
+				0,
+				UPNP_VARIABLE_RSIP_AVAILABLE,
+			},
+			{
+				"NewNATEnabled",
+				0,
+				UPNP_VARIABLE_NAT_ENABLED,
+			},
+		},
+	},
+	{
+		"GetGenericPortMappingEntry",
+		1, 1, 8,
+		(struct upnp_argument[]){
+			{
+				"NewPortMappingIndex",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_NUMBER_OF_ENTRIES,
+			},
+		},
+		(struct upnp_argument[]){
+			{
+				"NewRemoteHost",
+				0,
+				UPNP_VARIABLE_REMOTE_HOST,
+			},
+			{
+				"NewExternalPort",
+				0,
+				UPNP_VARIABLE_EXTERNAL_PORT,
+			},
+			{
+				"NewProtocol",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
+			},
+			{
+				"NewInternalPort",
+				0,
+				UPNP_VARIABLE_INTERNAL_PORT,
+			},
+			{
+				"NewInternalClient",
+				0,
+				UPNP_VARIABLE_INTERNAL_CLIENT,
+			},
+			{
+				"NewEnabled",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_ENABLED,
+			},
+			{
+				"NewPortMappingDescription",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_DESCRIPTION,
+			},
+			{
+				"NewLeaseDuration",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_LEASE_DURATION,
+			},
+		},
+	},
+	{
+		"GetSpecificPortMappingEntry",
+		1, 3, 5,
+		(struct upnp_argument[]){
+			{
+				"NewRemoteHost",
+				0,
+				UPNP_VARIABLE_REMOTE_HOST,
+			},
+			{
+				"NewExternalPort",
+				0,
+				UPNP_VARIABLE_EXTERNAL_PORT,
+			},
+			{
+				"NewProtocol",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
+			},
+		},
+		(struct upnp_argument[]){
+			{
+				"NewInternalPort",
+				0,
+				UPNP_VARIABLE_INTERNAL_PORT,
+			},
+			{
+				"NewInternalClient",
+				0,
+				UPNP_VARIABLE_INTERNAL_CLIENT,
+			},
+			{
+				"NewEnabled",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_ENABLED,
+			},
+			{
+				"NewPortMappingDescription",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_DESCRIPTION,
+			},
+			{
+				"NewLeaseDuration",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_LEASE_DURATION,
+			},
+		},
+	},
+	{
+		"AddPortMapping",
+		1, 8, 0,
+		(struct upnp_argument[]){
+			{
+				"NewRemoteHost",
+				0,
+				UPNP_VARIABLE_REMOTE_HOST,
+			},
+			{
+				"NewExternalPort",
+				0,
+				UPNP_VARIABLE_EXTERNAL_PORT,
+			},
+			{
+				"NewProtocol",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
+			},
+			{
+				"NewInternalPort",
+				0,
+				UPNP_VARIABLE_INTERNAL_PORT,
+			},
+			{
+				"NewInternalClient",
+				0,
+				UPNP_VARIABLE_INTERNAL_CLIENT,
+			},
+			{
+				"NewEnabled",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_ENABLED,
+			},
+			{
+				"NewPortMappingDescription",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_DESCRIPTION,
+			},
+			{
+				"NewLeaseDuration",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_LEASE_DURATION,
+			},
+		},
+		NULL,
+	},
+	{
+		"AddAnyPortMapping",
+		2, 8, 1,
+		(struct upnp_argument[]){
+			{
+				"NewRemoteHost",
+				0,
+				UPNP_VARIABLE_REMOTE_HOST,
+			},
+			{
+				"NewExternalPort",
+				0,
+				UPNP_VARIABLE_EXTERNAL_PORT,
+			},
+			{
+				"NewProtocol",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
+			},
+			{
+				"NewInternalPort",
+				0,
+				UPNP_VARIABLE_INTERNAL_PORT,
+			},
+			{
+				"NewInternalClient",
+				0,
+				UPNP_VARIABLE_INTERNAL_CLIENT,
+			},
+			{
+				"NewEnabled",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_ENABLED,
+			},
+			{
+				"NewPortMappingDescription",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_DESCRIPTION,
+			},
+			{
+				"NewLeaseDuration",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_LEASE_DURATION,
+			},
+		},
+		(struct upnp_argument[]){
+			{
+				"NewReservedPort",
+				0,
+				UPNP_VARIABLE_EXTERNAL_PORT,
+			},
+		},
+	},
+	{
+		"DeletePortMapping",
+		1, 3, 0,
+		(struct upnp_argument[]){
+			{
+				"NewRemoteHost",
+				0,
+				UPNP_VARIABLE_REMOTE_HOST,
+			},
+			{
+				"NewExternalPort",
+				0,
+				UPNP_VARIABLE_EXTERNAL_PORT,
+			},
+			{
+				"NewProtocol",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
+			},
+		},
+		NULL,
+	},
+	{
+		"DeletePortMappingRange",
+		2, 4, 0,
+		(struct upnp_argument[]){
+			{
+				"NewStartPort",
+				0,
+				UPNP_VARIABLE_EXTERNAL_PORT,
+			},
+			{
+				"NewEndPort",
+				0,
+				UPNP_VARIABLE_EXTERNAL_PORT,
+			},
+			{
+				"NewProtocol",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
+			},
+			{
+				"NewManage",
+				0,
+				UPNP_VARIABLE_A_ARG_TYPE_MANAGE,
+			},
+		},
+		NULL,
+	},
+	{
+		"GetExternalIPAddress",
+		1, 0, 1,
+		NULL,
+		(struct upnp_argument[]){
+			{
+				"NewExternalIPAddress",
+				0,
+				UPNP_VARIABLE_EXTERNAL_IP_ADDRESS,
+			},
+		},
+	},
+	{
+		"GetListOfPortMappings",
+		2, 5, 1,
+		(struct upnp_argument[]){
+			{
+				"NewStartPort",
+				0,
+				UPNP_VARIABLE_EXTERNAL_PORT,
+			},
+			{
+				"NewEndPort",
+				0,
+				UPNP_VARIABLE_EXTERNAL_PORT,
+			},
+			{
+				"NewProtocol",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
+			},
+			{
+				"NewManage",
+				0,
+				UPNP_VARIABLE_A_ARG_TYPE_MANAGE,
+			},
+			{
+				"NewNumberOfPorts",
+				0,
+				UPNP_VARIABLE_PORT_MAPPING_NUMBER_OF_ENTRIES,
+			},
+		},
+		(struct upnp_argument[]){
+			{
+				"NewPortListing",
+				0,
+				UPNP_VARIABLE_A_ARG_TYPE_PORT_LISTING,
+			},
+		},
+	},
+};
+
+/* UPnP services */
+const struct upnp_service	 upnp_service[UPNP_SERVICE_MAX] = {
+	{
+		UPNP_SCHEMA_NID,
+		{
+			UPNP_TYPE_SERVICE,
+			"WANCommonInterfaceConfig",
+			UPNP_VERSION_WAN_COMMON_INTERFACE_CONFIG,
+		},
+		UPNP_SERVICE_ID_URN(UPNP_NID, "WANCommonIFC", 1),
+		"/describe/WANCommonInterfaceConfig.xml",
+		"/control/WANCommonInterfaceConfig",
+		"/event/WANCommonInterfaceConfig",
+		(enum upnp_actions[]){
+			UPNP_ACTION_GET_COMMON_LINK_PROPERTIES,
+			UPNP_ACTION_EOL,
+		},
+		(enum upnp_variables[]){
+			UPNP_VARIABLE_WAN_ACCESS_TYPE,
+			UPNP_VARIABLE_LAYER_1_UPSTREAM_MAX_BIT_RATE,
+			UPNP_VARIABLE_LAYER_1_DOWNSTREAM_MAX_BIT_RATE,
+			UPNP_VARIABLE_PHYSICAL_LINK_STATUS,
+			UPNP_VARIABLE_EOL,
+		},
+	},
+	{
+		UPNP_SCHEMA_NID,
+		{
+			UPNP_TYPE_SERVICE,
+			"WANIPConnection",
+			UPNP_VERSION_WAN_IP_CONNECTION,
+		},
+		UPNP_SERVICE_ID_URN(UPNP_NID, "WANIPConn", 1),
+		"/describe/WANIPConnection.xml",
+		"/control/WANIPConnection",
+		"/event/WANIPConnection",
+		(enum upnp_actions[]){
+			UPNP_ACTION_SET_CONNECTION_TYPE,
+			UPNP_ACTION_GET_CONNECTION_TYPE_INFO,
+			UPNP_ACTION_REQUEST_CONNECTION,
+			UPNP_ACTION_FORCE_TERMINATION,
+			UPNP_ACTION_GET_STATUS_INFO,
+			UPNP_ACTION_GET_NAT_RSIP_STATUS,
+			UPNP_ACTION_GET_GENERIC_PORT_MAPPING_ENTRY,
+			UPNP_ACTION_GET_SPECIFIC_PORT_MAPPING_ENTRY,
+			UPNP_ACTION_ADD_PORT_MAPPING,
+#if UPNP_VERSION_WAN_IP_CONNECTION >= 2
+			UPNP_ACTION_ADD_ANY_PORT_MAPPING,
+#endif
+			UPNP_ACTION_DELETE_PORT_MAPPING,
+#if UPNP_VERSION_WAN_IP_CONNECTION >= 2
+			UPNP_ACTION_DELETE_PORT_MAPPING_RANGE,
+#endif
+			UPNP_ACTION_GET_EXTERNAL_IP_ADDRESS,
+#if UPNP_VERSION_WAN_IP_CONNECTION >= 2
+			UPNP_ACTION_GET_LIST_OF_PORT_MAPPINGS,
+#endif
+			UPNP_ACTION_EOL,
+		},
+		(enum upnp_variables[]){
+			UPNP_VARIABLE_CONNECTION_TYPE,
+			UPNP_VARIABLE_POSSIBLE_CONNECTION_TYPES,
+			UPNP_VARIABLE_CONNECTION_STATUS,
+			UPNP_VARIABLE_UPTIME,
+			UPNP_VARIABLE_LAST_CONNECTION_ERROR,
+			UPNP_VARIABLE_RSIP_AVAILABLE,
+			UPNP_VARIABLE_NAT_ENABLED,
+			UPNP_VARIABLE_EXTERNAL_IP_ADDRESS,
+			UPNP_VARIABLE_PORT_MAPPING_NUMBER_OF_ENTRIES,
+			UPNP_VARIABLE_PORT_MAPPING_ENABLED,
+			UPNP_VARIABLE_PORT_MAPPING_LEASE_DURATION,
+			UPNP_VARIABLE_REMOTE_HOST,
+			UPNP_VARIABLE_EXTERNAL_PORT,
+			UPNP_VARIABLE_INTERNAL_PORT,
+			UPNP_VARIABLE_PORT_MAPPING_PROTOCOL,
+			UPNP_VARIABLE_INTERNAL_CLIENT,
+			UPNP_VARIABLE_PORT_MAPPING_DESCRIPTION,
+#if UPNP_VERSION_WAN_IP_CONNECTION >= 2
+			UPNP_VARIABLE_SYSTEM_UPDATE_ID,
+			UPNP_VARIABLE_A_ARG_TYPE_MANAGE,
+			UPNP_VARIABLE_A_ARG_TYPE_PORT_LISTING,
+#endif
+			UPNP_VARIABLE_EOL,
+		},
+	},
+};
+
+/* UPnP devices */
+const struct upnp_device	upnp_device[UPNP_DEVICE_MAX] = {
+	{
+		UPNP_SCHEMA_NID,
+		{
+			UPNP_TYPE_DEVICE,
+			"InternetGatewayDevice",
+			UPNP_VERSION_INTERNET_GATEWAY_DEVICE,
+		},
+		NULL,
+		(enum upnp_devices[]){
+			UPNP_DEVICE_WAN_DEVICE,
+			UPNP_DEVICE_EOL,
+		},
+	},
+	{
+		UPNP_SCHEMA_NID,
+		{
+			UPNP_TYPE_DEVICE,
+			"WANDevice",
+			UPNP_VERSION_WAN_DEVICE,
+		},
+		(enum upnp_services[]){
+			UPNP_SERVICE_WAN_COMMON_INTERFACE_CONFIG,
+			UPNP_SERVICE_EOL,
+		},
+		(enum upnp_devices[]){
+			UPNP_DEVICE_WAN_CONNECTION_DEVICE,
+			UPNP_DEVICE_EOL,
+		},
+	},
+	{
+		UPNP_SCHEMA_NID,
+		{
+			UPNP_TYPE_DEVICE,
+			"WANConnectionDevice",
+			UPNP_VERSION_WAN_CONNECTION_DEVICE,
+		},
+		(enum upnp_services[]){
+			UPNP_SERVICE_WAN_IP_CONNECTION,
+			UPNP_SERVICE_EOL,
+		},
+		NULL,
+	},
+};
+
+/* FNV-1a, seeded so upnpgen can look for a seed that doesn't collide. The
+ * multiply only carries upwards, so the high half is folded in before the
+ * table size masks off the low bits
+ */
+u_int32_t
+upnp_hash(u_int32_t seed, const char *str, size_t len)
+{
+	u_int32_t	 h = 2166136261U ^ seed;
+
+	while (len--) {
+		h ^= (unsigned char)*str++;
+		h *= 16777619;
+	}
+
+	return (h ^ (h >> 16));
+}
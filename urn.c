@@ -14,6 +14,9 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/types.h>
+#include <sys/queue.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,41 +24,252 @@
 
 #include "igdpcpd.h"
 
-int	 isother(int);
-char	*urn_percent_encode(char *);
-char	*urn_percent_decode(char *);
+/* Interned strings. The identifiers a client can ask for are all known
+ * once the device tree is built, so they are interned then, and anything
+ * parsed later is only looked up. That way nothing a client sends can
+ * make the table grow
+ */
+struct urn_atom {
+	LIST_ENTRY(urn_atom)	 entry;
+	u_int32_t		 id;
+	size_t			 len;
+	char			 str[];
+};
 
-/* Allowed plain characters in NSS as well as those accepted by isalnum() */
-int
-isother(int c)
+LIST_HEAD(urn_atoms, urn_atom);
+
+#define	URN_ATOM_BUCKETS	 64
+
+struct urn_atoms	 urn_atoms[URN_ATOM_BUCKETS];
+struct urn_atom		**urn_atom_table;
+u_int32_t		 urn_atom_count;
+
+char		*urn_percent_encode(char *);
+char		*urn_percent_decode(char *);
+u_int32_t	 urn_atom_hash(const char *, size_t);
+struct urn_atom	*urn_atom_find(const char *, size_t);
+
+/* FNV-1a */
+u_int32_t
+urn_atom_hash(const char *str, size_t len)
 {
-	if ((c >= '\'' && c <= '.') || c == '!' || c == '$' || c == ':' ||
-	    c == ';' || c == '=' || c == '@' || c == '_')
-		return (1);
+	u_int32_t	 hash = 2166136261U;
 
-	return (0);
+	while (len--) {
+		hash ^= (u_int8_t)*str++;
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
+struct urn_atom *
+urn_atom_find(const char *str, size_t len)
+{
+	struct urn_atom	*ua;
+
+	LIST_FOREACH(ua, &urn_atoms[urn_atom_hash(str, len) % URN_ATOM_BUCKETS],
+	    entry)
+		if (ua->len == len && memcmp(ua->str, str, len) == 0)
+			return (ua);
+
+	return (NULL);
+}
+
+/* Return the atom for a string, adding it if it hasn't been seen */
+u_int32_t
+urn_intern(const char *str)
+{
+	struct urn_atom	*ua, **table;
+	size_t		 len = strlen(str);
+
+	if ((ua = urn_atom_find(str, len)) != NULL)
+		return (ua->id);
+
+	if ((ua = calloc(1, sizeof(struct urn_atom) + len + 1)) == NULL ||
+	    (table = reallocarray(urn_atom_table, urn_atom_count + 1,
+	    sizeof(struct urn_atom *))) == NULL)
+		fatal("urn_intern");
+
+	ua->id = ++urn_atom_count;
+	ua->len = len;
+	memcpy(ua->str, str, len + 1);
+
+	urn_atom_table = table;
+	urn_atom_table[ua->id - 1] = ua;
+	LIST_INSERT_HEAD(&urn_atoms[urn_atom_hash(str, len) % URN_ATOM_BUCKETS],
+	    ua, entry);
+
+	return (ua->id);
+}
+
+/* Return the atom for a string, URN_ATOM_NONE if it was never interned */
+u_int32_t
+urn_atom(const char *str, size_t len)
+{
+	struct urn_atom	*ua;
+
+	if ((ua = urn_atom_find(str, len)) == NULL)
+		return (URN_ATOM_NONE);
+
+	return (ua->id);
+}
+
+const char *
+urn_atom_string(u_int32_t id)
+{
+	if (id == URN_ATOM_NONE || id > urn_atom_count)
+		return (NULL);
+
+	return (urn_atom_table[id - 1]->str);
+}
+
+/* Characters that stand for themselves in an NSS, those accepted by
+ * isalnum() and the "other" characters of RFC 2141 section 2.2
+ */
+const u_int8_t	 urn_plain[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 1, 0, 0, 1, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 0,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 0,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+#define	XX	 0xff
+
+/* Value of each hex digit, XX for anything else */
+const u_int8_t	 urn_hex[256] = {
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, XX, XX, XX, XX, XX, XX,
+	XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+};
+
+#undef	XX
+
+const char	 urn_digits[] = "0123456789abcdef";
+
+/* Encode len bytes as per the rules in section 2.2 of RFC 2141 into a
+ * buffer of size bytes, which is always NUL-terminated. Returns the length
+ * of the result, -1 if it didn't fit
+ */
+ssize_t
+urn_encode(const char *in, size_t len, char *out, size_t size)
+{
+	const u_int8_t	*p = (const u_int8_t *)in, *end = p + len, *q;
+	size_t		 o = 0, run;
+
+	if (size == 0)
+		return (-1);
+
+	while (p < end) {
+		/* Plain characters are copied a run at a time */
+		for (q = p; q < end && urn_plain[*q]; q++)
+			;
+		if ((run = q - p) > 0) {
+			if (run >= size - o)
+				return (-1);
+			memcpy(out + o, p, run);
+			o += run;
+		}
+
+		if (q == end)
+			break;
+
+		if (3 >= size - o)
+			return (-1);
+		out[o++] = '%';
+		out[o++] = urn_digits[*q >> 4];
+		out[o++] = urn_digits[*q & 0x0f];
+		p = q + 1;
+	}
+
+	out[o] = '\0';
+
+	return (o);
+}
+
+/* Decode len bytes as per the rules in section 2.2 of RFC 2141 into a
+ * buffer of size bytes, which is always NUL-terminated. Returns the length
+ * of the result, -1 if an escape is malformed or it didn't fit
+ */
+ssize_t
+urn_decode(const char *in, size_t len, char *out, size_t size)
+{
+	const char	*p = in, *end = in + len, *q;
+	size_t		 o = 0, run;
+	u_int8_t	 hi, lo;
+
+	if (size == 0)
+		return (-1);
+
+	while (p < end) {
+		/* Everything up to the next escape is copied as it is */
+		if ((q = memchr(p, '%', end - p)) == NULL)
+			q = end;
+		if ((run = q - p) > 0) {
+			if (run >= size - o)
+				return (-1);
+			memcpy(out + o, p, run);
+			o += run;
+		}
+
+		if (q == end)
+			break;
+
+		if (end - q < 3 ||
+		    (hi = urn_hex[(u_int8_t)q[1]]) > 0x0f ||
+		    (lo = urn_hex[(u_int8_t)q[2]]) > 0x0f ||
+		    1 >= size - o)
+			return (-1);
+		out[o++] = (hi << 4) | lo;
+		p = q + 3;
+	}
+
+	out[o] = '\0';
+
+	return (o);
 }
 
 /* Encode a string as per the rules in section 2.2 of RFC 2141 */
 char *
 urn_percent_encode(char *in)
 {
-	char	*out, *p = in, *q;
+	size_t	 len = strlen(in);
+	char	*out;
 
 	/* The worst possible case is every character gets replaced with %xx
 	 * so the string grows to be three times longer
 	 */
-	if ((q = out = calloc((strlen(in) * 3) + 1, sizeof(char))) == NULL)
+	if ((out = calloc((len * 3) + 1, sizeof(char))) == NULL)
 		return (NULL);
 
-	while (*p) {
-		if (isalnum(*p) || isother(*p))
-			*q++ = *p;
-		else {
-			snprintf(q, 4, "%%%02x", *p);
-			q += 3;
-		}
-		p++;
+	if (urn_encode(in, len, out, (len * 3) + 1) == -1) {
+		free(out);
+		return (NULL);
 	}
 
 	return (out);
@@ -65,23 +279,15 @@ urn_percent_encode(char *in)
 char *
 urn_percent_decode(char *in)
 {
-	char	*out, *p = in, *q;
+	size_t	 len = strlen(in);
+	char	*out;
 
-	if ((q = out = calloc(strlen(in) + 1, sizeof(char))) == NULL)
+	if ((out = calloc(len + 1, sizeof(char))) == NULL)
 		return (NULL);
 
-	while (*p) {
-		if (*p == '%') {
-			if (strlen(p) < 3 || !isxdigit(p[1]) ||
-			    !isxdigit(p[2]) ||
-			    sscanf(p, "%%%2hhx", q++) != 1) {
-				free(out);
-				return (NULL);
-			}
-			p += 2;
-		} else
-			*q++ = *p;
-		p++;
+	if (urn_decode(in, len, out, len + 1) == -1) {
+		free(out);
+		return (NULL);
 	}
 
 	return (out);
@@ -91,21 +297,25 @@ urn_percent_decode(char *in)
 char *
 urn_to_string(struct urn *urn)
 {
-	size_t	 len;
-	char	*str, *nss;
+	size_t	 len, nid = strlen(urn->nid), nss = strlen(urn->nss);
+	char	*str;
 
-	/* Create %-encoded version of the NSS */
-	if ((nss = urn_percent_encode(urn->nss)) == NULL)
+	/* The %-encoded NSS is written straight after "urn:" and the NID,
+	 * with room for it to be three times longer at worst
+	 */
+	len = 4 + nid + 1 + (nss * 3) + 1;
+	if ((str = calloc(len, sizeof(char))) == NULL)
 		return (NULL);
 
-	len = snprintf(NULL, 0, "urn:%s:%s", urn->nid, nss);
-	if ((str = calloc(len + 1, sizeof(char))) == NULL) {
-		free(nss);
+	memcpy(str, "urn:", 4);
+	memcpy(str + 4, urn->nid, nid);
+	str[4 + nid] = ':';
+
+	if (urn_encode(urn->nss, nss, str + 4 + nid + 1,
+	    len - (4 + nid + 1)) == -1) {
+		free(str);
 		return (NULL);
 	}
-	snprintf(str, len + 1, "urn:%s:%s", urn->nid, nss);
-
-	free(nss);
 
 	return (str);
 }
@@ -139,6 +349,7 @@ urn_from_string(char *str)
 		return (NULL);
 	}
 	strncpy(urn->nid, str, p - str);
+	urn->atom = urn_atom(urn->nid, p - str);
 
 	p++;
 
@@ -153,6 +364,60 @@ urn_from_string(char *str)
 	return (urn);
 }
 
+/* Parse a URN in place. The NSS is left %-encoded as most are never
+ * looked at, urn_view_nss() decodes it when it is
+ */
+int
+urn_view_from_string(const char *str, size_t len, struct urn_view *uv)
+{
+	const char	*p, *end = str + len;
+
+	if (len < 4 || strncasecmp(str, "urn:", 4))
+		return (-1);
+	str += 4;
+
+	/* First character must be one of A-Z, a-z or 0-9 */
+	if (str == end || !isalnum((unsigned char)*str))
+		return (-1);
+
+	p = str;
+	while (p < end && (isalnum((unsigned char)*p) || *p == '-'))
+		p++;
+	if (p == end || *p != ':' ||
+	    (p - str == 3 && !strncasecmp(str, "urn", 3)) || p + 1 == end)
+		return (-1);
+
+	uv->nid = str;
+	uv->nid_len = p - str;
+	uv->nss = p + 1;
+	uv->nss_len = end - (p + 1);
+	uv->atom = urn_atom(uv->nid, uv->nid_len);
+
+	return (0);
+}
+
+/* Return the decoded NSS of a view and its length. Without any escapes
+ * that is the NSS where it lies, otherwise it is decoded into buf.
+ * Returns NULL if an escape is malformed or buf is too small
+ */
+const char *
+urn_view_nss(struct urn_view *uv, char *buf, size_t size, size_t *len)
+{
+	ssize_t	 n;
+
+	if (memchr(uv->nss, '%', uv->nss_len) == NULL) {
+		*len = uv->nss_len;
+		return (uv->nss);
+	}
+
+	if ((n = urn_decode(uv->nss, uv->nss_len, buf, size)) == -1)
+		return (NULL);
+
+	*len = n;
+
+	return (buf);
+}
+
 /* Free a URN structure */
 void
 urn_free(struct urn *urn)